@@ -0,0 +1,82 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The XCurrency developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Benchmark block propagation across a line of four nodes, once with
+# compact blocks and once with -compactblocks=0. For every block the
+# nodes first share a mempool of fresh transactions, then node0 mines
+# and the time until node3 has the new tip is recorded. Also checks that
+# the compact blocks were rebuilt from the mempool.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+import time
+
+class CompactBlocksTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--blocks", dest="blocks", default=10, type="int",
+                          help="Blocks mined in each mode (default: %default)")
+        parser.add_option("--txs", dest="txs", default=20, type="int",
+                          help="Transactions in each block (default: %default)")
+
+    def setup_nodes(self):
+        return start_nodes(4, self.options.tmpdir, [["-debug=cmpctblock"]] * 4)
+
+    def restart_nodes(self, extra_args):
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.nodes = start_nodes(4, self.options.tmpdir, [["-debug=cmpctblock"] + extra_args] * 4)
+        connect_nodes_bi(self.nodes, 0, 1)
+        connect_nodes_bi(self.nodes, 1, 2)
+        connect_nodes_bi(self.nodes, 2, 3)
+        self.is_network_split = False
+        self.sync_all()
+
+    def count_reconstructed(self, n):
+        with open(log_filename(self.options.tmpdir, n, "debug.log")) as f:
+            return sum(1 for line in f if "Successfully reconstructed block" in line)
+
+    def measure(self, label):
+        # One block first, so that every node asks the peer it came from to announce with cmpctblock
+        self.nodes[0].setgenerate(True, 1)
+        self.sync_all()
+
+        bytes_before = self.nodes[3].getnettotals()['totalbytesrecv']
+        times = []
+        for i in range(self.options.blocks):
+            for j in range(self.options.txs):
+                self.nodes[j % 4].sendtoaddress(self.nodes[(j + 1) % 4].getnewaddress(), Decimal("0.1"))
+            self.sync_all()
+
+            # Includes the time node0 takes to mine, which is the same in both modes
+            start = time.time()
+            self.nodes[0].setgenerate(True, 1)
+            tip = self.nodes[0].getbestblockhash()
+            while self.nodes[3].getbestblockhash() != tip:
+                time.sleep(0.002)
+            times.append(time.time() - start)
+            self.sync_all()
+        bytes_received = self.nodes[3].getnettotals()['totalbytesrecv'] - bytes_before
+
+        times.sort()
+        print("%-16s %d blocks of %d txs: mean %.1f ms, median %.1f ms, max %.1f ms, node3 received %d bytes" %
+              (label, len(times), self.options.txs, 1000 * sum(times) / len(times),
+               1000 * times[len(times) // 2], 1000 * times[-1], bytes_received))
+
+    def run_test(self):
+        self.restart_nodes(["-compactblocks=0"])
+        before = self.count_reconstructed(3)
+        self.measure("full blocks")
+        assert_equal(self.count_reconstructed(3), before)
+
+        self.restart_nodes([])
+        before = self.count_reconstructed(3)
+        self.measure("compact blocks")
+        assert_greater_than(self.count_reconstructed(3) - before, self.options.blocks - 1)
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
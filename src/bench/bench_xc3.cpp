@@ -0,0 +1,18 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+#include "util.h"
+
+int main(int argc, char** argv)
+{
+    SetupEnvironment();
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+    SHA256AutoDetect();
+
+    benchmark::BenchRunner::RunAll();
+}
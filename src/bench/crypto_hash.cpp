@@ -0,0 +1,45 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+#include "primitives/block.h"
+
+#include <vector>
+
+/** Bulk hashing through CSHA256, which uses the single block Transform */
+static void SHA256_1M(benchmark::State& state)
+{
+    uint8_t hash[CSHA256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(1 << 20, 0);
+    while (state.KeepRunning())
+        CSHA256().Write(&in[0], in.size()).Finalize(hash);
+}
+
+/** Double SHA-256 of 1024 64 byte inputs, one merkle tree level */
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning())
+        SHA256D64(&in[0], &in[0], 1024);
+}
+
+/** Merkle root of a block of 1000 transactions */
+static void MerkleRoot(benchmark::State& state)
+{
+    CBlock block;
+    block.vtx.resize(1000);
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        block.vtx[i] = tx;
+    }
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+
+BENCHMARK(SHA256_1M);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(MerkleRoot);
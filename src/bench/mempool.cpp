@@ -0,0 +1,106 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "random.h"
+#include "txmempool.h"
+
+#include <algorithm>
+#include <list>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+/** Transactions of one or two inputs, every fourth starting a fresh chain of up to four */
+static void GenerateTransactions(std::vector<CTransaction>& vtx, size_t nCount)
+{
+    vtx.clear();
+    vtx.reserve(nCount);
+    for (size_t i = 0; i < nCount; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1 + i % 2);
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            tx.vin[j].scriptSig = CScript() << OP_11;
+            if (i % 4 != 0 && j == 0)
+                tx.vin[j].prevout = COutPoint(vtx.back().GetHash(), 0);
+            else
+                tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+        }
+        tx.vout.resize(2);
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[j].nValue = 1000;
+        }
+        vtx.push_back(CTransaction(tx));
+    }
+}
+
+static void AddTransactions(CTxMemPool& pool, const std::vector<CTransaction>& vtx, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        pool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], 1000 + i % 7919, 0, 0.0, 1));
+}
+
+// Fill an empty pool with 10000 transactions
+static void MempoolInsert(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx;
+    GenerateTransactions(vtx, 10000);
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        AddTransactions(pool, vtx, 0, vtx.size());
+    }
+}
+
+// 1000 each of exists, lookup and spent outpoint checks, half of them misses,
+// against a pool of 100000 transactions
+static void MempoolLookup(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx, vtxMissing;
+    GenerateTransactions(vtx, 100000);
+    GenerateTransactions(vtxMissing, 500);
+    CTxMemPool pool(CFeeRate(1000));
+    AddTransactions(pool, vtx, 0, vtx.size());
+
+    std::vector<CTransaction> vtxQuery(vtx.begin(), vtx.begin() + 500);
+    vtxQuery.insert(vtxQuery.end(), vtxMissing.begin(), vtxMissing.end());
+    std::random_shuffle(vtxQuery.begin(), vtxQuery.end(), GetRandInt);
+
+    uint64_t nFound = 0;
+    while (state.KeepRunning()) {
+        LOCK(pool.cs);
+        BOOST_FOREACH (const CTransaction& tx, vtxQuery) {
+            CTransaction txOut;
+            nFound += pool.exists(tx.GetHash());
+            nFound += pool.lookup(tx.GetHash(), txOut);
+            nFound += pool.mapNextTx.count(tx.vin[0].prevout);
+        }
+    }
+    assert(nFound > 0);
+}
+
+// Confirm 1000 of the transactions of a pool of 100000 in a block, then put
+// them back so every round starts from the same pool
+static void MempoolRemoveForBlock(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx;
+    GenerateTransactions(vtx, 100000);
+    CTxMemPool pool(CFeeRate(1000));
+    AddTransactions(pool, vtx, 0, vtx.size());
+
+    unsigned int nHeight = 1;
+    size_t nBegin = 0;
+    while (state.KeepRunning()) {
+        std::vector<CTransaction> vtxBlock(vtx.begin() + nBegin, vtx.begin() + nBegin + 1000);
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(vtxBlock, ++nHeight, conflicts);
+        AddTransactions(pool, vtx, nBegin, nBegin + 1000);
+        nBegin = (nBegin + 1000) % vtx.size();
+    }
+}
+
+BENCHMARK(MempoolInsert);
+BENCHMARK(MempoolLookup);
+BENCHMARK(MempoolRemoveForBlock);
@@ -0,0 +1,118 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+// socketpair() and the -socketevents modes benchmarked here are POSIX only
+#ifndef WIN32
+
+#include "chainparams.h"
+#include "net.h"
+#include "protocol.h"
+#include "streams.h"
+#include "sync.h"
+#include "version.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+/** Idle peers connected next to the active one; select() needs both ends of every pair below FD_SETSIZE */
+static const int SYNTHETIC_IDLE_PEERS = 400;
+
+/**
+ * Push one small message into an active peer's socket and wait until
+ * ThreadSocketHandler has received it, while many other local peers stay
+ * connected and idle. This is the cost of a single wakeup as the number of
+ * connections grows, for the given -socketevents mode.
+ */
+static void SocketHandlerRoundTrip(benchmark::State& state, SocketEventsMode mode)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    nSocketEventsMode = mode;
+    InitSocketEvents();
+    if (nSocketEventsMode != mode) {
+        CloseSocketEvents();
+        return;
+    }
+
+    std::vector<CNode*> vPeers;
+    std::vector<int> vRemote;
+    for (int i = 0; i <= SYNTHETIC_IDLE_PEERS; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            break;
+        CNode* pnode = new CNode(sv[0], CAddress(CService("127.0.0.1", 0)), "", true);
+        pnode->AddRef();
+        vPeers.push_back(pnode);
+        vRemote.push_back(sv[1]);
+    }
+    {
+        LOCK(cs_vNodes);
+        vNodes.insert(vNodes.end(), vPeers.begin(), vPeers.end());
+    }
+
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader("ping", sizeof(uint64_t)) << (uint64_t)0;
+    std::vector<char> vMsg(ssMsg.begin(), ssMsg.end());
+
+    boost::thread threadSocketHandler(&ThreadSocketHandler);
+
+    CNode* pactive = vPeers.front();
+    while (state.KeepRunning()) {
+        uint64_t nRecvBytes;
+        {
+            LOCK(pactive->cs_vRecvMsg);
+            nRecvBytes = pactive->nRecvBytes;
+        }
+        if (write(vRemote.front(), &vMsg[0], vMsg.size()) != (ssize_t)vMsg.size())
+            break;
+        bool fReceived = false;
+        while (!fReceived) {
+            boost::this_thread::yield();
+            LOCK(pactive->cs_vRecvMsg);
+            if (pactive->nRecvBytes >= nRecvBytes + vMsg.size()) {
+                // Keep the receive buffer empty so flood control never kicks in
+                pactive->vRecvMsg.clear();
+                fReceived = true;
+            }
+        }
+    }
+
+    threadSocketHandler.interrupt();
+    threadSocketHandler.join();
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vPeers) {
+            vNodes.erase(std::remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+            pnode->CloseSocketDisconnect();
+            delete pnode;
+        }
+    }
+    BOOST_FOREACH (int fd, vRemote)
+        close(fd);
+    CloseSocketEvents();
+}
+
+static void SocketHandlerSelect(benchmark::State& state)
+{
+    SocketHandlerRoundTrip(state, SOCKETEVENTS_SELECT);
+}
+
+static void SocketHandlerEpoll(benchmark::State& state)
+{
+    SocketEventsMode mode;
+    if (ParseSocketEventsMode("epoll", mode))
+        SocketHandlerRoundTrip(state, mode);
+}
+
+BENCHMARK(SocketHandlerSelect);
+BENCHMARK(SocketHandlerEpoll);
+
+#endif // WIN32
@@ -0,0 +1,163 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+#define MIN_TRANSACTION_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION))
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                             header(block.GetBlockHeader()),
+                                                                             vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+
+    // The coinbase, and the coinstake of a proof-of-stake block, are never in a mempool
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    nPrefilled = std::min(nPrefilled, block.vtx.size());
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        prefilledtxn[i].index = i;
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+    shorttxids.reserve(block.vtx.size() - nPrefilled);
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shorttxidhash;
+    hasher.Finalize(shorttxidhash.begin());
+    shorttxidk0 = shorttxidhash.Get64(0);
+    shorttxidk1 = shorttxidhash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+    // Positions are exchanged as 16 bit numbers
+    if (cmpctblock.BlockTxCount() > (size_t)std::numeric_limits<uint16_t>::max() + 1)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull() || prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        txn_available[prefilled.index] = prefilled.tx;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Map each short ID to its position in the block, skipping the prefilled positions.
+    // The short IDs come from the peer, which could pick them to fill a single bucket;
+    // give up on reconstruction rather than degrade to linear lookups.
+    boost::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    uint16_t index_offset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (!txn_available[i + index_offset].IsNull())
+            index_offset++;
+        shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
+        if (shorttxids.bucket_size(shorttxids.bucket(cmpctblock.shorttxids[i])) > 12)
+            return READ_STATUS_FAILED;
+    }
+    // Two transactions of the block share a short ID
+    if (shorttxids.size() != cmpctblock.shorttxids.size())
+        return READ_STATUS_FAILED;
+
+    std::vector<bool> have_txn(txn_available.size());
+    {
+        LOCK(pool->cs);
+        for (CTxMemPool::TxMap::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(cmpctblock.GetShortID(it->first));
+            if (idit != shorttxids.end()) {
+                if (!have_txn[idit->second]) {
+                    txn_available[idit->second] = it->second.GetTx();
+                    have_txn[idit->second] = true;
+                    mempool_count++;
+                } else if (!txn_available[idit->second].IsNull()) {
+                    // Two mempool transactions match the short ID; request the one in the block
+                    txn_available[idit->second] = CTransaction();
+                    mempool_count--;
+                }
+            }
+            // Stop once every short ID was matched; a later collision would only cost a full block download
+            if (mempool_count == shorttxids.size())
+                break;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %u\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < txn_available.size());
+    return !txn_available[index].IsNull();
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vtx.resize(txn_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (txn_available[i].IsNull()) {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[tx_missing_offset++];
+        } else {
+            block.vtx[i] = txn_available[i];
+        }
+    }
+    block.vchBlockSig = vchBlockSig;
+
+    // Make sure we can't call FillBlock again
+    header.SetNull();
+    txn_available.clear();
+
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+
+    // A short ID collision with a mempool transaction gives a different merkle root
+    bool mutated;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %u txn prefilled, %u txn from mempool and %u txn requested\n",
+        block.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size());
+
+    return READ_STATUS_OK;
+}
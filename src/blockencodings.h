@@ -0,0 +1,234 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Version of the short transaction ID encoding, sent in "sendcmpct" */
+static const uint64_t SHORT_IDS_BLOCKS_ENCODING_VERSION = 1;
+
+/**
+ * Serialize a list of ascending transaction positions as compact size
+ * differences, each relative to the previous position plus one. They are
+ * kept as absolute positions in memory.
+ */
+template <typename Stream>
+void SerializeDifferentialIndexes(Stream& s, const std::vector<uint16_t>& indexes)
+{
+    WriteCompactSize(s, indexes.size());
+    for (size_t i = 0; i < indexes.size(); i++)
+        WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1));
+}
+
+template <typename Stream>
+uint16_t UnserializeDifferentialIndex(Stream& s, uint64_t nPrevious)
+{
+    uint64_t nIndex = ReadCompactSize(s) + nPrevious;
+    if (nIndex > std::numeric_limits<uint16_t>::max())
+        throw std::ios_base::failure("transaction index overflowed 16 bits");
+    return nIndex;
+}
+
+/** "getblocktxn": the transactions of a compact block the requester could not find in its mempool */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        SerializeDifferentialIndexes(s, indexes);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nSize = ReadCompactSize(s);
+        if (nSize > std::numeric_limits<uint16_t>::max() + 1)
+            throw std::ios_base::failure("too many transaction indexes");
+        indexes.clear();
+        indexes.reserve(nSize);
+        for (uint64_t i = 0; i < nSize; i++)
+            indexes.push_back(UnserializeDifferentialIndex(s, i == 0 ? 0 : indexes.back() + 1));
+    }
+};
+
+/** "blocktxn": the answer to a getblocktxn, in the requested order */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full with a compact block, at position index of the block */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+};
+
+/**
+ * "cmpctblock": a block announced as its header, the transactions the
+ * receiver cannot have (coinbase and coinstake) and a 6 byte short ID for
+ * every other transaction. Short IDs are SipHash-2-4 of the txid keyed by
+ * SHA256(header || nonce), so they differ per block and per sender.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    //! Proof-of-stake block signature, empty for proof-of-work blocks
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+        WriteCompactSize(s, prefilledtxn.size());
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            WriteCompactSize(s, prefilledtxn[i].index - (i == 0 ? 0 : prefilledtxn[i - 1].index + 1));
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+        ::Serialize(s, vchBlockSig, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        uint64_t nShortIDs = ReadCompactSize(s);
+        if (nShortIDs > MAX_BLOCK_SIZE / SHORTTXIDS_LENGTH)
+            throw std::ios_base::failure("too many short transaction IDs");
+        shorttxids.resize(nShortIDs);
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb;
+            uint16_t msb;
+            ::Unserialize(s, lsb, nType, nVersion);
+            ::Unserialize(s, msb, nType, nVersion);
+            shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+        }
+        uint64_t nPrefilled = ReadCompactSize(s);
+        if (nPrefilled > std::numeric_limits<uint16_t>::max() + 1)
+            throw std::ios_base::failure("too many prefilled transactions");
+        prefilledtxn.clear();
+        for (uint64_t i = 0; i < nPrefilled; i++) {
+            PrefilledTransaction prefilled;
+            prefilled.index = UnserializeDifferentialIndex(s, i == 0 ? 0 : prefilledtxn.back().index + 1);
+            ::Unserialize(s, prefilled.tx, nType, nVersion);
+            prefilledtxn.push_back(prefilled);
+        }
+        ::Unserialize(s, vchBlockSig, nType, nVersion);
+
+        FillShortTxIDSelector();
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  //! Failed to process object, e.g. a short ID collision; fetch the full block
+};
+
+/**
+ * A block being rebuilt from a cmpctblock: transactions are taken from the
+ * prefilled list and the mempool, and the positions still empty afterwards
+ * are requested with getblocktxn.
+ */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    size_t prefilled_count, mempool_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    size_t GetMempoolCount() const { return mempool_count; }
+    /**
+     * Assemble the block from what InitData found and vtx_missing, which holds
+     * the missing transactions in block order. Only the merkle root is checked
+     * here; the block is validated by ProcessNewBlock.
+     */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
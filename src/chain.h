@@ -448,7 +448,8 @@ public:
         READWRITE(nNonce);
     }
 
-    uint256 GetBlockHash() const
+    //! The header as stored, with hashPrev in place of pprev, which is not linked yet
+    CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion = nVersion;
@@ -457,7 +458,12 @@ public:
         block.nTime = nTime;
         block.nBits = nBits;
         block.nNonce = nNonce;
-        return block.GetHash();
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
 
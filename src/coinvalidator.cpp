@@ -5,15 +5,132 @@
 
 #include "coinvalidator.h"
 
-#include <fstream>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include "clientversion.h"
+#include "hash.h"
 #include "s3downloader.h"
+#include "streams.h"
 #include "util.h"
+#include "utilstrencodings.h"
+
+static_assert(sizeof(InfractionRecord) == 88, "InfractionRecord must stay tightly packed");
 
 /**
  * Return the chain height coin validator is active on.
  */
 const int CoinValidator::CHAIN_HEIGHT = 101651;
 
+/**
+ * Version of the binary cache file format.
+ */
+const uint32_t CoinValidator::CACHE_VERSION = 1;
+
+static const char EXPL_CACHE_MAGIC[8] = {'X', 'C', 'E', 'X', 'P', 'L', 0, 0};
+
+/**
+ * Bloom filter parameters, about 0.25% false positives.
+ */
+static const int INFRACTION_FILTER_PROBES = 4;
+static const size_t INFRACTION_FILTER_BITS_PER_ENTRY = 16;
+
+/**
+ * Txids are double sha256 so any 32 bits of them make a good filter hash.
+ */
+static inline uint32_t infractionFilterProbe(const uint256 &txId, int n) {
+    uint32_t probe;
+    memcpy(&probe, txId.begin() + n * sizeof(probe), sizeof(probe));
+    return probe;
+}
+
+/**
+ * Builds the sorted snapshot, grouping infractions of the same tx together.
+ * @param infractions
+ */
+InfractionIndex::InfractionIndex(std::vector<InfractionData> &infractions) {
+    std::vector<std::pair<uint256, size_t>> order;
+    order.reserve(infractions.size());
+    for (size_t i = 0; i < infractions.size(); ++i)
+        order.emplace_back(uint256S(infractions[i].txid), i);
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<uint256, size_t> &a, const std::pair<uint256, size_t> &b) {
+                         return a.first < b.first;
+                     });
+
+    keys.reserve(order.size());
+    infs.reserve(order.size());
+    for (auto &item : order) {
+        keys.push_back(item.first);
+        infs.push_back(std::move(infractions[item.second]));
+    }
+
+    // Size the filter to a power of two so probes only need a mask
+    size_t bits = 64;
+    while (bits < keys.size() * INFRACTION_FILTER_BITS_PER_ENTRY)
+        bits <<= 1;
+    filter.assign(bits / 64, 0);
+    filterMask = (uint32_t)(bits - 1);
+    for (const uint256 &key : keys) {
+        for (int i = 0; i < INFRACTION_FILTER_PROBES; ++i) {
+            uint32_t bit = infractionFilterProbe(key, i) & filterMask;
+            filter[bit >> 6] |= (uint64_t)1 << (bit & 63);
+        }
+    }
+}
+
+/**
+ * Returns false if the tx definitely has no infractions, true if it may have.
+ * @param txId
+ * @return
+ */
+bool InfractionIndex::MayContain(const uint256 &txId) const {
+    for (int i = 0; i < INFRACTION_FILTER_PROBES; ++i) {
+        uint32_t bit = infractionFilterProbe(txId, i) & filterMask;
+        if (!(filter[bit >> 6] & ((uint64_t)1 << (bit & 63))))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Returns true if there are infractions for the tx. Does not consult the prefilter,
+ * callers on the hot path check MayContain first.
+ * @param txId
+ * @return
+ */
+bool InfractionIndex::Contains(const uint256 &txId) const {
+    return std::binary_search(keys.begin(), keys.end(), txId);
+}
+
+/**
+ * Returns the infractions for the tx.
+ * @param txId
+ * @return
+ */
+std::vector<InfractionData> InfractionIndex::Get(const uint256 &txId) const {
+    auto range = std::equal_range(keys.begin(), keys.end(), txId);
+    return std::vector<InfractionData>(infs.begin() + (range.first - keys.begin()),
+                                       infs.begin() + (range.second - keys.begin()));
+}
+
+/**
+ * Returns the current snapshot, or null if none is loaded.
+ * @return
+ */
+const InfractionIndex* CoinValidator::getIndex() const {
+    return infIndex.load(std::memory_order_acquire);
+}
+
+/**
+ * Swaps in a new snapshot built from the infractions. Old snapshots are kept alive since
+ * readers do not lock. Caller must hold the lock.
+ * @param infractions
+ */
+void CoinValidator::publish(std::vector<InfractionData> &infractions) {
+    infSnapshots.emplace_back(new InfractionIndex(infractions));
+    infIndex.store(infSnapshots.back().get(), std::memory_order_release);
+}
+
 /**
  * Returns true if the tx is not associated with any infractions.
  * @param txId
@@ -21,12 +138,21 @@ const int CoinValidator::CHAIN_HEIGHT = 101651;
  */
 bool CoinValidator::IsCoinValid(const uint256 &txId) const {
     // A coin is valid if its tx is not in the infractions list
-    boost::mutex::scoped_lock l(lock);
-    return infMap.count(txId.ToString()) == 0;
-}
-bool CoinValidator::IsCoinValid(uint256 &txId) const {
-    boost::mutex::scoped_lock l(lock);
-    return infMap.count(txId.ToString()) == 0;
+    const InfractionIndex *index = getIndex();
+    if (index == nullptr)
+        return true;
+
+    // Almost every input is clean, let the prefilter answer those
+    if (!index->MayContain(txId)) {
+        prefilterClean.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    prefilterMaybe.fetch_add(1, std::memory_order_relaxed);
+
+    if (!index->Contains(txId))
+        return true;
+    infractionsFound.fetch_add(1, std::memory_order_relaxed);
+    return false;
 }
 
 /**
@@ -37,17 +163,20 @@ bool CoinValidator::IsCoinValid(uint256 &txId) const {
  */
 bool CoinValidator::RedeemAddressVerified(std::vector<RedeemData> &exploited,
                                           std::vector<RedeemData> &recipients) {
-    boost::mutex::scoped_lock l(lock);
     if (recipients.empty())
         return false;
 
+    const InfractionIndex *index = getIndex();
+    if (index == nullptr)
+        return false;
+
     static const std::string redeemAddress = "BmL4hWa8T7Qi6ZZaL291jDai4Sv98opcSK";
-    std::set<std::string> explSeen;
+    std::set<std::pair<uint256, std::string>> explSeen;
 
     // Add up all exploited inputs by send from address
     CAmount totalExploited = 0;
     for (auto &expl : exploited) {
-        if (!infMap.count(expl.txid)) // fail if infraction not found
+        if (!index->Contains(expl.txid)) // fail if infraction not found
             return false;
 
         // Get address of tx
@@ -58,13 +187,13 @@ bool CoinValidator::RedeemAddressVerified(std::vector<RedeemData> &exploited,
         std::string explAddr = explAddress.ToString();
 
         // If we've already added up infractions for this utxo address, skip
-        std::string guid = expl.txid + "-" + explAddr;
+        auto guid = std::make_pair(expl.txid, explAddr);
         if (explSeen.count(guid))
             continue;
 
         // Find out how much exploited coin we need to spend in this utxo
         CAmount exploitedAmount = 0;
-        std::vector<InfractionData> &infs = infMap[expl.txid];
+        std::vector<InfractionData> infs = index->Get(expl.txid);
         for (auto &inf : infs) {
             if (inf.address == explAddr)
                 exploitedAmount += inf.amount;
@@ -114,31 +243,48 @@ bool CoinValidator::IsLoaded() const {
  */
 void CoinValidator::Clear() {
     boost::mutex::scoped_lock l(lock);
-    infMap.clear();
+    infIndex.store(nullptr, std::memory_order_release);
     lastLoadH = 0;
     infMapLoaded = false;
     downloadErr = false;
 }
 
+/**
+ * Returns the lookup counters and the size of the loaded list.
+ * @return
+ */
+CoinValidatorStats CoinValidator::GetStats() const {
+    CoinValidatorStats stats;
+    stats.prefilterClean = prefilterClean.load(std::memory_order_relaxed);
+    stats.prefilterMaybe = prefilterMaybe.load(std::memory_order_relaxed);
+    stats.infractions = infractionsFound.load(std::memory_order_relaxed);
+    const InfractionIndex *index = getIndex();
+    if (index != nullptr) {
+        stats.entries = index->Size();
+        stats.filterBytes = index->FilterBytes();
+    }
+    return stats;
+}
+
 /**
  * Get infractions for the specified criteria.
  * @return
  */
 std::vector<InfractionData> CoinValidator::GetInfractions(const uint256 &txId) {
-    boost::mutex::scoped_lock l(lock);
-    return infMap[txId.ToString()];
-}
-std::vector<InfractionData> CoinValidator::GetInfractions(uint256 &txId) {
-    boost::mutex::scoped_lock l(lock);
-    return infMap[txId.ToString()];
+    const InfractionIndex *index = getIndex();
+    if (index == nullptr)
+        return std::vector<InfractionData>();
+    return index->Get(txId);
 }
 std::vector<InfractionData> CoinValidator::GetInfractions(CBitcoinAddress &address) {
-    boost::mutex::scoped_lock l(lock);
     std::vector<InfractionData> infs;
-    for (auto &item : infMap) {
-        for (const InfractionData &inf : item.second)
-            if (inf.address == address.ToString())
-                infs.push_back(inf);
+    const InfractionIndex *index = getIndex();
+    if (index == nullptr)
+        return infs;
+    const std::string addr = address.ToString();
+    for (const InfractionData &inf : index->GetAll()) {
+        if (inf.address == addr)
+            infs.push_back(inf);
     }
     return infs;
 }
@@ -156,58 +302,19 @@ bool CoinValidator::Load(int loadHeight) {
         return false;
     infMapLoaded = true;
 
-    // Clear old data
-    infMap.clear();
-
     // Load from cache if our loaded chain height is under current chain height
-    ifstream f(getExplPath().string());
-    if (f.good()) { // only proceed to load from cache if the file exists
-        try {
-            std::ifstream cacheFile(getExplPath().string(), std::ios::in | std::ifstream::binary);
-            if (cacheFile) {
-                bool isLastLoadH = true;
-                // Get lines from file
-                std::vector<std::string> lines;
-                for (std::string line; getline(cacheFile, line); ) {
-                    // Check first line for last load height
-                    if (isLastLoadH) {
-                        isLastLoadH = false;
-                        int blockH = getBlockHeight(line);
-                        // Do not proceed if this cache file is out of date
-                        if (!blockH || blockH < loadHeight)
-                            break;
-                        // Skip first line since it's the block height
-                        lastLoadH = blockH; // set the load height
-                        continue;
-                    }
-                    lines.push_back(line);
-                }
-                cacheFile.close();
-
-                // Add lines to memory after file is safely closed (this can fail)
-                if (!lines.empty()) {
-                    bool failed = false;
-                    for (std::string &line : lines) {
-                        if (!addLine(line, infMap)) { // populate hash
-                            LogPrintf("Coin Validator: Failed to parse hash item: %s\n", line);
-                            std::cout << "Coin Validator: Failed to parse hash item: " + line << std::endl;
-                            failed = true;
-                        }
-                    }
-
-                    // If we didn't fail return, otherwise proceed to load from network
-                    if (!failed) {
-                        LogPrintf("Coin Validator: Loading from cache: %u\n", lastLoadH);
-                        return true;
-                    }
-                }
-
-            } // if cache file doesn't exist or is old, proceed to load from network
-        } catch (std::exception &e) {
-            LogPrintf("Coin Validator: Failed to load from cache, trying from network: %s\n", e.what());
-            // proceed to try network
+    std::vector<InfractionData> infractions;
+    int cacheHeight = 0;
+    if (readCache(infractions, cacheHeight)) {
+        // Do not use the cache if it is out of date
+        if (cacheHeight >= loadHeight && !infractions.empty()) {
+            publish(infractions);
+            lastLoadH = cacheHeight; // set the load height
+            LogPrintf("Coin Validator: Loading from cache: %u\n", lastLoadH);
+            return true;
         }
-    }
+        infractions.clear();
+    } // if cache file doesn't exist or is old, proceed to load from network
 
     std::string err;
     std::list<std::string> lst;
@@ -219,17 +326,13 @@ bool CoinValidator::Load(int loadHeight) {
 
     // Load hash from list
     for (std::string &line : lst) {
-        addLine(line, infMap);
+        if (!addLine(line, infractions))
+            LogPrintf("Coin Validator: Failed to parse hash item: %s\n", line);
     }
+    publish(infractions);
 
     // Save to disk
-    std::ofstream file(getExplPath().string(), std::ios::out | std::ofstream::binary);
-    file << std::to_string(loadHeight) << std::endl;
-    for (auto &item : infMap) {
-        for (auto &inf : item.second)
-            file << inf.ToString() << std::endl;
-    }
-    file.close();
+    writeCache(*getIndex(), loadHeight);
 
     // set the load height
     lastLoadH = loadHeight;
@@ -251,21 +354,21 @@ bool CoinValidator::LoadStatic() {
         return false;
     infMapLoaded = true;
 
-    // Clear old data
-    infMap.clear();
-
     // Load infractions into memory
-    std::vector<string> infractions = getExplList();
-    for (std::string &line : infractions) {
-        bool result = addLine(line, infMap);
+    std::vector<string> lines = getExplList();
+    std::vector<InfractionData> infractions;
+    infractions.reserve(lines.size());
+    for (std::string &line : lines) {
+        bool result = addLine(line, infractions);
         if (!result) {
             LogPrintf("Coin Validator: Failed to read infraction: %s\n", line);
             assert(result);
         }
     }
+    publish(infractions);
 
     lastLoadH = CHAIN_HEIGHT;
-    LogPrintf("Coin Validator: Ready: %u", lastLoadH);
+    LogPrintf("Coin Validator: Ready: %u\n", lastLoadH);
     return true;
 }
 
@@ -274,47 +377,135 @@ bool CoinValidator::LoadStatic() {
  * @return
  */
 boost::filesystem::path CoinValidator::getExplPath() {
-    return GetDataDir() / "expl.txt";
+    return GetDataDir() / "expl.dat";
 }
 
 /**
- * Adds the data to internal hash.
+ * Reads the binary cache file. Returns false if it is missing, corrupted or of another version.
+ * @param infractions
+ * @param blockHeight
  * @return
  */
-bool CoinValidator::addLine(std::string &line, std::map<std::string, std::vector<InfractionData>> &map) {
-    std::stringstream os(line);
-    os.imbue(std::locale::classic());
-    std::string t;
-    std::string a;
-    CAmount amt = 0;
-    double amtd = 0;
-    os >> t >> a >> amt >> amtd;
-
-    if (t.empty() || a.empty() || amt == 0 || amtd == 0)
+bool CoinValidator::readCache(std::vector<InfractionData> &infractions, int &blockHeight) {
+    boost::filesystem::path path = getExplPath();
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
         return false;
 
-    // Make sure parsed line matches expected
-    assert(line == t + "\t" + a + "\t" + std::to_string(amt) + "\t" + CoinValidator::AmountToString(amtd));
+    // use file size to size memory buffer
+    int dataSize = (int)boost::filesystem::file_size(path) - (int)sizeof(uint256);
+    if (dataSize < 24)
+        return error("%s : Cache file %s too small", __func__, path.string());
+    std::vector<unsigned char> vchData(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char*)&vchData[0], dataSize);
+        filein >> hashIn;
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    filein.fclose();
+
+    // verify stored checksum matches input data
+    if (hashIn != Hash(vchData.begin(), vchData.end()))
+        return error("%s : Checksum mismatch, data corrupted", __func__);
+
+    CDataStream ss(vchData, SER_DISK, CLIENT_VERSION);
+    try {
+        char magic[8];
+        uint32_t version = 0;
+        int32_t height = 0;
+        uint32_t count = 0;
+        uint32_t reserved = 0;
+        ss >> FLATDATA(magic) >> version >> height >> count >> reserved;
+        if (memcmp(magic, EXPL_CACHE_MAGIC, sizeof(magic)) != 0 || version != CACHE_VERSION)
+            return error("%s : Unknown cache file format", __func__);
+        if (ss.size() != (size_t)count * sizeof(InfractionRecord))
+            return error("%s : Cache file has wrong size for %u records", __func__, count);
+
+        infractions.reserve(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            InfractionRecord rec;
+            ss >> FLATDATA(rec);
+            uint256 txid;
+            memcpy(txid.begin(), rec.txid, sizeof(rec.txid));
+            std::string address(rec.address, strnlen(rec.address, sizeof(rec.address)));
+            infractions.emplace_back(txid.GetHex(), address, rec.amount, rec.amountH);
+        }
+        blockHeight = height;
+    } catch (std::exception &e) {
+        infractions.clear();
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+/**
+ * Writes the snapshot to the binary cache file.
+ * @param index
+ * @param blockHeight
+ * @return
+ */
+bool CoinValidator::writeCache(const InfractionIndex &index, int blockHeight) {
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(EXPL_CACHE_MAGIC) << CACHE_VERSION << (int32_t)blockHeight << (uint32_t)index.Size() << (uint32_t)0;
+    for (const InfractionData &inf : index.GetAll()) {
+        InfractionRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        uint256 txid = uint256S(inf.txid);
+        memcpy(rec.txid, txid.begin(), sizeof(rec.txid));
+        strncpy(rec.address, inf.address.c_str(), sizeof(rec.address) - 1);
+        rec.amount = inf.amount;
+        rec.amountH = inf.amountH;
+        ss << FLATDATA(rec);
+    }
+    uint256 hash = Hash(ss.begin(), ss.end());
+    ss << hash;
 
-    const InfractionData inf(t, a, amt, amtd);
-    std::vector<InfractionData> &infs = map[inf.txid];
-    infs.push_back(inf);
+    boost::filesystem::path path = getExplPath();
+    FILE *file = fopen(path.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, path.string());
 
+    try {
+        fileout << ss;
+    } catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    fileout.fclose();
     return true;
 }
 
 /**
- * Get block height from line.
+ * Parses a tab separated infraction line (txid, address, amount, amount in coin).
  * @return
  */
-int CoinValidator::getBlockHeight(std::string &line) {
-    std::stringstream os(line);
+bool CoinValidator::addLine(const std::string &line, std::vector<InfractionData> &infractions) {
+    size_t p1 = line.find('\t');
+    size_t p2 = p1 == std::string::npos ? p1 : line.find('\t', p1 + 1);
+    size_t p3 = p2 == std::string::npos ? p2 : line.find('\t', p2 + 1);
+    if (p3 == std::string::npos)
+        return false;
+
+    std::string t = line.substr(0, p1);
+    std::string a = line.substr(p1 + 1, p2 - p1 - 1);
+    CAmount amt = atoi64(line.substr(p2 + 1, p3 - p2 - 1));
+
+    std::istringstream os(line.substr(p3 + 1));
     os.imbue(std::locale::classic());
-    int t = 0; os >> t;
-    if (t > 0)
-        return t;
-    else
-        return 0;
+    double amtd = 0;
+    os >> amtd;
+
+    if (t.size() != 64 || !IsHex(t) || a.empty() || a.size() >= sizeof(InfractionRecord::address) || amt <= 0 || amtd <= 0)
+        return false;
+
+    infractions.emplace_back(t, a, amt, amtd);
+    return true;
 }
 
 /**
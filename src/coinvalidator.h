@@ -6,6 +6,8 @@
 #ifndef BLOCKDX_COINVALIDATOR_H
 #define BLOCKDX_COINVALIDATOR_H
 
+#include <atomic>
+#include <memory>
 #include <boost/thread/mutex.hpp>
 #include <boost/filesystem/path.hpp>
 #include <script/script.h>
@@ -31,42 +33,92 @@ struct InfractionData {
  * Stores redeem data.
  */
 struct RedeemData {
-    std::string txid;
+    uint256 txid;
     CScript scriptPubKey;
     CAmount amount;
-    RedeemData(std::string t, CScript a, CAmount amt) {
-        txid = std::move(t); scriptPubKey = a; amount = amt;
+    RedeemData(const uint256 &t, CScript a, CAmount amt) {
+        txid = t; scriptPubKey = a; amount = amt;
     }
 };
 
+/**
+ * Immutable snapshot of the infraction list, sorted by raw txid. A snapshot is never
+ * modified after it is published so it can be read without locking.
+ */
+class InfractionIndex {
+public:
+    explicit InfractionIndex(std::vector<InfractionData> &infractions);
+    bool MayContain(const uint256 &txId) const;
+    bool Contains(const uint256 &txId) const;
+    std::vector<InfractionData> Get(const uint256 &txId) const;
+    const std::vector<InfractionData> & GetAll() const { return infs; }
+    size_t Size() const { return infs.size(); }
+    size_t FilterBytes() const { return filter.size() * sizeof(uint64_t); }
+private:
+    std::vector<uint256> keys; // txid of each infraction, sorted
+    std::vector<InfractionData> infs; // infractions in the same order as keys
+    std::vector<uint64_t> filter; // bloom filter over keys, probes are taken straight from the txid bits
+    uint32_t filterMask = 0; // number of filter bits minus one, the bit count is a power of two
+};
+
+/**
+ * Lookup counters, shows how many checks the prefilter answered on its own.
+ */
+struct CoinValidatorStats {
+    uint64_t prefilterClean = 0; // inputs the prefilter reported as definitely clean
+    uint64_t prefilterMaybe = 0; // inputs that needed a lookup in the index
+    uint64_t infractions = 0; // inputs found in the index
+    size_t entries = 0;
+    size_t filterBytes = 0;
+};
+
+/**
+ * Record layout of the binary infraction cache (expl.dat). The file is a fixed size
+ * header followed by records sorted by txid, all 8 byte aligned so the file can be
+ * memory mapped and searched in place on little endian hosts.
+ */
+struct InfractionRecord {
+    unsigned char txid[32];
+    char address[40]; // null padded
+    int64_t amount;
+    double amountH;
+};
+
 /**
  * Manages coin infractions.
  */
 class CoinValidator {
 public:
     static const int CHAIN_HEIGHT;
+    static const uint32_t CACHE_VERSION;
     bool IsCoinValid(const uint256 &txId) const;
-    bool IsCoinValid(uint256 &txId) const;
     bool RedeemAddressVerified(std::vector<RedeemData> &exploited,
                                std::vector<RedeemData> &recipients);
     bool Load(int loadHeight);
     bool LoadStatic();
     bool IsLoaded() const;
     void Clear();
+    CoinValidatorStats GetStats() const;
     std::vector<InfractionData> GetInfractions(const uint256 &txId);
-    std::vector<InfractionData> GetInfractions(uint256 &txId);
     std::vector<InfractionData> GetInfractions(CBitcoinAddress &address);
     static std::string AmountToString(double amount);
     static CoinValidator& instance();
 private:
-    std::map<std::string, std::vector<InfractionData>> infMap; // Store infractions in memory
+    std::atomic<const InfractionIndex*> infIndex{nullptr}; // current snapshot, read without locking
+    std::vector<std::unique_ptr<const InfractionIndex>> infSnapshots; // every published snapshot, readers may still hold one
+    mutable std::atomic<uint64_t> prefilterClean{0};
+    mutable std::atomic<uint64_t> prefilterMaybe{0};
+    mutable std::atomic<uint64_t> infractionsFound{0};
     bool infMapLoaded = false;
     int lastLoadH = 0;
     bool downloadErr = false;
-    mutable boost::mutex lock;
+    mutable boost::mutex lock; // serializes loading, not needed for reads
+    const InfractionIndex* getIndex() const;
+    void publish(std::vector<InfractionData> &infractions);
     boost::filesystem::path getExplPath();
-    bool addLine(std::string &line, std::map<std::string, std::vector<InfractionData>> &map);
-    int getBlockHeight(std::string &line);
+    bool readCache(std::vector<InfractionData> &infractions, int &blockHeight);
+    bool writeCache(const InfractionIndex &index, int blockHeight);
+    bool addLine(const std::string &line, std::vector<InfractionData> &infractions);
     bool downloadList(std::list<std::string> &lst, std::string &err);
     std::vector<string> getExplList();
 };
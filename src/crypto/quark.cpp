@@ -0,0 +1,318 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/quark.h"
+
+#include "crypto/sph_blake.h"
+#include "crypto/sph_bmw.h"
+#include "crypto/sph_groestl.h"
+#include "crypto/sph_jh.h"
+#include "crypto/sph_keccak.h"
+#include "crypto/sph_skein.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(ENABLE_AVX2)
+namespace quark_avx2
+{
+void Blake512_4way(unsigned char* const* out, const unsigned char* const* in, size_t len);
+void Bmw512_4way(unsigned char* const* out, const unsigned char* const* in);
+void Jh512_4way(unsigned char* const* out, const unsigned char* const* in);
+void Keccak512_4way(unsigned char* const* out, const unsigned char* const* in);
+void Skein512_4way(unsigned char* const* out, const unsigned char* const* in);
+}
+#endif
+
+#if defined(ENABLE_AESNI)
+namespace quark_aesni
+{
+void Groestl512(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+namespace
+{
+/** Hash n inputs into n 64 byte outputs. Only the first stage sees nLen != 64. */
+typedef void (*StageFn)(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n);
+
+struct QuarkEngine {
+    StageFn blake;
+    StageFn bmw;
+    StageFn groestl;
+    StageFn jh;
+    StageFn keccak;
+    StageFn skein;
+};
+
+void BlakeGeneric(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    static const unsigned char pblank[1] = {0};
+    sph_blake512_context ctx;
+    for (size_t i = 0; i < n; i++) {
+        sph_blake512_init(&ctx);
+        sph_blake512(&ctx, nLen ? in[i] : pblank, nLen);
+        sph_blake512_close(&ctx, out[i]);
+    }
+}
+
+void BmwGeneric(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    sph_bmw512_context ctx;
+    for (size_t i = 0; i < n; i++) {
+        sph_bmw512_init(&ctx);
+        sph_bmw512(&ctx, in[i], nLen);
+        sph_bmw512_close(&ctx, out[i]);
+    }
+}
+
+void GroestlGeneric(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    sph_groestl512_context ctx;
+    for (size_t i = 0; i < n; i++) {
+        sph_groestl512_init(&ctx);
+        sph_groestl512(&ctx, in[i], nLen);
+        sph_groestl512_close(&ctx, out[i]);
+    }
+}
+
+void JhGeneric(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    sph_jh512_context ctx;
+    for (size_t i = 0; i < n; i++) {
+        sph_jh512_init(&ctx);
+        sph_jh512(&ctx, in[i], nLen);
+        sph_jh512_close(&ctx, out[i]);
+    }
+}
+
+void KeccakGeneric(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    sph_keccak512_context ctx;
+    for (size_t i = 0; i < n; i++) {
+        sph_keccak512_init(&ctx);
+        sph_keccak512(&ctx, in[i], nLen);
+        sph_keccak512_close(&ctx, out[i]);
+    }
+}
+
+void SkeinGeneric(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    sph_skein512_context ctx;
+    for (size_t i = 0; i < n; i++) {
+        sph_skein512_init(&ctx);
+        sph_skein512(&ctx, in[i], nLen);
+        sph_skein512_close(&ctx, out[i]);
+    }
+}
+
+#if defined(ENABLE_AVX2)
+/** Run a 4-way kernel over n lanes; a short last group is padded with scratch lanes. */
+template <void (*Fn)(unsigned char* const*, const unsigned char* const*)>
+void Run4Way(unsigned char* const* out, const unsigned char* const* in, size_t n)
+{
+    unsigned char scratch[4][64];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        Fn(out + i, in + i);
+    if (i < n) {
+        unsigned char* pout[4];
+        const unsigned char* pin[4];
+        for (size_t k = 0; k < 4; k++) {
+            pout[k] = i + k < n ? out[i + k] : scratch[k];
+            pin[k] = i + k < n ? in[i + k] : in[i];
+        }
+        Fn(pout, pin);
+    }
+}
+
+void BlakeAVX2(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    // Longer inputs need more than one block; leave those to sphlib.
+    if (nLen > 111) {
+        BlakeGeneric(out, in, nLen, n);
+        return;
+    }
+    unsigned char scratch[4][64];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        quark_avx2::Blake512_4way(out + i, in + i, nLen);
+    if (i < n) {
+        unsigned char* pout[4];
+        const unsigned char* pin[4];
+        for (size_t k = 0; k < 4; k++) {
+            pout[k] = i + k < n ? out[i + k] : scratch[k];
+            pin[k] = i + k < n ? in[i + k] : in[i];
+        }
+        quark_avx2::Blake512_4way(pout, pin, nLen);
+    }
+}
+
+void BmwAVX2(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    Run4Way<quark_avx2::Bmw512_4way>(out, in, n);
+}
+
+void JhAVX2(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    Run4Way<quark_avx2::Jh512_4way>(out, in, n);
+}
+
+void KeccakAVX2(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    Run4Way<quark_avx2::Keccak512_4way>(out, in, n);
+}
+
+void SkeinAVX2(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    Run4Way<quark_avx2::Skein512_4way>(out, in, n);
+}
+#endif
+
+#if defined(ENABLE_AESNI)
+void GroestlAESNI(unsigned char* const* out, const unsigned char* const* in, size_t nLen, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        quark_aesni::Groestl512(out[i], in[i]);
+}
+#endif
+
+QuarkEngine engine = {BlakeGeneric, BmwGeneric, GroestlGeneric, JhGeneric, KeccakGeneric, SkeinGeneric};
+
+/** Number of inputs carried through the chain together. */
+const size_t QUARK_BATCH_LANES = 32;
+
+/** Apply fnSet to the lanes whose input has bit 3 set and fnUnset to the others. */
+void Branch(StageFn fnSet, StageFn fnUnset, unsigned char* const* out, const unsigned char* const* in, size_t n)
+{
+    unsigned char* poutSet[QUARK_BATCH_LANES];
+    unsigned char* poutUnset[QUARK_BATCH_LANES];
+    const unsigned char* pinSet[QUARK_BATCH_LANES];
+    const unsigned char* pinUnset[QUARK_BATCH_LANES];
+    size_t nSet = 0, nUnset = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (in[i][0] & 8) {
+            poutSet[nSet] = out[i];
+            pinSet[nSet++] = in[i];
+        } else {
+            poutUnset[nUnset] = out[i];
+            pinUnset[nUnset++] = in[i];
+        }
+    }
+    if (nSet)
+        fnSet(poutSet, pinSet, 64, nSet);
+    if (nUnset)
+        fnUnset(poutUnset, pinUnset, 64, nUnset);
+}
+
+void HashLanes(const QuarkEngine& e, unsigned char* pout, const unsigned char* pin, size_t nLen, size_t nStride, size_t n)
+{
+    unsigned char bufA[QUARK_BATCH_LANES][64];
+    unsigned char bufB[QUARK_BATCH_LANES][64];
+    unsigned char* a[QUARK_BATCH_LANES];
+    unsigned char* b[QUARK_BATCH_LANES];
+    const unsigned char* in[QUARK_BATCH_LANES];
+    for (size_t i = 0; i < n; i++) {
+        in[i] = pin + i * nStride;
+        a[i] = bufA[i];
+        b[i] = bufB[i];
+    }
+    const unsigned char* const* ca = a;
+    const unsigned char* const* cb = b;
+
+    // Same chain as HashQuark() in hash.h.
+    e.blake(a, in, nLen, n);
+    e.bmw(b, ca, 64, n);
+    Branch(e.groestl, e.skein, a, cb, n);
+    e.groestl(b, ca, 64, n);
+    e.jh(a, cb, 64, n);
+    Branch(e.blake, e.bmw, b, ca, n);
+    e.keccak(a, cb, 64, n);
+    e.skein(b, ca, 64, n);
+    Branch(e.keccak, e.jh, a, cb, n);
+
+    for (size_t i = 0; i < n; i++)
+        memcpy(pout + i * QUARK_OUTPUT_SIZE, bufA[i], QUARK_OUTPUT_SIZE);
+}
+
+bool SelfTest(const QuarkEngine& e)
+{
+    // Compare against sphlib on inputs that exercise every branch combination
+    // and a group size that is not a multiple of the SIMD width.
+    static const QuarkEngine generic = {BlakeGeneric, BmwGeneric, GroestlGeneric, JhGeneric, KeccakGeneric, SkeinGeneric};
+    static const size_t nLanes = 23;
+    unsigned char in[nLanes][80];
+    for (size_t i = 0; i < nLanes; i++)
+        for (size_t j = 0; j < 80; j++)
+            in[i][j] = (unsigned char)(i * 31 + j * 7 + (i ^ j));
+    unsigned char expected[nLanes][QUARK_OUTPUT_SIZE], actual[nLanes][QUARK_OUTPUT_SIZE];
+    for (size_t nLen = 64; nLen <= 80; nLen += 16) {
+        HashLanes(generic, expected[0], in[0], nLen, 80, nLanes);
+        HashLanes(e, actual[0], in[0], nLen, 80, nLanes);
+        if (memcmp(expected, actual, sizeof(expected)) != 0)
+            return false;
+    }
+    return true;
+}
+} // namespace
+
+std::string QuarkAutoDetect()
+{
+    std::string ret = "sphlib";
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+    uint32_t eax, ebx, ecx, edx;
+    bool have_aesni = false, have_avx2 = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        have_aesni = (ecx >> 25) & 1 && (ecx >> 9) & 1; // AES and SSSE3
+        const bool have_xsave = (ecx >> 27) & 1 && (ecx >> 28) & 1; // OSXSAVE and AVX
+        if (have_xsave) {
+            uint32_t xcr0_lo, xcr0_hi;
+            __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            if ((xcr0_lo & 6) == 6 && __get_cpuid_max(0, NULL) >= 7) {
+                __cpuid_count(7, 0, eax, ebx, ecx, edx);
+                have_avx2 = (ebx >> 5) & 1;
+            }
+        }
+    }
+
+    (void)have_aesni;
+    (void)have_avx2;
+
+    QuarkEngine candidate = engine;
+#if defined(ENABLE_AESNI)
+    if (have_aesni) {
+        candidate.groestl = GroestlAESNI;
+        ret += ",groestl-aesni(1way)";
+    }
+#endif
+#if defined(ENABLE_AVX2)
+    if (have_avx2) {
+        candidate.blake = BlakeAVX2;
+        candidate.bmw = BmwAVX2;
+        candidate.jh = JhAVX2;
+        candidate.keccak = KeccakAVX2;
+        candidate.skein = SkeinAVX2;
+        ret += ",avx2(4way)";
+    }
+#endif
+    if (!SelfTest(candidate))
+        return "sphlib (simd self-test failed)";
+    engine = candidate;
+#endif
+    return ret;
+}
+
+void QuarkHashBatch(unsigned char* pout, const unsigned char* pin, size_t nLen, size_t nStride, size_t nCount)
+{
+    while (nCount > 0) {
+        const size_t n = nCount < QUARK_BATCH_LANES ? nCount : QUARK_BATCH_LANES;
+        HashLanes(engine, pout, pin, nLen, nStride, n);
+        pout += n * QUARK_OUTPUT_SIZE;
+        pin += n * nStride;
+        nCount -= n;
+    }
+}
@@ -0,0 +1,24 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_QUARK_H
+#define BITCOIN_CRYPTO_QUARK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** Size in bytes of a Quark hash as used for block headers (the low half of the final 512 bit state). */
+static const size_t QUARK_OUTPUT_SIZE = 32;
+
+/** Select the fastest Quark implementation supported by this CPU and return a description of it.
+ *  Until this is called the portable sphlib implementation is used. Not thread safe; call during startup. */
+std::string QuarkAutoDetect();
+
+/** Compute the Quark hashes of nCount inputs of nLen bytes each, the first starting at pin and the
+ *  following ones nStride bytes apart. QUARK_OUTPUT_SIZE bytes per input are written to pout.
+ *  The result is bit-exact with HashQuark() for every input. */
+void QuarkHashBatch(unsigned char* pout, const unsigned char* pin, size_t nLen, size_t nStride, size_t nCount);
+
+#endif // BITCOIN_CRYPTO_QUARK_H
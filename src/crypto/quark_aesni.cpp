@@ -0,0 +1,148 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Groestl-512 for one 64 byte message using AES-NI. The 8x16 byte state is
+// held row-wise, one row per register: ShiftBytes becomes a byte shuffle,
+// MixBytes a handful of GF(2^8) doublings and xors across rows, and SubBytes
+// is AESENCLAST with a zero key after undoing the AES ShiftRows step.
+
+#ifdef ENABLE_AESNI
+
+#include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+namespace quark_aesni {
+namespace {
+
+const unsigned char SHIFT_P[8] = {0, 1, 2, 3, 4, 5, 6, 11};
+const unsigned char SHIFT_Q[8] = {1, 3, 5, 11, 0, 2, 4, 6};
+
+/** Multiply every byte by 2 in GF(2^8) modulo x^8 + x^4 + x^3 + x + 1. */
+inline __m128i XTime(__m128i x)
+{
+    const __m128i hi = _mm_cmplt_epi8(x, _mm_setzero_si128());
+    return _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(hi, _mm_set1_epi8(0x1b)));
+}
+
+/** Shuffle masks that apply ShiftBytes for each row followed by the inverse of AES ShiftRows. */
+void MakeShuffles(const unsigned char* shift, __m128i* masks)
+{
+    const __m128i inv_shift_rows = _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3);
+    for (int i = 0; i < 8; i++)
+        masks[i] = _mm_and_si128(_mm_add_epi8(inv_shift_rows, _mm_set1_epi8(shift[i])), _mm_set1_epi8(15));
+}
+
+void MixBytes(__m128i* a)
+{
+    __m128i x2[8], x4[8], b[8];
+    for (int i = 0; i < 8; i++) {
+        x2[i] = XTime(a[i]);
+        x4[i] = XTime(x2[i]);
+    }
+    // Row i of circ(02, 02, 03, 04, 05, 03, 05, 07) applied to the column.
+    for (int i = 0; i < 8; i++) {
+        __m128i t = _mm_xor_si128(a[(i + 2) & 7], a[(i + 4) & 7]);
+        t = _mm_xor_si128(t, _mm_xor_si128(a[(i + 5) & 7], a[(i + 6) & 7]));
+        t = _mm_xor_si128(t, a[(i + 7) & 7]);
+        t = _mm_xor_si128(t, _mm_xor_si128(x2[i], x2[(i + 1) & 7]));
+        t = _mm_xor_si128(t, _mm_xor_si128(x2[(i + 2) & 7], x2[(i + 5) & 7]));
+        t = _mm_xor_si128(t, x2[(i + 7) & 7]);
+        t = _mm_xor_si128(t, _mm_xor_si128(x4[(i + 3) & 7], x4[(i + 4) & 7]));
+        t = _mm_xor_si128(t, _mm_xor_si128(x4[(i + 6) & 7], x4[(i + 7) & 7]));
+        b[i] = t;
+    }
+    for (int i = 0; i < 8; i++)
+        a[i] = b[i];
+}
+
+inline void SubShiftBytes(__m128i* a, const __m128i* masks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 8; i++)
+        a[i] = _mm_aesenclast_si128(_mm_shuffle_epi8(a[i], masks[i]), zero);
+}
+
+void PermP(__m128i* a, const __m128i* masks)
+{
+    const __m128i col = _mm_setr_epi8(0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70,
+        (char)0x80, (char)0x90, (char)0xa0, (char)0xb0, (char)0xc0, (char)0xd0, (char)0xe0, (char)0xf0);
+    for (int r = 0; r < 14; r++) {
+        a[0] = _mm_xor_si128(a[0], _mm_xor_si128(col, _mm_set1_epi8((char)r)));
+        SubShiftBytes(a, masks);
+        MixBytes(a);
+    }
+}
+
+void PermQ(__m128i* a, const __m128i* masks)
+{
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i col = _mm_setr_epi8((char)0xff, (char)0xef, (char)0xdf, (char)0xcf, (char)0xbf, (char)0xaf, (char)0x9f, (char)0x8f,
+        0x7f, 0x6f, 0x5f, 0x4f, 0x3f, 0x2f, 0x1f, 0x0f);
+    for (int r = 0; r < 14; r++) {
+        for (int i = 0; i < 7; i++)
+            a[i] = _mm_xor_si128(a[i], ones);
+        a[7] = _mm_xor_si128(a[7], _mm_xor_si128(col, _mm_set1_epi8((char)r)));
+        SubShiftBytes(a, masks);
+        MixBytes(a);
+    }
+}
+
+/** Load a 128 byte column-major block as eight rows. */
+void LoadRows(__m128i* rows, const unsigned char* block)
+{
+    unsigned char t[8][16];
+    for (int j = 0; j < 16; j++)
+        for (int i = 0; i < 8; i++)
+            t[i][j] = block[8 * j + i];
+    for (int i = 0; i < 8; i++)
+        rows[i] = _mm_loadu_si128((const __m128i*)t[i]);
+}
+
+} // namespace
+
+void Groestl512(unsigned char* out, const unsigned char* in)
+{
+    // A 64 byte message pads to exactly one block: 0x80, zeros, block count 1.
+    unsigned char block[128];
+    memcpy(block, in, 64);
+    block[64] = 0x80;
+    memset(block + 65, 0, 62);
+    block[127] = 1;
+
+    __m128i masksP[8], masksQ[8];
+    MakeShuffles(SHIFT_P, masksP);
+    MakeShuffles(SHIFT_Q, masksQ);
+
+    // IV: all zero except the 512 bit output size in the last two bytes (0x02, 0x00).
+    __m128i h[8], p[8], q[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_setzero_si128();
+    h[6] = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02);
+
+    LoadRows(q, block);
+    for (int i = 0; i < 8; i++)
+        p[i] = _mm_xor_si128(h[i], q[i]);
+    PermP(p, masksP);
+    PermQ(q, masksQ);
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p[i], q[i]));
+
+    // Output transformation: truncate P(h) ^ h to its last eight columns.
+    for (int i = 0; i < 8; i++)
+        p[i] = h[i];
+    PermP(p, masksP);
+    unsigned char t[8][16];
+    for (int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*)t[i], _mm_xor_si128(p[i], h[i]));
+    for (int j = 8; j < 16; j++)
+        for (int i = 0; i < 8; i++)
+            out[8 * (j - 8) + i] = t[i][j];
+}
+
+} // namespace quark_aesni
+
+#endif // ENABLE_AESNI
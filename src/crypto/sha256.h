@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,16 @@ public:
     CSHA256& Reset();
 };
 
+/** Select the fastest SHA-256 implementation supported by this CPU and return a description of it.
+ *  Every hardware backend is compared against the portable code first and left unused if it differs.
+ *  Until this is called the portable implementation is used. Not thread safe; call during startup. */
+std::string SHA256AutoDetect();
+
+/** Compute multiple double-SHA256's of 64-byte blobs.
+ *  output: pointer to a blocks*32 byte output buffer
+ *  input:  pointer to a blocks*64 byte input buffer
+ *  blocks: the number of hashes to compute.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
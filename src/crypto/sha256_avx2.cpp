@@ -0,0 +1,156 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 8-way AVX2 double SHA-256 of 64 byte inputs. Every 256-bit register
+// carries the same state word of eight independent messages, so the rounds
+// read like the scalar code in sha256.cpp with vectors in place of uint32_t.
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace sha256d64_avx2 {
+namespace {
+
+/** Eight 32-bit lanes. */
+struct W {
+    __m256i v;
+};
+
+inline W Make(__m256i v) { W r; r.v = v; return r; }
+inline W Set1(uint32_t x) { return Make(_mm256_set1_epi32((int)x)); }
+
+inline W operator+(W a, W b) { return Make(_mm256_add_epi32(a.v, b.v)); }
+inline W operator^(W a, W b) { return Make(_mm256_xor_si256(a.v, b.v)); }
+inline W operator&(W a, W b) { return Make(_mm256_and_si256(a.v, b.v)); }
+inline W operator|(W a, W b) { return Make(_mm256_or_si256(a.v, b.v)); }
+inline W operator>>(W a, int n) { return Make(_mm256_srli_epi32(a.v, n)); }
+inline W operator<<(W a, int n) { return Make(_mm256_slli_epi32(a.v, n)); }
+inline W& operator+=(W& a, W b) { a = a + b; return a; }
+
+inline W Ror(W x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline W Ch(W x, W y, W z) { return z ^ (x & (y ^ z)); }
+inline W Maj(W x, W y, W z) { return (x & y) | (z & (x | y)); }
+inline W Sigma0(W x) { return Ror(x, 2) ^ Ror(x, 13) ^ Ror(x, 22); }
+inline W Sigma1(W x) { return Ror(x, 6) ^ Ror(x, 11) ^ Ror(x, 25); }
+inline W sigma0(W x) { return Ror(x, 7) ^ Ror(x, 18) ^ (x >> 3); }
+inline W sigma1(W x) { return Ror(x, 17) ^ Ror(x, 19) ^ (x >> 10); }
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline void Initialize(W* s)
+{
+    s[0] = Set1(0x6a09e667ul);
+    s[1] = Set1(0xbb67ae85ul);
+    s[2] = Set1(0x3c6ef372ul);
+    s[3] = Set1(0xa54ff53aul);
+    s[4] = Set1(0x510e527ful);
+    s[5] = Set1(0x9b05688cul);
+    s[6] = Set1(0x1f83d9abul);
+    s[7] = Set1(0x5be0cd19ul);
+}
+
+/** One SHA-256 compression of the 16 message words in w, which are overwritten by the schedule. */
+inline void Transform(W* s, W* w)
+{
+    W a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] += sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] + sigma0(w[(i + 1) & 15]);
+        W t1 = h + Sigma1(e) + Ch(e, f, g) + Set1(K[i]) + w[i & 15];
+        W t2 = Sigma0(a) + Maj(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+}
+
+/** Byte order swap within every 32-bit lane. */
+inline W ByteSwap(W x)
+{
+    return Make(_mm256_shuffle_epi8(x.v, _mm256_set_epi32(0x0C0D0E0Ful, 0x08090A0Bul, 0x04050607ul, 0x00010203ul, 0x0C0D0E0Ful, 0x08090A0Bul, 0x04050607ul, 0x00010203ul)));
+}
+
+/** Big-endian word at offset of each of the eight 64 byte inputs. */
+inline W Read8(const unsigned char* in, int offset)
+{
+    return ByteSwap(Make(_mm256_set_epi32(ReadLE32(in + 448 + offset), ReadLE32(in + 384 + offset), ReadLE32(in + 320 + offset), ReadLE32(in + 256 + offset),
+        ReadLE32(in + 192 + offset), ReadLE32(in + 128 + offset), ReadLE32(in + 64 + offset), ReadLE32(in + offset))));
+}
+
+/** Store each lane big-endian at offset of its 32 byte output. */
+inline void Write8(unsigned char* out, int offset, W x)
+{
+    x = ByteSwap(x);
+    WriteLE32(out + offset, _mm256_extract_epi32(x.v, 0));
+    WriteLE32(out + 32 + offset, _mm256_extract_epi32(x.v, 1));
+    WriteLE32(out + 64 + offset, _mm256_extract_epi32(x.v, 2));
+    WriteLE32(out + 96 + offset, _mm256_extract_epi32(x.v, 3));
+    WriteLE32(out + 128 + offset, _mm256_extract_epi32(x.v, 4));
+    WriteLE32(out + 160 + offset, _mm256_extract_epi32(x.v, 5));
+    WriteLE32(out + 192 + offset, _mm256_extract_epi32(x.v, 6));
+    WriteLE32(out + 224 + offset, _mm256_extract_epi32(x.v, 7));
+}
+
+} // namespace
+
+void Transform_8way(unsigned char* out, const unsigned char* in)
+{
+    W s[8], w[16];
+
+    // The 64 byte inputs
+    Initialize(s);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read8(in, 4 * i);
+    Transform(s, w);
+
+    // Their padding block: 0x80, zeros and the 512 bit length
+    w[0] = Set1(0x80000000ul);
+    for (int i = 1; i < 15; i++)
+        w[i] = Set1(0);
+    w[15] = Set1(0x200);
+    Transform(s, w);
+
+    // The 32 byte digests, padded to one block
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = Set1(0x80000000ul);
+    for (int i = 9; i < 15; i++)
+        w[i] = Set1(0);
+    w[15] = Set1(0x100);
+    Initialize(s);
+    Transform(s, w);
+
+    for (int i = 0; i < 8; i++)
+        Write8(out, 4 * i, s[i]);
+}
+
+} // namespace sha256d64_avx2
+
+#endif // ENABLE_AVX2
@@ -0,0 +1,164 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// SHA-256 using the x86 SHA extensions. SHA256RNDS2 runs two rounds on a
+// state split over two registers as ABEF and CDGH, and SHA256MSG1/MSG2
+// extend the message schedule four words at a time. The 2-way double hash
+// interleaves two independent messages to hide the instruction latency.
+
+#ifdef ENABLE_SHANI
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t INIT[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+
+/** Byte order swap within every 32-bit word. */
+inline __m128i ByteSwap(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull));
+}
+
+inline __m128i Load(const unsigned char* in)
+{
+    return ByteSwap(_mm_loadu_si128((const __m128i*)in));
+}
+
+/** State words a..h in two registers to ABEF and CDGH. */
+inline void Shuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+}
+
+/** ABEF and CDGH back to a..h. */
+inline void Unshuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0x1B);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 0x08);
+}
+
+/**
+ * 64 rounds for N independent lanes, interleaved. s0/s1 hold each lane's
+ * shuffled state and m its 16 message words, which are overwritten by the
+ * schedule. After quad round q, message quad q + 1 is completed (MSG2) and
+ * the first half of quad q + 3 is started (MSG1).
+ */
+template <int N>
+inline void Transform(__m128i* s0, __m128i* s1, __m128i (*m)[4])
+{
+    __m128i so0[N], so1[N];
+    for (int l = 0; l < N; l++) {
+        so0[l] = s0[l];
+        so1[l] = s1[l];
+    }
+    for (int q = 0; q < 16; q++) {
+        const __m128i k = _mm_loadu_si128((const __m128i*)(K + 4 * q));
+        for (int l = 0; l < N; l++) {
+            const __m128i msg = _mm_add_epi32(m[l][q & 3], k);
+            s1[l] = _mm_sha256rnds2_epu32(s1[l], s0[l], msg);
+            s0[l] = _mm_sha256rnds2_epu32(s0[l], s1[l], _mm_shuffle_epi32(msg, 0x0E));
+        }
+        for (int l = 0; l < N; l++) {
+            __m128i& mPrev = m[l][(q + 3) & 3];
+            __m128i& mCur = m[l][q & 3];
+            __m128i& mNext = m[l][(q + 1) & 3];
+            if (q >= 3 && q <= 14)
+                mNext = _mm_sha256msg2_epu32(_mm_add_epi32(mNext, _mm_alignr_epi8(mCur, mPrev, 4)), mCur);
+            if (q >= 1 && q <= 12)
+                mPrev = _mm_sha256msg1_epu32(mPrev, mCur);
+        }
+    }
+    for (int l = 0; l < N; l++) {
+        s0[l] = _mm_add_epi32(s0[l], so0[l]);
+        s1[l] = _mm_add_epi32(s1[l], so1[l]);
+    }
+}
+
+inline void Initialize(__m128i& s0, __m128i& s1)
+{
+    s0 = _mm_loadu_si128((const __m128i*)INIT);
+    s1 = _mm_loadu_si128((const __m128i*)(INIT + 4));
+    Shuffle(s0, s1);
+}
+
+} // namespace
+
+namespace sha256_shani {
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    __m128i s0 = _mm_loadu_si128((const __m128i*)s);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)(s + 4));
+    Shuffle(s0, s1);
+    while (blocks--) {
+        __m128i m[1][4];
+        for (int i = 0; i < 4; i++)
+            m[0][i] = Load(chunk + 16 * i);
+        ::Transform<1>(&s0, &s1, m);
+        chunk += 64;
+    }
+    Unshuffle(s0, s1);
+    _mm_storeu_si128((__m128i*)s, s0);
+    _mm_storeu_si128((__m128i*)(s + 4), s1);
+}
+} // namespace sha256_shani
+
+namespace sha256d64_shani {
+void Transform_2way(unsigned char* out, const unsigned char* in)
+{
+    __m128i s0[2], s1[2], m[2][4];
+
+    // The 64 byte inputs
+    for (int l = 0; l < 2; l++) {
+        Initialize(s0[l], s1[l]);
+        for (int i = 0; i < 4; i++)
+            m[l][i] = Load(in + 64 * l + 16 * i);
+    }
+    ::Transform<2>(s0, s1, m);
+
+    // Their padding block: 0x80, zeros and the 512 bit length
+    for (int l = 0; l < 2; l++) {
+        m[l][0] = _mm_set_epi32(0, 0, 0, 0x80000000ul);
+        m[l][1] = _mm_setzero_si128();
+        m[l][2] = _mm_setzero_si128();
+        m[l][3] = _mm_set_epi32(0x200, 0, 0, 0);
+    }
+    ::Transform<2>(s0, s1, m);
+
+    // The 32 byte digests, padded to one block
+    for (int l = 0; l < 2; l++) {
+        Unshuffle(s0[l], s1[l]);
+        m[l][0] = s0[l];
+        m[l][1] = s1[l];
+        m[l][2] = _mm_set_epi32(0, 0, 0, 0x80000000ul);
+        m[l][3] = _mm_set_epi32(0x100, 0, 0, 0);
+        Initialize(s0[l], s1[l]);
+    }
+    ::Transform<2>(s0, s1, m);
+
+    for (int l = 0; l < 2; l++) {
+        Unshuffle(s0[l], s1[l]);
+        _mm_storeu_si128((__m128i*)(out + 32 * l), ByteSwap(s0[l]));
+        _mm_storeu_si128((__m128i*)(out + 32 * l + 16), ByteSwap(s1[l]));
+    }
+}
+} // namespace sha256d64_shani
+
+#endif // ENABLE_SHANI
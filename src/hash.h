@@ -8,6 +8,7 @@
 #ifndef BITCOIN_HASH_H
 #define BITCOIN_HASH_H
 
+#include "crypto/quark.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha256.h"
 #include "serialize.h"
@@ -324,6 +325,37 @@ uint256 SerializeHash(const T& obj, int nType = SER_GETHASH, int nVersion = PROT
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4, a keyed hash of short inputs. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash a 64-bit integer worth of data
+     *  It is treated as if this was the little-endian interpretation of 8 bytes.
+     *  This function can only be used when a multiple of 8 bytes have been written so far.
+     */
+    CSipHasher& Write(uint64_t data);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched. */
+    uint64_t Finalize() const;
+};
+
+/** Optimized SipHash-2-4 implementation for uint256.
+ *
+ *  It is identical to:
+ *    CSipHasher(k0, k1)
+ *      .Write(val.Get64(0))
+ *      .Write(val.Get64(1))
+ *      .Write(val.Get64(2))
+ *      .Write(val.Get64(3))
+ *      .Finalize()
+ */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
@@ -416,6 +448,14 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     return hash[8].trim256();
 }
 
+/** HashQuark() of nCount inputs of nLen bytes laid out nStride bytes apart, using the
+ *  implementation selected by QuarkAutoDetect(). */
+inline void HashQuarkBatch(uint256* pout, const unsigned char* pin, size_t nLen, size_t nStride, size_t nCount)
+{
+    static_assert(sizeof(uint256) == QUARK_OUTPUT_SIZE, "uint256 must be tightly packed");
+    QuarkHashBatch((unsigned char*)pout, pin, nLen, nStride, nCount);
+}
+
 template<typename T1>
 inline uint256 HashBlake(const T1 pbegin, const T1 pend)
 {
@@ -3,9 +3,15 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
+#include "checkqueue.h"
+#include "crypto/common.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -239,14 +245,81 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Kernel modifier index: for each block of the active chain, the first later
+// block that generated a stake modifier at least a selection interval after it.
+// Blocks still waiting for such a block are kept by that deadline, so connecting
+// a block resolves exactly the entries it finishes.
+static CCriticalSection cs_kernelModifierIndex;
+static std::vector<const CBlockIndex*> vKernelModifierChain;    // mirror of chainActive
+static std::vector<const CBlockIndex*> vKernelModifierFrom;     // NULL while unresolved
+static std::vector<std::vector<int> > vKernelModifierResolved;  // heights resolved by each block
+static std::multimap<int64_t, int> mapKernelModifierPending;    // deadline -> height
+
+static void KernelModifierIndexConnect(const CBlockIndex* pindex)
+{
+    const int nHeight = vKernelModifierChain.size();
+    vKernelModifierChain.push_back(pindex);
+    vKernelModifierFrom.push_back(NULL);
+    vKernelModifierResolved.push_back(std::vector<int>());
+    if (pindex->GeneratedStakeModifier()) {
+        std::multimap<int64_t, int>::iterator it = mapKernelModifierPending.begin();
+        while (it != mapKernelModifierPending.end() && it->first <= pindex->GetBlockTime()) {
+            vKernelModifierFrom[it->second] = pindex;
+            vKernelModifierResolved[nHeight].push_back(it->second);
+            mapKernelModifierPending.erase(it++);
+        }
+    }
+    mapKernelModifierPending.insert(std::make_pair(pindex->GetBlockTime() + GetStakeModifierSelectionInterval(), nHeight));
+}
+
+static void KernelModifierIndexDisconnect()
+{
+    const int nHeight = vKernelModifierChain.size() - 1;
+    const CBlockIndex* pindex = vKernelModifierChain.back();
+    std::pair<std::multimap<int64_t, int>::iterator, std::multimap<int64_t, int>::iterator> range =
+        mapKernelModifierPending.equal_range(pindex->GetBlockTime() + GetStakeModifierSelectionInterval());
+    for (std::multimap<int64_t, int>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == nHeight) {
+            mapKernelModifierPending.erase(it);
+            break;
+        }
+    }
+    BOOST_FOREACH (int nResolved, vKernelModifierResolved[nHeight]) {
+        vKernelModifierFrom[nResolved] = NULL;
+        mapKernelModifierPending.insert(std::make_pair(vKernelModifierChain[nResolved]->GetBlockTime() + GetStakeModifierSelectionInterval(), nResolved));
+    }
+    vKernelModifierChain.pop_back();
+    vKernelModifierFrom.pop_back();
+    vKernelModifierResolved.pop_back();
+}
+
+void UpdateKernelModifierIndex()
+{
+    LOCK(cs_kernelModifierIndex);
+    while (!vKernelModifierChain.empty() && ((int)vKernelModifierChain.size() > chainActive.Height() + 1 || chainActive[vKernelModifierChain.size() - 1] != vKernelModifierChain.back()))
+        KernelModifierIndexDisconnect();
+    while ((int)vKernelModifierChain.size() <= chainActive.Height())
+        KernelModifierIndexConnect(chainActive[vKernelModifierChain.size()]);
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool /*fPrintProofOfStake*/)
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
 {
+    {
+        LOCK(cs_kernelModifierIndex);
+        const int nHeight = pindexFrom->nHeight;
+        if (nHeight >= 0 && nHeight < (int)vKernelModifierChain.size() && vKernelModifierChain[nHeight] == pindexFrom && vKernelModifierFrom[nHeight]) {
+            const CBlockIndex* pindex = vKernelModifierFrom[nHeight];
+            nStakeModifier = pindex->nStakeModifier;
+            nStakeModifierHeight = pindex->nHeight;
+            nStakeModifierTime = pindex->GetBlockTime();
+            return true;
+        }
+    }
+
+    // Not in the index, or no block far enough ahead yet: walk the chain
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
-        return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
@@ -271,29 +344,84 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
     return true;
 }
 
-uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom)
+CStakeKernel::CStakeKernel() : nStakeModifier(0), nStakeModifierHeight(0), nStakeModifierTime(0), nTimeBlockFrom(0)
+{
+}
+
+bool CStakeKernel::Init(const CBlockIndex* pindexFrom, const COutPoint& prevout, int64_t nValueIn, unsigned int nBits)
+{
+    if (!GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime))
+        return false;
+    nTimeBlockFrom = pindexFrom->GetBlockTime();
+
+    // The kernel hashes the modifier, block time and prevout (XCurrency hashes in the prevout to
+    // make each hash unique), followed by nTimeTx
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << prevout.n << prevout.hash;
+    hasher.Reset().Write((const unsigned char*)&ss[0], ss.size());
+
+    // The target is weighted by the coin amount, with a 256 bit wraparound
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    bnTarget = (uint256(nValueIn) / 100) * bnTargetPerCoinDay;
+    return true;
+}
+
+uint256 CStakeKernel::GetHash(unsigned int nTimeTx) const
 {
-    //XCurrency will hash in the transaction hash and the index number in order to make sure each hash is unique
-    ss << nTimeBlockFrom << prevoutIndex << prevoutHash << nTimeTx;
-    return Hash(ss.begin(), ss.end());
+    unsigned char vchTime[4];
+    WriteLE32(vchTime, nTimeTx);
+    uint256 hash;
+    CSHA256 sha(hasher);
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    sha.Write(vchTime, sizeof(vchTime)).Finalize(buf);
+    sha.Reset().Write(buf, sizeof(buf)).Finalize((unsigned char*)&hash);
+    return hash;
 }
 
-//test hash vs target
-bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay)
+bool CStakeKernel::Search(unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake) const
 {
-    //get the stake weight - weight is equal to coin amount
-    uint256 bnCoinDayWeight = uint256(nValueIn) / 100;
+    for (unsigned int i = 0; i < nHashDrift; i++) {
+        unsigned int nTryTime = nTimeTx + nHashDrift - i;
+        hashProofOfStake = GetHash(nTryTime);
+        if (IsTargetHit(hashProofOfStake)) {
+            nTimeTx = nTryTime;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Kernels prepared by the stake search, reused until the tip or difficulty changes
+static CCriticalSection cs_mapStakeKernels;
+static std::map<COutPoint, CStakeKernel> mapStakeKernels;
+static uint256 hashStakeKernelsTip;
+static unsigned int nStakeKernelsBits = 0;
 
-    // Now check if proof-of-stake hash meets target protocol
-    return (uint256(hashProofOfStake) < bnCoinDayWeight * bnTargetPerCoinDay);
+// Look up or prepare the search kernel for an output
+static bool GetStakeKernel(const CBlockIndex* pindexFrom, const COutPoint& prevout, int64_t nValueIn, unsigned int nBits, CStakeKernel& kernel)
+{
+    LOCK(cs_mapStakeKernels);
+    const uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    if (hashStakeKernelsTip != hashTip || nStakeKernelsBits != nBits) {
+        mapStakeKernels.clear();
+        hashStakeKernelsTip = hashTip;
+        nStakeKernelsBits = nBits;
+    }
+    std::map<COutPoint, CStakeKernel>::const_iterator it = mapStakeKernels.find(prevout);
+    if (it != mapStakeKernels.end()) {
+        kernel = it->second;
+        return true;
+    }
+    if (!kernel.Init(pindexFrom, prevout, nValueIn, nBits))
+        return false;
+    mapStakeKernels[prevout] = kernel;
+    return true;
 }
 
-//instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake)
 {
-    //assign new variables to make it easier to read
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    unsigned int nTimeBlockFrom = pindexFrom->GetBlockTime();
 
     if (nTimeTx < nTimeBlockFrom) // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
@@ -301,100 +429,192 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation - nTimeBlockFrom=%d nStakeMinAge=%d nTimeTx=%d", nTimeBlockFrom, nStakeMinAge, nTimeTx);
 
-    //grab difficulty
-    uint256 bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-
-    //grab stake modifier
-    uint64_t nStakeModifier = 0;
-    int nStakeModifierHeight = 0;
-    int64_t nStakeModifierTime = 0;
-    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
+    CStakeKernel kernel;
+    if (!kernel.Init(pindexFrom, prevout, nValueIn, nBits)) {
         LogPrintf("CheckStakeKernelHash(): failed to get kernel stake modifier \n");
         return false;
     }
+    hashProofOfStake = kernel.GetHash(nTimeTx);
+    return kernel.IsTargetHit(hashProofOfStake);
+}
 
-    //create data stream once instead of repeating it in the loop
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier;
+int nStakeThreads = 0;
+std::atomic<uint64_t> nStakeTipSequence(0);
+
+namespace
+{
+// Shared state of one kernel search. Everything read from the chain is
+// prepared under cs_main before the search starts, so the search itself
+// only hashes.
+struct CStakeSearch {
+    unsigned int nTimeTx;
+    unsigned int nHashDrift;
+    int64_t nMedianTimePast;
+    uint64_t nTipSequence; // nStakeTipSequence of the tip the kernels were prepared on
+    std::vector<CStakeKernel> vKernels;
+    std::vector<char> vfReady; // kernel prepared and the output old enough
+
+    std::atomic<size_t> nBest; // lowest candidate with a hit so far
+    std::vector<std::pair<unsigned int, uint256> > vResult; // hit per candidate, valid for nBest
+
+    CStakeSearch(size_t nCandidates) : vKernels(nCandidates), vfReady(nCandidates, false), nBest(nCandidates), vResult(nCandidates) {}
+};
+
+// Search candidates [nStart, nEnd) in order. A range stops early for
+// candidates after the lowest hit, so the lowest hit always wins, and
+// once the tip has moved, as no hit is used then.
+void StakeSearchRange(CStakeSearch& search, size_t nStart, size_t nEnd)
+{
+    for (size_t i = nStart; i < nEnd && i < search.nBest; i++) {
+        if (!search.vfReady[i])
+            continue;
+        if (nStakeTipSequence.load(std::memory_order_relaxed) != search.nTipSequence)
+            return;
+        unsigned int nTimeHit = search.nTimeTx;
+        uint256 hashProofOfStake;
+        // A hit at or before the median time past would be rejected, as would any
+        // earlier time for the same output
+        if (!search.vKernels[i].Search(nTimeHit, search.nHashDrift, hashProofOfStake) || nTimeHit <= search.nMedianTimePast)
+            continue;
+        search.vResult[i] = std::make_pair(nTimeHit, hashProofOfStake);
+        size_t nBest = search.nBest;
+        while (i < nBest && !search.nBest.compare_exchange_weak(nBest, i)) {
+        }
+        return;
+    }
+}
+
+// A chunk of candidates, queued on the stake search threads
+class CStakeSearchCheck
+{
+private:
+    CStakeSearch* psearch;
+    size_t nStart;
+    size_t nEnd;
 
-    //if wallet is simply checking to make sure a hash is valid
-    if (fCheck) {
-        hashProofOfStake = stakeHash(nTimeTx, ss, prevout.n, prevout.hash, nTimeBlockFrom);
-        return stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay);
+public:
+    CStakeSearchCheck() : psearch(NULL), nStart(0), nEnd(0) {}
+    CStakeSearchCheck(CStakeSearch* psearchIn, size_t nStartIn, size_t nEndIn) : psearch(psearchIn), nStart(nStartIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        StakeSearchRange(*psearch, nStart, nEnd);
+        return true;
     }
 
-    bool fSuccess = false;
-    unsigned int nTryTime = 0;
-    unsigned int i;
-    for (i = 0; i < (nHashDrift); i++) //iterate the hashing
+    void swap(CStakeSearchCheck& check)
     {
-        //hash this iteration
-        nTryTime = nTimeTx + nHashDrift - i;
-        hashProofOfStake = stakeHash(nTryTime, ss, prevout.n, prevout.hash, nTimeBlockFrom);
+        std::swap(psearch, check.psearch);
+        std::swap(nStart, check.nStart);
+        std::swap(nEnd, check.nEnd);
+    }
+};
 
-        // if stake hash does not meet the target then continue to next iteration
-        if (!stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay))
-            continue;
+const size_t STAKE_SEARCH_CHUNK = 16;
+
+CCheckQueue<CStakeSearchCheck> stakesearchqueue(1);
+} // namespace
+
+void ThreadStakeSearch()
+{
+    RenameThread("xcurrency-stakesearch");
+    stakesearchqueue.Thread();
+}
+
+int SearchStakeKernels(const std::vector<CStakeCandidate>& vCandidates, unsigned int nBits, unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake, bool fParallel)
+{
+    CStakeSearch search(vCandidates.size());
+    search.nTimeTx = nTimeTx;
+    search.nHashDrift = nHashDrift;
+
+    // The stake modifiers come from chainActive and the kernel modifier index,
+    // so prepare every kernel under cs_main
+    const CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+        search.nTipSequence = nStakeTipSequence;
+        search.nMedianTimePast = pindexTip->GetMedianTimePast();
+        for (size_t i = 0; i < vCandidates.size(); i++) {
+            const CStakeCandidate& candidate = vCandidates[i];
+            if (nTimeTx < candidate.pindexFrom->GetBlockTime() + nStakeMinAge)
+                continue;
+            search.vfReady[i] = GetStakeKernel(candidate.pindexFrom, candidate.prevout, candidate.nValue, nBits, search.vKernels[i]);
+        }
+    }
 
-        fSuccess = true; // if we make it this far then we have successfully created a stake hash
-        nTimeTx = nTryTime;
-
-        if (fDebug || fPrintProofOfStake) {
-            LogPrintf("CheckStakeKernelHash() : using modifier %s at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
-                boost::lexical_cast<std::string>(nStakeModifier).c_str(), nStakeModifierHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
-                mapBlockIndex[blockFrom.GetHash()]->nHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", blockFrom.GetBlockTime()).c_str());
-            LogPrintf("CheckStakeKernelHash() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-                "0.3",
-                boost::lexical_cast<std::string>(nStakeModifier).c_str(),
-                nTimeBlockFrom, prevout.hash.ToString().c_str(), nTimeBlockFrom, prevout.n, nTryTime,
-                hashProofOfStake.ToString().c_str());
+    // Only worth handing out when there is more than a chunk to search
+    if (fParallel && nStakeThreads && vCandidates.size() > STAKE_SEARCH_CHUNK) {
+        CCheckQueueControl<CStakeSearchCheck> control(&stakesearchqueue);
+        std::vector<CStakeSearchCheck> vChecks;
+        // The queue is taken from the back, so add the last chunk first
+        for (size_t nStart = (vCandidates.size() - 1) / STAKE_SEARCH_CHUNK * STAKE_SEARCH_CHUNK;; nStart -= STAKE_SEARCH_CHUNK) {
+            vChecks.push_back(CStakeSearchCheck(&search, nStart, std::min(nStart + STAKE_SEARCH_CHUNK, vCandidates.size())));
+            if (nStart == 0)
+                break;
         }
-        break;
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        StakeSearchRange(search, 0, vCandidates.size());
     }
 
     mapHashedBlocks.clear();
-    mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
-    return fSuccess;
+    mapHashedBlocks[pindexTip->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+
+    // A hit on a stale tip is of no use
+    if (search.nBest == vCandidates.size() || nStakeTipSequence != search.nTipSequence)
+        return -1;
+    nTimeTx = search.vResult[search.nBest].first;
+    hashProofOfStake = search.vResult[search.nBest].second;
+    return search.nBest;
+}
+
+// Find the output a coinstake kernel spends and the block that created it
+static bool GetKernelOutput(const COutPoint& prevout, CTxOut& txoutPrev, const CBlockIndex*& pindexFrom)
+{
+    // The coins view has the output and its height, so the common case needs
+    // no block file access at all
+    const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+    if (coins && coins->IsAvailable(prevout.n) && coins->nHeight >= 0 && coins->nHeight <= chainActive.Height()) {
+        txoutPrev = coins->vout[prevout.n];
+        pindexFrom = chainActive[coins->nHeight];
+        return true;
+    }
+
+    // Spent in the active chain, e.g. a block building on a fork: look the transaction up
+    uint256 hashBlock;
+    CTransaction txPrev;
+    if (!GetTransaction(prevout.hash, txPrev, hashBlock, true) || prevout.n >= txPrev.vout.size())
+        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+    if (it == mapBlockIndex.end())
+        return error("CheckProofOfStake() : read block failed");
+    txoutPrev = txPrev.vout[prevout.n];
+    pindexFrom = it->second;
+    return true;
 }
 
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake)
 {
-    const CTransaction tx = block.vtx[1];
+    const CTransaction& tx = block.vtx[1];
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString().c_str());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    CTxOut txoutPrev;
+    const CBlockIndex* pindexFrom = NULL;
+    if (!GetKernelOutput(txin.prevout, txoutPrev, pindexFrom))
+        return false;
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, txoutPrev.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
-
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
-    unsigned int nInterval = 0;
-    unsigned int nTime = block.nTime;
-    if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(block.nBits, pindexFrom, txoutPrev.nValue, txin.prevout, block.nTime, hashProofOfStake))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s \n", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -4,8 +4,11 @@
 #ifndef BITCOIN_KERNEL_H
 #define BITCOIN_KERNEL_H
 
+#include "crypto/sha256.h"
 #include "main.h"
 
+#include <atomic>
+
 
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 static const unsigned int MODIFIER_INTERVAL = 60;
@@ -20,15 +23,69 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Bring the kernel modifier index in line with chainActive; called whenever the tip is set
+void UpdateKernelModifierIndex();
+
+// Get the stake modifier used to hash a kernel spending an output created in pindexFrom
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime);
+
+// Stake kernel of a single output with everything except the coinstake time
+// precomputed: the hasher already holds the modifier, block time and prevout,
+// and the coin day weight is folded into the target.
+class CStakeKernel
+{
+private:
+    CSHA256 hasher;
+    uint256 bnTarget;
+
+public:
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    unsigned int nTimeBlockFrom;
+
+    CStakeKernel();
+
+    bool Init(const CBlockIndex* pindexFrom, const COutPoint& prevout, int64_t nValueIn, unsigned int nBits);
+    uint256 GetHash(unsigned int nTimeTx) const;
+    bool IsTargetHit(const uint256& hashProofOfStake) const { return hashProofOfStake < bnTarget; }
+
+    // Try nTimeTx + nHashDrift down to nTimeTx + 1; on success nTimeTx is set to the hit
+    bool Search(unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake) const;
+};
+
+// Threads used to search for a stake kernel, including the staking thread itself
+static const int DEFAULT_STAKE_THREADS = 0;
+static const int MAX_STAKE_THREADS = 16;
+extern int nStakeThreads;
+
+// Bumped under cs_main whenever the active tip moves, so a search on an older tip stops early
+extern std::atomic<uint64_t> nStakeTipSequence;
+
+// An output the stake search may use as kernel
+struct CStakeCandidate {
+    const CBlockIndex* pindexFrom;
+    COutPoint prevout;
+    int64_t nValue;
+};
+
+// Find the first candidate with a kernel hit in (nTimeTx, nTimeTx + nHashDrift] that is
+// later than the median time past of the tip. The kernels are prepared under cs_main,
+// then searched on the stake search threads, or serially for a handful of candidates.
+// Gives the same result as trying the candidates one by one in order. Fails if the tip
+// changed during the search. Returns the candidate index, or -1 if there is none.
+int SearchStakeKernels(const std::vector<CStakeCandidate>& vCandidates, unsigned int nBits, unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake, bool fParallel = true);
+
+// Worker thread of the stake search, nStakeThreads - 1 of them are started
+void ThreadStakeSearch();
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
-uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom);
-bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake);
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
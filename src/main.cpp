@@ -11,6 +11,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -20,6 +21,7 @@
 #include "servicenode-payments.h"
 #include "servicenodeman.h"
 #include "merkleblock.h"
+#include "msgdispatcher.h"
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
@@ -32,12 +34,14 @@
 #include "utilmoneystr.h"
 #include "coinvalidator.h"
 
+#include <atomic>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -70,6 +74,7 @@ bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
+bool fCompactBlocks = DEFAULT_COMPACT_BLOCKS;
 CoinValidator &coinValidator = CoinValidator::instance();
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -162,9 +167,13 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, set while waiting for the blocktxn of a cmpctblock.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+/** Peers asked to announce new blocks with cmpctblock, least recent block provider first. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
@@ -363,6 +372,7 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -382,7 +392,7 @@ void MarkBlockAsReceived(const uint256& hash)
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, list<QueuedBlock>::iterator* pit = NULL)
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
@@ -390,11 +400,44 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, boost::shared_ptr<PartiallyDownloadedBlock>()};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
+}
+
+/**
+ * Ask pfrom, which just provided our new tip, to announce its next blocks
+ * with cmpctblock. The MAX_COMPACT_BLOCK_ANNOUNCERS peers that did so most
+ * recently keep that role; the one that did longest ago goes back to inv.
+ * Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    if (!fCompactBlocks || !pfrom->fSupportsCompactBlocks)
+        return;
+    NodeId nodeid = pfrom->GetId();
+    for (list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == nodeid) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+            return;
+        }
+    }
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_COMPACT_BLOCK_ANNOUNCERS) {
+        NodeId oldest = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == oldest)
+                pnode->PushMessage("sendcmpct", false, SHORT_IDS_BLOCKS_ENCODING_VERSION);
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, SHORT_IDS_BLOCKS_ENCODING_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -966,6 +1009,56 @@ bool GetCoinAge(const CTransaction& tx, const unsigned int nTxTime, uint64_t& nC
     return true;
 }
 
+/**
+ * Outputs of transactions on the coin validator's infraction list. Transactions never change,
+ * so entries never go stale, and only flagged txids are ever added, which keeps this bounded.
+ */
+static std::map<uint256, std::vector<CTxOut> > mapInfractionTxOuts;
+static CCriticalSection cs_mapInfractionTxOuts;
+
+/**
+ * Look up a flagged output for redeem verification without reading its block from disk when possible:
+ * first the outputs seen before, then the UTXO set, and only then a (slow) transaction lookup.
+ */
+static bool GetInfractionTxOut(const COutPoint& prevout, CTxOut& txOut)
+{
+    {
+        LOCK(cs_mapInfractionTxOuts);
+        std::map<uint256, std::vector<CTxOut> >::const_iterator it = mapInfractionTxOuts.find(prevout.hash);
+        if (it != mapInfractionTxOuts.end()) {
+            if (prevout.n >= (*it).second.size())
+                return false;
+            txOut = (*it).second[prevout.n];
+            return true;
+        }
+    }
+
+    {
+        LOCK(cs_main);
+        const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+        if (coins && coins->IsAvailable(prevout.n)) {
+            txOut = coins->vout[prevout.n];
+            return true;
+        }
+    }
+
+    // Spent or unknown, fall back to finding the transaction itself and remember all of its outputs
+    CTransaction prevtx;
+    uint256 prevblock;
+    if (!GetTransaction(prevout.hash, prevtx, prevblock, true) || prevtx.IsNull())
+        return false;
+
+    {
+        LOCK(cs_mapInfractionTxOuts);
+        mapInfractionTxOuts[prevout.hash] = prevtx.vout;
+    }
+
+    if (prevout.n >= prevtx.vout.size())
+        return false;
+    txOut = prevtx.vout[prevout.n];
+    return true;
+}
+
 bool CheckTransaction(const CTransaction& tx, CValidationState& state)
 {
     // Basic checks that don't depend on any context
@@ -1002,7 +1095,7 @@ bool CheckTransaction(const CTransaction& tx, CValidationState& state)
 
         // Track all valid recipients
         if (!txout.IsEmpty())
-            recipients.emplace_back(tx.GetHash().ToString(), txout.scriptPubKey, txout.nValue);
+            recipients.emplace_back(tx.GetHash(), txout.scriptPubKey, txout.nValue);
     }
 
     // Bad stake inputs
@@ -1018,14 +1111,14 @@ bool CheckTransaction(const CTransaction& tx, CValidationState& state)
         // Check for bad stake inputs
         if (chainActive.Height() >= CoinValidator::CHAIN_HEIGHT) {
             if (!coinValidator.IsCoinValid(txin.prevout.hash)) {
-                CTransaction prevtx; uint256 prevblock;
+                CTxOut prevout;
                 // If bad transaction or bad prev tx then reject tx
-                if (!GetTransaction(txin.prevout.hash, prevtx, prevblock, true) || prevtx.IsNull()) {
+                if (!GetInfractionTxOut(txin.prevout, prevout)) {
                     return state.DoS(100, error("CheckTransaction() : bad inputs"),
                                      REJECT_INVALID, "bad-txns-inputs-stake");
                 }
                 // Track exploited coin
-                exploited.emplace_back(prevtx.GetHash().ToString(), prevtx.vout[txin.prevout.n].scriptPubKey, prevtx.vout[txin.prevout.n].nValue);
+                exploited.emplace_back(txin.prevout.hash, prevout.scriptPubKey, prevout.nValue);
             }
         }
 
@@ -1113,7 +1206,22 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+/** Expire old transactions and evict the cheapest ones until the pool fits in -maxmempool */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    list<CTransaction> removed;
+    int expired = pool.Expire(GetTime() - age, &removed);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit, &removed);
+
+    // Wallet transactions that left the pool are no longer counted as unconfirmed
+    BOOST_FOREACH (const CTransaction& tx, removed)
+        SyncWithWallets(tx, NULL);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1237,7 +1345,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1251,6 +1359,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // Once the pool has had to evict, it takes more than the relay fee to get in,
+            // whatever the caller's -limitfreerelay exemption
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1285,6 +1401,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Keep in-pool packages small, block assembly and eviction walk them whole
+        {
+            LOCK(pool.cs);
+            std::set<uint256> setAncestors;
+            std::string errString;
+            if (!pool.CalculateMemPoolAncestors(tx, nSize, setAncestors,
+                    GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT), GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                    GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT), GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), errString),
+                    REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
@@ -1306,6 +1434,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // Trim the pool and check whether the transaction survived
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1530,7 +1665,17 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
-                hashBlock = header.GetHash();
+                // The containing block is normally on the active chain right after
+                // hashPrevBlock; take its hash from the index instead of rehashing.
+                hashBlock = 0;
+                BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+                if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second)) {
+                    CBlockIndex* pindexTx = chainActive.Next(mi->second);
+                    if (pindexTx && pindexTx->GetBlockPos() == postx)
+                        hashBlock = pindexTx->GetBlockHash();
+                }
+                if (hashBlock == 0)
+                    hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
                     return error("%s : txid mismatch", __func__);
                 return true;
@@ -1622,14 +1767,65 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash()) {
-        LogPrintf("%s : block=%s index=%s\n", __func__, block.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
+    uint256 hashBlock = block.GetHash();
+    if (hashBlock != pindex->GetBlockHash()) {
+        LogPrintf("%s : block=%s index=%s\n", __func__, hashBlock.ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
     }
     return true;
 }
 
 
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos)
+{
+    // WriteBlockToDisk puts the message start and the block size in front of the block
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("ReadRawBlockFromDisk : invalid block position %u in file %d", pos.nPos, pos.nFile);
+    CDiskBlockPos posHeader(pos.nFile, pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int));
+
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk : OpenBlockFile failed");
+
+    size_t nStart = ss.size();
+    try {
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("ReadRawBlockFromDisk : no message start at %u in file %d", posHeader.nPos, posHeader.nFile);
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk : invalid block size %u at %u in file %d", nSize, pos.nPos, pos.nFile);
+
+        // Read the block straight into the end of the stream
+        ss.resize(nStart + nSize);
+        filein.read((char*)&ss[nStart], nSize);
+    } catch (std::exception& e) {
+        ss.resize(nStart);
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CDataStream& ss, const CBlockIndex* pindex)
+{
+    size_t nStart = ss.size();
+    if (!ReadRawBlockFromDisk(ss, pindex->GetBlockPos()))
+        return false;
+
+    // The header fields are all that goes into the block hash, so comparing them
+    // with the index is as good as checking GetHash() and needs no hashing
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << pindex->GetBlockHeader();
+    if (memcmp(&ss[nStart], &ssHeader[0], ssHeader.size()) != 0) {
+        ss.resize(nStart);
+        return error("ReadRawBlockFromDisk(CDataStream&, CBlockIndex*) : block header doesn't match index for %s", pindex->GetBlockHash().ToString());
+    }
+    return true;
+}
+
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -2406,6 +2602,8 @@ void FlushStateToDisk()
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    UpdateKernelModifierIndex();
+    nStakeTipSequence++;
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2466,9 +2664,10 @@ bool static DisconnectTip(CValidationState& state)
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true))
             mempool.remove(tx, removed, true);
     }
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2797,6 +2996,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
 {
     CBlockIndex* pindexNewTip = NULL;
     CBlockIndex* pindexMostWork = NULL;
+    const uint256 hashBlock = pblock ? pblock->GetHash() : uint256();
     do {
         boost::this_thread::interruption_point();
 
@@ -2814,7 +3014,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
-            if (!ActivateBestChainStep(state, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL))
+            if (!ActivateBestChainStep(state, pindexMostWork, pblock && hashBlock == pindexMostWork->GetBlockHash() ? pblock : NULL))
                 return false;
 
             pindexNewTip = chainActive.Tip();
@@ -2824,15 +3024,34 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
         // Notifications/callbacks that can run without cs_main
+        GetMainSignals().UpdatedBlockTip(pindexNewTip, fInitialDownload);
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
+            // Peers that asked for it get the block itself as a cmpctblock, which saves the
+            // getdata round trip, as long as we still have it in memory.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            CInv inv(MSG_BLOCK, hashNewTip);
+            boost::shared_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (fCompactBlocks && pnode->fPreferCompactBlocks && pblock && hashBlock == hashNewTip) {
+                        {
+                            LOCK(pnode->cs_inventory);
+                            if (pnode->setInventoryKnown.count(inv))
+                                continue;
+                        }
+                        if (!pcmpctblock)
+                            pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
+                        pnode->PushMessage("cmpctblock", *pcmpctblock);
+                        pnode->AddInventoryKnown(inv);
+                    } else {
+                        pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -3132,7 +3351,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool /*fCheckPOW*/
             REJECT_INVALID, "bad-header", true);
 
     // Check timestamp
-    LogPrint("debug", "%s: block=%s  is proof of stake=%d\n", __func__, block.GetHash().ToString().c_str(), block.IsProofOfStake());
+    if (fDebug)
+        LogPrint("debug", "%s: block=%s  is proof of stake=%d\n", __func__, block.GetHash().ToString().c_str(), block.IsProofOfStake());
     if (block.GetBlockTime() > GetAdjustedTime() + (block.IsProofOfStake() ? 180 : 7200)) // 3 minute future drift for PoS
         return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
             REJECT_INVALID, "time-too-new");
@@ -3250,7 +3470,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool /*fCheckPOW*/
     return true;
 }
 
-bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
+bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev)
 {
     if (pindexPrev == NULL)
         return error("%s : null pindexPrev for block %s", __func__, block.GetHash().ToString().c_str());
@@ -3411,8 +3631,9 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
     CBlockIndex*& pindex = *ppindex;
 
     // Get prev block index
+    const uint256 hash = block.GetHash();
     CBlockIndex* pindexPrev = NULL;
-    if (block.GetHash() != Params().HashGenesisBlock()) {
+    if (hash != Params().HashGenesisBlock()) {
         BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(0, error("%s : prev block %s not found", __func__, block.hashPrevBlock.ToString().c_str()), 0, "bad-prevblk");
@@ -3421,7 +3642,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
             return state.DoS(100, error("%s : prev block invalid", __func__), REJECT_INVALID, "bad-prevblk");
     }
 
-    if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
+    if (hash != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
         return false;
 
     if (!AcceptBlockHeader(block, state, &pindex))
@@ -3526,6 +3747,12 @@ void CBlockIndex::BuildSkip()
 
 bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
 {
+    // Blocks from peers already hold it; mined, submitted and imported blocks take it here, before
+    // cs_main, as the payment and budget checks and updates share state with the message worker
+    LOCK(cs_messageWorker);
+
+    const uint256 hash = pblock->GetHash();
+
     // Preliminary checks
     bool checked = CheckBlock(*pblock, state);
 
@@ -3539,7 +3766,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     if (!pblock->CheckBlockSignature())
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
-    if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
+    if (hash != Params().HashGenesisBlock() && pfrom != NULL) {
         //if we get this far, check if the prev block is our prev block, if not then request sync and return false
         BlockMap::iterator mi = mapBlockIndex.find(pblock->hashPrevBlock);
         if (mi == mapBlockIndex.end()) {
@@ -3555,7 +3782,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
             continue;
         }
 
-        MarkBlockAsReceived(pblock->GetHash());
+        MarkBlockAsReceived(hash);
         if (!checked) {
             return error("%s : CheckBlock FAILED", __func__);
         }
@@ -3716,6 +3943,7 @@ bool static LoadBlockIndexDB()
     boost::this_thread::interruption_point();
 
     // Calculate nChainWork
+    int64_t nTimeStart = GetTimeMicros();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex) {
@@ -3747,6 +3975,7 @@ bool static LoadBlockIndexDB()
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    LogPrintf("%s: computed chain work and skip pointers for %u blocks in %.2fms\n", __func__, vSortedByHeight.size(), (GetTimeMicros() - nTimeStart) * 0.001);
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -3823,6 +4052,7 @@ bool static LoadBlockIndexDB()
 
         //set the chain to the block before lastMeta so that the meta block will be seen as new
         chainActive.SetTip(pindexLastMeta->pprev);
+        UpdateKernelModifierIndex();
 
         //Process the lastMetaBlock again, using the known location on disk
         CDiskBlockPos blockPos = pindexLastMeta->GetBlockPos();
@@ -3883,6 +4113,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    UpdateKernelModifierIndex();
 
     PruneBlockIndexCandidates();
 
@@ -3986,6 +4217,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    UpdateKernelModifierIndex();
     pindexBestInvalid = NULL;
 }
 
@@ -4038,6 +4270,147 @@ bool InitBlockIndex()
 }
 
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Number of transactions accepted per cs_main acquisition while reloading mempool.dat */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 100;
+
+/** Set once LoadMempool has finished, so a partial pool is never written over a good dump */
+static std::atomic<bool> fMempoolLoaded(false);
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unsupported mempool file version %d. Continuing anyway.\n", version);
+            fMempoolLoaded = true;
+            return false;
+        }
+
+        // Deltas go in first so fee checks see them; they are kept for transactions that never make it back
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t num;
+        file >> num;
+        std::vector<std::pair<CTransaction, int64_t> > vBatch;
+        vBatch.reserve(MEMPOOL_LOAD_BATCH_SIZE);
+        while (num) {
+            while (num && vBatch.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                vBatch.push_back(std::make_pair(CTransaction(), 0));
+                file >> vBatch.back().first;
+                file >> vBatch.back().second;
+                --num;
+            }
+
+            {
+                LOCK(cs_main);
+                for (unsigned int i = 0; i < vBatch.size(); i++) {
+                    const CTransaction& tx = vBatch[i].first;
+                    int64_t nTime = vBatch[i].second;
+                    if (nTime + nExpiryTimeout <= nNow || mempool.exists(tx.GetHash())) {
+                        ++skipped;
+                        continue;
+                    }
+                    CValidationState state;
+                    if (AcceptToMemoryPool(mempool, state, tx, true, NULL, false, false, false, nTime))
+                        ++count;
+                    else
+                        ++failed;
+                }
+            }
+            vBatch.clear();
+
+            // Let shutdown interrupt a long reload between batches
+            boost::this_thread::interruption_point();
+        }
+    } catch (const boost::thread_interrupted&) {
+        throw;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired or already present\n", count, failed, skipped);
+    fMempoolLoaded = true;
+    return true;
+}
+
+/** Serializes the periodic dump, savemempool and the dump at shutdown, which share mempool.dat.new */
+static CCriticalSection cs_dumpMempool;
+
+bool DumpMempool()
+{
+    LOCK(cs_dumpMempool);
+    if (!fMempoolLoaded)
+        return error("DumpMempool() : mempool.dat has not been loaded yet");
+
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<const CTxMemPoolEntry*> vEntries;
+    std::vector<std::pair<CTransaction, int64_t> > vtx;
+    {
+        LOCK(mempool.cs);
+        mapDeltas.insert(mempool.mapDeltas.begin(), mempool.mapDeltas.end());
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::TxMap::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(&it->second);
+        // Parents before children, so every transaction finds its inputs when reloaded
+        std::sort(vEntries.begin(), vEntries.end(), CompareTxMemPoolEntryByAncestorCount());
+        vtx.reserve(vEntries.size());
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+            vtx.push_back(std::make_pair(vEntries[i]->GetTx(), vEntries[i]->GetTime()));
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return error("DumpMempool() : failed to open %s", pathTmp.string());
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+        file << mapDeltas;
+        uint64_t num = vtx.size();
+        file << num;
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            file << vtx[i].first;
+            file << vtx[i].second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("DumpMempool() : failed to rename %s", pathTmp.string());
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    } catch (const std::exception& e) {
+        return error("DumpMempool() : failed to dump mempool: %s", e.what());
+    }
+    return true;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -4462,8 +4835,18 @@ string GetWarnings(string strFor)
 //
 
 
+/** Whether AlreadyHave answers inv from the chain, mempool and orphans alone. */
+bool static IsChainInv(const CInv& inv)
+{
+    return inv.type == MSG_TX || inv.type == MSG_BLOCK;
+}
+
+// requires cs_main, and cs_messageWorker unless IsChainInv, as the message worker changes the
+// servicenode, budget and obfuscation maps
 bool static AlreadyHave(const CInv& inv)
 {
+    if (!IsChainInv(inv))
+        AssertLockHeld(cs_messageWorker);
     switch (inv.type) {
     case MSG_TX: {
         bool txInMap = false;
@@ -4480,8 +4863,10 @@ bool static AlreadyHave(const CInv& inv)
                mapTxLockReqRejected.count(inv.hash);
     case MSG_TXLOCK_VOTE:
         return mapTxLockVote.count(inv.hash);
-    case MSG_SPORK:
+    case MSG_SPORK: {
+        LOCK(cs_mapSporks);
         return mapSporks.count(inv.hash);
+    }
     case MSG_SERVICENODE_WINNER:
         if (servicenodePayments.mapServicenodePayeeVotes.count(inv.hash)) {
             servicenodeSync.AddedServicenodeWinner(inv.hash);
@@ -4532,7 +4917,7 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
+    LOCK2(cs_messageWorker, cs_main);
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -4563,13 +4948,20 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (send) {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    if (inv.type == MSG_BLOCK) {
+                        // The block on disk is already in network format; copy it into the
+                        // send buffer as is rather than deserializing and hashing it
+                        pfrom->BeginMessage("block");
+                        if (!ReadRawBlockFromDisk(pfrom->ssSend, (*mi).second)) {
+                            pfrom->AbortMessage();
+                            assert(!"cannot load block from disk");
+                        }
+                        pfrom->EndMessage();
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -4641,6 +5033,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
+                    LOCK(cs_mapSporks);
                     if (mapSporks.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4757,6 +5150,34 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Fall back to downloading a block announced with cmpctblock in full. Requires cs_main. */
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+    MarkBlockAsInFlight(pfrom->GetId(), hash);
+}
+
+/** Validate a block received from pfrom, in full or rebuilt from a cmpctblock, and tell the peer if it is invalid. */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        LOCK(cs_main);
+        if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == block.GetHash())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -4891,6 +5312,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we take compact blocks. It is asked to announce new blocks
+        // with them once it has provided us a new tip.
+        if (fCompactBlocks && pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", false, SHORT_IDS_BLOCKS_ENCODING_VERSION);
     }
 
 
@@ -5322,20 +5748,165 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         } else {
             pfrom->AddInventoryKnown(inv);
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+        }
+
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (fCompactBlocks && nCMPCTBLOCKVersion == SHORT_IDS_BLOCKS_ENCODING_VERSION) {
+            pfrom->fSupportsCompactBlocks = true;
+            pfrom->fPreferCompactBlocks = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+            // Nothing to do if we have the block or it is already on its way
+            if (AlreadyHave(inv) || mapBlocksInFlight.count(hashBlock))
+                return true;
+
+            // Only blocks on top of our tip are rebuilt from the mempool; anything else takes the usual way
+            if (!fCompactBlocks || cmpctblock.header.hashPrevBlock != chainActive.Tip()->GetBlockHash()) {
+                if (mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                    RequestFullBlock(pfrom, hashBlock);
+                } else {
+                    pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                    pfrom->vBlockRequested.push_back(hashBlock);
+                }
+                return true;
+            }
+
+            // Check the proof of work before any effort goes into matching short IDs
             CValidationState state;
-            ProcessNewBlock(state, pfrom, &block);
-            int nDoS;
-            if (state.IsInvalid(nDoS)) {
-                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                if (nDoS > 0) {
-                    TRY_LOCK(cs_main, lockMain);
-                    if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+            if (!CheckBlockHeader(cmpctblock.header, state, chainActive.Height() + 1 <= Params().LAST_POW_BLOCK())) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid cmpctblock header %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            }
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid cmpctblock %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                RequestFullBlock(pfrom, hashBlock);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                if (partialBlock->FillBlock(block, vector<CTransaction>()) == READ_STATUS_OK)
+                    fBlockReconstructed = true;
+                else
+                    RequestFullBlock(pfrom, hashBlock);
+            } else {
+                // Keep the partial block with the in-flight entry until the blocktxn arrives
+                list<QueuedBlock>::iterator itQueued;
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock, NULL, &itQueued);
+                itQueued->partialBlock = partialBlock;
+                req.blockhash = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
+                LogPrint("cmpctblock", "requesting %u of %u transactions of block %s from peer=%d\n",
+                    req.indexes.size(), cmpctblock.BlockTxCount(), hashBlock.ToString(), pfrom->id);
+            }
+        }
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+
+            if (chainActive.Contains(mi->second) && mi->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                CBlock block;
+                if (!ReadBlockFromDisk(block, mi->second))
+                    assert(!"cannot load block from disk");
+                BlockTransactions resp(req);
+                for (size_t i = 0; i < req.indexes.size(); i++) {
+                    if (req.indexes[i] >= block.vtx.size()) {
+                        Misbehaving(pfrom->GetId(), 100);
+                        return error("peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+                    }
+                    resp.txn[i] = block.vtx[req.indexes[i]];
                 }
+                pfrom->PushMessage("blocktxn", resp);
+                return true;
             }
         }
 
+        // Blocks that are no longer recent tips go through the usual getdata checks and are sent in full;
+        // ProcessGetData takes cs_messageWorker before cs_main, so cs_main is released first
+        pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+        ProcessGetData(pfrom);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us invalid block transactions for block %s", pfrom->id, resp.blockhash.ToString());
+            } else if (status == READ_STATUS_FAILED) {
+                // A short ID matched the wrong mempool transaction
+                RequestFullBlock(pfrom, resp.blockhash);
+            } else {
+                MarkBlockAsReceived(resp.blockhash);
+                fBlockReconstructed = true;
+            }
+        }
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
     }
 
 
@@ -5553,8 +6124,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
+    else if (messageDispatcher.Enqueue(pfrom, strCommand, vRecv)) {
+        // servicenode, budget and spork commands run on the message worker
+    }
+
     else
     {
+        // SwiftTX, and everything when the message worker is off; the handlers share state with it
+        LOCK(cs_messageWorker);
+
         //probably one the extensions
         obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
         mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
@@ -5579,6 +6157,17 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+/**
+ * Commands whose processing reads state the message worker changes: the
+ * AlreadyHave and getdata lookups, dstx relay, and the servicenode payment
+ * and budget checks and updates done for a new block.
+ */
+static bool IsMessageWorkerStateCommand(const string& strCommand)
+{
+    return strCommand == "inv" || strCommand == "getdata" || strCommand == "getblocktxn" || strCommand == "tx" ||
+           strCommand == "dstx" || strCommand == "block" || strCommand == "cmpctblock" || strCommand == "blocktxn";
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -5594,6 +6183,7 @@ bool ProcessMessages(CNode* pfrom)
     //  (x) data
     //
     bool fOk = true;
+    pfrom->fWorkerQueueFull = false;
 
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
@@ -5619,6 +6209,12 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // Leave it in vRecvMsg until the message workers catch up with this peer
+        if (messageDispatcher.IsRouted(msg.hdr.GetCommand()) && messageDispatcher.IsPeerQueueFull(pfrom->id)) {
+            pfrom->fWorkerQueueFull = true;
+            break;
+        }
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -5654,7 +6250,12 @@ bool ProcessMessages(CNode* pfrom)
         // Process message
         bool fRet = false;
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsMessageWorkerStateCommand(strCommand)) {
+                LOCK(cs_messageWorker);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
@@ -5896,8 +6497,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+        // cs_messageWorker is taken before cs_main elsewhere, so only try it here. Transactions
+        // and blocks do not need it and are always requested; while the message worker runs a
+        // handler the other requests wait for a later round
+        TRY_LOCK(cs_messageWorker, lockWorker);
+        std::multimap<int64_t, CInv>::iterator itAsk = pto->mapAskFor.begin();
+        while (!pto->fDisconnect && itAsk != pto->mapAskFor.end() && itAsk->first <= nNow) {
+            const CInv& inv = itAsk->second;
+            if (!lockWorker && !IsChainInv(inv)) {
+                ++itAsk;
+                continue;
+            }
             if (!AlreadyHave(inv)) {
                 if (fDebug)
                     LogPrint("net", "Requesting %s peer=%d\n", inv.ToString(), pto->id);
@@ -5907,7 +6517,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     vGetData.clear();
                 }
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
+            pto->mapAskFor.erase(itAsk++);
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
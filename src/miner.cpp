@@ -8,6 +8,7 @@
 #include "miner.h"
 
 #include "amount.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "main.h"
 #include "servicenode-sync.h"
@@ -33,27 +34,6 @@ using namespace std;
 // XCurrencyMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
-    {
-    }
-};
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
@@ -81,6 +61,92 @@ public:
     }
 };
 
+/** A mempool entry with the totals of the part of its ancestor package that is not in the block yet */
+class CTxPackage
+{
+public:
+    const CTxMemPoolEntry* pentry;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    CTxPackage() : pentry(NULL), nSizeWithAncestors(0), nModFeesWithAncestors(0) {}
+    CTxPackage(const CTxMemPoolEntry* pentryIn) : pentry(pentryIn),
+                                                  nSizeWithAncestors(pentryIn->GetSizeWithAncestors()),
+                                                  nModFeesWithAncestors(pentryIn->GetModFeesWithAncestors()) {}
+};
+
+class CompareTxPackageByFee
+{
+public:
+    bool operator()(const CTxPackage& a, const CTxPackage& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return a.pentry->GetTx().GetHash() < b.pentry->GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Number of packages in a row that may not fit before a nearly full block is given up on */
+static const int MAX_CONSECUTIVE_FAILURES = 1000;
+
+/**
+ * Check a package, sorted parents first, against the coins of the block being
+ * assembled. On success the package is applied to view and the sigops of each
+ * of its transactions are returned in vSigOps.
+ */
+static bool TestPackage(const vector<const CTxMemPoolEntry*>& vPackage, CCoinsViewCache& view, int nHeight, unsigned int nBlockSigOps, vector<unsigned int>& vSigOps)
+{
+    CCoinsViewCache viewPackage(&view);
+    BOOST_FOREACH (const CTxMemPoolEntry* pentry, vPackage) {
+        const CTransaction& tx = pentry->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        nTxSigOps += GetP2SHSigOpCount(tx, viewPackage);
+        nBlockSigOps += nTxSigOps;
+        if (nBlockSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+        vSigOps.push_back(nTxSigOps);
+    }
+    viewPackage.Flush();
+    return true;
+}
+
+static void AddPackageToBlock(const vector<const CTxMemPoolEntry*>& vPackage, const vector<unsigned int>& vSigOps, CBlockTemplate* pblocktemplate, set<uint256>& setInBlock, uint64_t& nBlockSize, uint64_t& nBlockTx, unsigned int& nBlockSigOps, CAmount& nFees)
+{
+    for (unsigned int i = 0; i < vPackage.size(); i++) {
+        const CTxMemPoolEntry& entry = *vPackage[i];
+        pblocktemplate->block.vtx.push_back(entry.GetTx());
+        pblocktemplate->vTxFees.push_back(entry.GetFee());
+        pblocktemplate->vTxSigOps.push_back(vSigOps[i]);
+        setInBlock.insert(entry.GetTx().GetHash());
+        nBlockSize += entry.GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vSigOps[i];
+        nFees += entry.GetFee();
+    }
+}
+
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
@@ -167,166 +233,165 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
+        // Collect transactions into block
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        unsigned int nBlockSigOps = 100;
+        set<uint256> setInBlock;
+
+        // High-priority transactions first, as long as they fit in
+        // -blockprioritysize. Only the entries free at this height can be
+        // added, so the heap is built from those rather than the whole pool.
+        if (nBlockPrioritySize > nBlockSize) {
+            vector<const CTxMemPoolEntry*> vFree;
+            mempool.GetFreeCandidates(nHeight, vFree);
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(vFree.size());
+            BOOST_FOREACH (const CTxMemPoolEntry* pentry, vFree) {
+                double dPriority = pentry->GetPriority(nHeight);
+                CAmount nDummy = 0;
+                mempool.ApplyDeltas(pentry->GetTx().GetHash(), dPriority, nDummy);
+                vecPriority.push_back(TxPriority(dPriority, CFeeRate(pentry->GetModifiedFee(), pentry->GetTxSize()), &pentry->GetTx()));
+            }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
+            // Transactions waiting for an in-pool parent to be added first
+            map<uint256, vector<TxPriority> > mapWaitPriority;
+            TxPriorityCompare comparer(false);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+            while (!vecPriority.empty()) {
+                TxPriority txPriority = vecPriority.front();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+
+                double dPriority = txPriority.get<0>();
+                const CTransaction& tx = *txPriority.get<2>();
+                const CTxMemPoolEntry& entry = mempool.mapTx[tx.GetHash()];
+                if (!AllowFree(dPriority) || nBlockSize + entry.GetTxSize() >= nBlockPrioritySize)
+                    break;
+
+                bool fWaiting = false;
+                BOOST_FOREACH (const uint256& hashParent, mempool.mapLinks[tx.GetHash()].parents) {
+                    if (!setInBlock.count(hashParent)) {
+                        mapWaitPriority[hashParent].push_back(txPriority);
+                        fWaiting = true;
                         break;
                     }
+                }
+                if (fWaiting)
+                    continue;
 
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                vector<const CTxMemPoolEntry*> vPackage(1, &entry);
+                vector<unsigned int> vSigOps;
+                if (!TestPackage(vPackage, view, nHeight, nBlockSigOps, vSigOps))
                     continue;
+                AddPackageToBlock(vPackage, vSigOps, pblocktemplate.get(), setInBlock, nBlockSize, nBlockTx, nBlockSigOps, nFees);
+                if (fPrintPriority) {
+                    LogPrintf("priority %.1f fee %s txid %s\n",
+                        dPriority, txPriority.get<1>().ToString(), tx.GetHash().ToString());
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
 
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
+                map<uint256, vector<TxPriority> >::iterator it = mapWaitPriority.find(tx.GetHash());
+                if (it != mapWaitPriority.end()) {
+                    BOOST_FOREACH (const TxPriority& txWaiting, it->second) {
+                        vecPriority.push_back(txWaiting);
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    }
+                    mapWaitPriority.erase(it);
+                }
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        // Then walk the mempool by ancestor package fee rate, adding each package
+        // with its missing ancestors. Packages whose ancestors are partly in the
+        // block already are re-scored in setModified without those ancestors.
+        map<uint256, CTxPackage> mapModified;
+        set<CTxPackage, CompareTxPackageByFee> setModified;
+        set<uint256> setFailed;
+        int nConsecutiveFailed = 0;
+        CTxMemPool::indexed_ancestor_fee::const_iterator mi = mempool.setAncestorFee.begin();
+
+        while (mi != mempool.setAncestorFee.end() || !setModified.empty()) {
+            if (mi != mempool.setAncestorFee.end()) {
+                const uint256& hash = (*mi)->GetTx().GetHash();
+                if (setInBlock.count(hash) || setFailed.count(hash) || mapModified.count(hash)) {
+                    ++mi;
+                    continue;
+                }
+            }
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+            CTxPackage package;
+            if (mi != mempool.setAncestorFee.end())
+                package = CTxPackage(*mi);
+            if (!setModified.empty() && (mi == mempool.setAncestorFee.end() || CompareTxPackageByFee()(*setModified.begin(), package))) {
+                package = *setModified.begin();
+                setModified.erase(setModified.begin());
+                mapModified.erase(package.pentry->GetTx().GetHash());
+            } else {
+                ++mi;
+            }
+            const uint256 hash = package.pentry->GetTx().GetHash();
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            // Everything after this pays less, so once the block is past the minimum
+            // size there is nothing left worth adding below the relay fee
+            if (package.nModFeesWithAncestors < ::minRelayTxFee.GetFee(package.nSizeWithAncestors)) {
+                if (nBlockSize >= nBlockMinSize)
+                    break;
+                if (nBlockSize + package.nSizeWithAncestors >= nBlockMinSize) {
+                    setFailed.insert(hash);
+                    continue;
+                }
             }
 
-            if (!view.HaveInputs(tx))
+            if (nBlockSize + package.nSizeWithAncestors >= nBlockMaxSize) {
+                setFailed.insert(hash);
+                // Give up once the block is nearly full and nothing has fit for a while
+                if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 4000)
+                    break;
                 continue;
+            }
 
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            // The package is the entry and whatever of its ancestors is not in the block,
+            // parents first
+            set<uint256> setAncestors;
+            mempool.CalculateMemPoolAncestors(hash, setAncestors);
+            vector<const CTxMemPoolEntry*> vPackage;
+            vPackage.push_back(package.pentry);
+            BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+                if (!setInBlock.count(hashAncestor))
+                    vPackage.push_back(&mempool.mapTx[hashAncestor]);
+            }
+            std::sort(vPackage.begin(), vPackage.end(), CompareTxMemPoolEntryByAncestorCount());
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            vector<unsigned int> vSigOps;
+            if (!TestPackage(vPackage, view, nHeight, nBlockSigOps, vSigOps)) {
+                setFailed.insert(hash);
                 continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
+            }
+            nConsecutiveFailed = 0;
+            AddPackageToBlock(vPackage, vSigOps, pblocktemplate.get(), setInBlock, nBlockSize, nBlockTx, nBlockSigOps, nFees);
             if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
+                LogPrintf("package fee %s txid %s (%u transactions)\n",
+                    CFeeRate(package.nModFeesWithAncestors, package.nSizeWithAncestors).ToString(), hash.ToString(), vPackage.size());
             }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+            // Take the added transactions out of the packages of their descendants
+            BOOST_FOREACH (const CTxMemPoolEntry* pentry, vPackage) {
+                set<uint256> setDescendants;
+                mempool.CalculateDescendants(pentry->GetTx().GetHash(), setDescendants);
+                BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+                    if (setInBlock.count(hashDescendant))
+                        continue;
+                    map<uint256, CTxPackage>::iterator it = mapModified.find(hashDescendant);
+                    if (it == mapModified.end())
+                        it = mapModified.insert(make_pair(hashDescendant, CTxPackage(&mempool.mapTx[hashDescendant]))).first;
+                    else
+                        setModified.erase(it->second);
+                    it->second.nSizeWithAncestors -= pentry->GetTxSize();
+                    it->second.nModFeesWithAncestors -= pentry->GetModifiedFee();
+                    setModified.insert(it->second);
                 }
             }
         }
@@ -517,10 +582,27 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
         while (true) {
             unsigned int nHashesDone = 0;
 
+            // Hash a batch of consecutive nonces at a time so the SIMD Quark
+            // implementation can work on several headers in parallel.
+            static const unsigned int nBatchSize = 8;
+            unsigned char vchHeaders[nBatchSize][80];
+            uint256 vHashes[nBatchSize];
             uint256 hash;
             while (true) {
-                hash = pblock->GetHash();
-                if (hash <= hashTarget) {
+                const unsigned int nBatch = std::min(nBatchSize, 0x100 - (pblock->nNonce & 0xFF));
+                for (unsigned int i = 0; i < nBatch; i++) {
+                    memcpy(vchHeaders[i], BEGIN(pblock->nVersion), sizeof(vchHeaders[i]));
+                    WriteLE32(vchHeaders[i] + 76, pblock->nNonce + i);
+                }
+                HashQuarkBatch(vHashes, vchHeaders[0], sizeof(vchHeaders[0]), sizeof(vchHeaders[0]), nBatch);
+                unsigned int nFound = nBatch;
+                for (unsigned int i = 0; i < nBatch && nFound == nBatch; i++)
+                    if (vHashes[i] <= hashTarget)
+                        nFound = i;
+                pblock->nNonce += nFound;
+                nHashesDone += nFound;
+                if (nFound < nBatch) {
+                    hash = vHashes[nFound];
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
                     LogPrintf("BitcoinMiner:\n");
@@ -535,8 +617,6 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
 
                     break;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
                 if ((pblock->nNonce & 0xFF) == 0)
                     break;
             }
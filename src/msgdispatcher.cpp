@@ -0,0 +1,231 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "msgdispatcher.h"
+
+#include "main.h"
+#include "obfuscation.h"
+#include "servicenode-budget.h"
+#include "servicenode-payments.h"
+#include "servicenode-sync.h"
+#include "servicenodeman.h"
+#include "spork.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+CMessageDispatcher messageDispatcher;
+CCriticalSection cs_messageWorker;
+
+std::string GetMessageSubsystemName(MessageSubsystem subsystem)
+{
+    switch (subsystem) {
+    case MSG_SUBSYSTEM_SERVICENODE:
+        return "servicenode";
+    case MSG_SUBSYSTEM_PAYMENTS:
+        return "payments";
+    case MSG_SUBSYSTEM_BUDGET:
+        return "budget";
+    case MSG_SUBSYSTEM_SPORK:
+        return "spork";
+    case MSG_SUBSYSTEM_OBFUSCATION:
+        return "obfuscation";
+    case MSG_SUBSYSTEM_SYNC:
+        return "sync";
+    case MSG_SUBSYSTEM_MAX:
+        break;
+    }
+    return "unknown";
+}
+
+static void ProcessSubsystemMessage(MessageSubsystem subsystem, CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    switch (subsystem) {
+    case MSG_SUBSYSTEM_SERVICENODE:
+        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+        break;
+    case MSG_SUBSYSTEM_PAYMENTS:
+        servicenodePayments.ProcessMessageServicenodePayments(pfrom, strCommand, vRecv);
+        break;
+    case MSG_SUBSYSTEM_BUDGET:
+        budget.ProcessMessage(pfrom, strCommand, vRecv);
+        break;
+    case MSG_SUBSYSTEM_SPORK:
+        ProcessSpork(pfrom, strCommand, vRecv);
+        break;
+    case MSG_SUBSYSTEM_OBFUSCATION:
+        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
+        break;
+    case MSG_SUBSYSTEM_SYNC:
+        servicenodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+        break;
+    case MSG_SUBSYSTEM_MAX:
+        break;
+    }
+}
+
+CMessageDispatcher::CMessageDispatcher() : fRunning(false), nNextSubsystem(0)
+{
+    for (int i = 0; i < MSG_SUBSYSTEM_MAX; i++)
+        vfBusy[i] = false;
+
+    const char* vServicenode[] = {"mnb", "mnp", "dseg", "dsee", "dseep"};
+    const char* vPayments[] = {"mnget", "mnw"};
+    const char* vBudget[] = {"mnvs", "mprop", "mvote", "fbs", "fbvote"};
+    const char* vSpork[] = {"spork", "getsporks"};
+    const char* vObfuscation[] = {"dsa", "dsq", "dsi", "dssu", "dss", "dsf", "dsc"};
+    const char* vSync[] = {"ssc"};
+
+#define ADD_ROUTES(v, subsystem)                       \
+    for (unsigned int i = 0; i < ARRAYLEN(v); i++)     \
+        mapRoutes[v[i]] = subsystem;
+    ADD_ROUTES(vServicenode, MSG_SUBSYSTEM_SERVICENODE);
+    ADD_ROUTES(vPayments, MSG_SUBSYSTEM_PAYMENTS);
+    ADD_ROUTES(vBudget, MSG_SUBSYSTEM_BUDGET);
+    ADD_ROUTES(vSpork, MSG_SUBSYSTEM_SPORK);
+    ADD_ROUTES(vObfuscation, MSG_SUBSYSTEM_OBFUSCATION);
+    ADD_ROUTES(vSync, MSG_SUBSYSTEM_SYNC);
+#undef ADD_ROUTES
+}
+
+void CMessageDispatcher::Start(boost::thread_group& threadGroup)
+{
+    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msgworker",
+        boost::function<void()>(boost::bind(&CMessageDispatcher::ThreadWorker, this))));
+    fRunning = true;
+    LogPrintf("Processing servicenode, budget and spork messages on a separate thread\n");
+}
+
+bool CMessageDispatcher::IsRouted(const std::string& strCommand) const
+{
+    return fRunning && mapRoutes.count(strCommand);
+}
+
+bool CMessageDispatcher::IsPeerQueueFull(NodeId id)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<NodeId, unsigned int>::const_iterator it = mapPeerQueued.find(id);
+    return it != mapPeerQueued.end() && it->second >= MAX_PEER_QUEUED_MESSAGES;
+}
+
+bool CMessageDispatcher::Enqueue(CNode* pfrom, const std::string& strCommand, const CDataStream& vRecv)
+{
+    if (!fRunning)
+        return false;
+    std::map<std::string, MessageSubsystem>::const_iterator itRoute = mapRoutes.find(strCommand);
+    if (itRoute == mapRoutes.end())
+        return false;
+
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::deque<CTask>& queue = vQueue[itRoute->second];
+        queue.push_back(CTask());
+        CTask& task = queue.back();
+        task.pfrom = pfrom;
+        task.strCommand = strCommand;
+        task.vRecv = vRecv;
+        task.nTimeQueued = GetTimeMicros();
+
+        mapPeerQueued[pfrom->GetId()]++;
+        CMessageQueueStats& stats = mapStats[strCommand];
+        stats.nQueued++;
+        stats.nMaxQueued = std::max(stats.nMaxQueued, stats.nQueued);
+    }
+    cond.notify_one();
+    return true;
+}
+
+bool CMessageDispatcher::PopTask(MessageSubsystem& subsystem, CTask& task)
+{
+    // Round robin over the subsystems so one busy queue cannot starve the others
+    for (int i = 0; i < MSG_SUBSYSTEM_MAX; i++) {
+        int n = (nNextSubsystem + i) % MSG_SUBSYSTEM_MAX;
+        if (vQueue[n].empty())
+            continue;
+        subsystem = (MessageSubsystem)n;
+        task = vQueue[n].front();
+        vQueue[n].pop_front();
+        vfBusy[n] = true;
+        nNextSubsystem = (n + 1) % MSG_SUBSYSTEM_MAX;
+        return true;
+    }
+    return false;
+}
+
+void CMessageDispatcher::ThreadWorker()
+{
+    while (true) {
+        MessageSubsystem subsystem;
+        CTask task;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!PopTask(subsystem, task))
+                cond.wait(lock);
+        }
+
+        int64_t nStart = GetTimeMicros(), nEnd = nStart;
+        if (!task.pfrom->fDisconnect) {
+            // Waiting for the message handler thread counts as waiting, not as processing
+            LOCK(cs_messageWorker);
+            nStart = GetTimeMicros();
+            try {
+                ProcessSubsystemMessage(subsystem, task.pfrom, task.strCommand, task.vRecv);
+            } catch (std::ios_base::failure& e) {
+                task.pfrom->PushMessage("reject", task.strCommand, REJECT_MALFORMED, std::string("error parsing message"));
+                LogPrintf("CMessageDispatcher(%s, %u bytes): Exception '%s' caught\n", SanitizeString(task.strCommand), task.vRecv.size(), e.what());
+            } catch (boost::thread_interrupted) {
+                throw;
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "CMessageDispatcher::ThreadWorker()");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "CMessageDispatcher::ThreadWorker()");
+            }
+            nEnd = GetTimeMicros();
+        }
+
+        bool fResume = false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vfBusy[subsystem] = false;
+
+            CMessageQueueStats& stats = mapStats[task.strCommand];
+            stats.nQueued--;
+            stats.nProcessed++;
+            stats.nWaitMicros += nStart - task.nTimeQueued;
+            stats.nRunMicros += nEnd - nStart;
+
+            std::map<NodeId, unsigned int>::iterator it = mapPeerQueued.find(task.pfrom->GetId());
+            if (it != mapPeerQueued.end()) {
+                fResume = (it->second == MAX_PEER_QUEUED_MESSAGES);
+                if (--it->second == 0)
+                    mapPeerQueued.erase(it);
+            }
+        }
+        // ProcessMessages may be holding this peer back; let it continue
+        if (fResume)
+            messageHandlerCondition.notify_one();
+
+        {
+            LOCK(cs_vNodes);
+            task.pfrom->Release();
+        }
+    }
+}
+
+void CMessageDispatcher::GetStats(std::map<std::string, CMessageQueueStats>& mapStatsOut, std::vector<std::pair<int64_t, bool> >& vSubsystemsOut)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    mapStatsOut = mapStats;
+    vSubsystemsOut.clear();
+    for (int i = 0; i < MSG_SUBSYSTEM_MAX; i++)
+        vSubsystemsOut.push_back(std::make_pair((int64_t)vQueue[i].size(), vfBusy[i]));
+}
@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MSGDISPATCHER_H
+#define BITCOIN_MSGDISPATCHER_H
+
+#include "net.h"
+#include "streams.h"
+#include "sync.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace boost
+{
+class thread_group;
+} // namespace boost
+
+/** Default for -msgworker, whether servicenode, budget and spork messages are processed on their own thread */
+static const bool DEFAULT_MESSAGE_WORKER = true;
+/** Messages a peer may have waiting for the workers before ProcessMessages holds the rest back */
+static const unsigned int MAX_PEER_QUEUED_MESSAGES = 500;
+
+/** Groups of commands handled by the worker, each with its own queue */
+enum MessageSubsystem {
+    MSG_SUBSYSTEM_SERVICENODE,
+    MSG_SUBSYSTEM_PAYMENTS,
+    MSG_SUBSYSTEM_BUDGET,
+    MSG_SUBSYSTEM_SPORK,
+    MSG_SUBSYSTEM_OBFUSCATION,
+    MSG_SUBSYSTEM_SYNC,
+    MSG_SUBSYSTEM_MAX
+};
+
+std::string GetMessageSubsystemName(MessageSubsystem subsystem);
+
+/** Counters for one command, reported by getmessagequeueinfo */
+struct CMessageQueueStats {
+    int64_t nQueued;     //! Messages waiting right now
+    int64_t nMaxQueued;  //! Deepest the queue has been
+    int64_t nProcessed;  //! Messages handled so far
+    int64_t nWaitMicros; //! Total time spent waiting for the worker
+    int64_t nRunMicros;  //! Total time spent in the handler
+
+    CMessageQueueStats() : nQueued(0), nMaxQueued(0), nProcessed(0), nWaitMicros(0), nRunMicros(0) {}
+};
+
+/**
+ * Held by the message worker while it runs a handler. The handlers change
+ * servicenode, payment, budget, sync and obfuscation state that the message
+ * handler thread reads too, in AlreadyHave, ProcessGetData, dstx relay and
+ * block validation, so ProcessMessages holds it for the commands that get
+ * there. Taken before cs_main.
+ */
+extern CCriticalSection cs_messageWorker;
+
+/**
+ * Moves the servicenode, payment, budget, spork, obfuscation and sync
+ * commands off ThreadMessageHandler onto a worker thread, so that signature
+ * checks for mnb, mnp, mnw and budget votes no longer run between the block
+ * and transaction messages of other peers. Chain-state messages stay on the
+ * message handler thread and keep their order; SwiftTX stays there too, as
+ * its locks are checked by AcceptToMemoryPool and CheckBlock.
+ *
+ * The handlers share state with each other and with the message handler
+ * thread, so one handler runs at a time, under cs_messageWorker. The
+ * subsystems are queued separately and served round robin, so a flood of
+ * one kind of message does not hold up the others. Each peer may have
+ * MAX_PEER_QUEUED_MESSAGES waiting. Past that ProcessMessages leaves the
+ * peer's messages in vRecvMsg, which in turn stops the socket thread reading
+ * from it.
+ */
+class CMessageDispatcher
+{
+public:
+    CMessageDispatcher();
+
+    /** Start the worker thread. Until then routed commands keep being processed inline. */
+    void Start(boost::thread_group& threadGroup);
+
+    /** Whether strCommand goes to the worker pool */
+    bool IsRouted(const std::string& strCommand) const;
+    /** Whether the peer has as many messages waiting as it may */
+    bool IsPeerQueueFull(NodeId id);
+    /** Hand a routed message to the worker. Returns false if it must be processed inline instead. */
+    bool Enqueue(CNode* pfrom, const std::string& strCommand, const CDataStream& vRecv);
+
+    bool IsRunning() const { return fRunning; }
+    void GetStats(std::map<std::string, CMessageQueueStats>& mapStatsOut, std::vector<std::pair<int64_t, bool> >& vSubsystemsOut);
+
+private:
+    struct CTask {
+        CNode* pfrom;
+        std::string strCommand;
+        CDataStream vRecv;
+        int64_t nTimeQueued;
+
+        CTask() : pfrom(NULL), vRecv(SER_NETWORK, PROTOCOL_VERSION), nTimeQueued(0) {}
+    };
+
+    bool fRunning;
+    std::map<std::string, MessageSubsystem> mapRoutes;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CTask> vQueue[MSG_SUBSYSTEM_MAX];
+    bool vfBusy[MSG_SUBSYSTEM_MAX];
+    int nNextSubsystem;
+    std::map<NodeId, unsigned int> mapPeerQueued;
+    std::map<std::string, CMessageQueueStats> mapStats;
+
+    /** Take the oldest task of the next subsystem with work. requires mutex */
+    bool PopTask(MessageSubsystem& subsystem, CTask& task);
+    void ThreadWorker();
+};
+
+extern CMessageDispatcher messageDispatcher;
+
+#endif // BITCOIN_MSGDISPATCHER_H
@@ -26,6 +26,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -85,6 +90,11 @@ static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
 bool fAddressesInitialized = false;
+#ifdef USE_EPOLL
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_EPOLL;
+#else
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+#endif
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -93,6 +103,8 @@ deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
+static void UnregisterSocketEvents(SOCKET hSocket);
+
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
 
@@ -420,6 +432,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         if (obfuScationMaster) pnode->fObfuScationMaster = true;
@@ -439,6 +452,7 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        UnregisterSocketEvents(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -688,72 +702,532 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+/** How often the epoll loop sweeps every node for disconnects, timeouts and deferred work, in milliseconds */
+static const int SOCKET_HOUSEKEEPING_INTERVAL = 50;
+/** Maximum number of events taken from the kernel per epoll_wait() */
+static const int SOCKET_EVENTS_MAX = 256;
+
+#ifndef WIN32
+/** Pipe whose read end wakes ThreadSocketHandler out of select() or epoll_wait() */
+static int hWakeupPipe[2] = {-1, -1};
+#endif
+
+#ifdef USE_EPOLL
+static int hEpollFd = -1;
+/** Nodes by the socket they were registered with; only touched by ThreadSocketHandler */
+static std::map<SOCKET, CNode*> mapSocketNodes;
+#endif
+
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT:
+        return "select";
+    case SOCKETEVENTS_EPOLL:
+        return "epoll";
+    }
+    return "unknown";
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+#ifdef USE_EPOLL
+    return "select, epoll";
+#else
+    return "select";
+#endif
+}
+
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef USE_EPOLL
+    if (str == "epoll") {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool InitSocketEvents()
+{
+#ifndef WIN32
+    if (hWakeupPipe[0] == -1) {
+        if (pipe(hWakeupPipe) != 0) {
+            LogPrintf("InitSocketEvents : pipe() failed: %s\n", NetworkErrorString(errno));
+            hWakeupPipe[0] = hWakeupPipe[1] = -1;
+        } else {
+            for (int i = 0; i < 2; i++)
+                fcntl(hWakeupPipe[i], F_SETFL, fcntl(hWakeupPipe[i], F_GETFL) | O_NONBLOCK);
+        }
+    }
+#endif
+
+#ifdef USE_EPOLL
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpollFd == -1) {
+        hEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpollFd == -1) {
+            LogPrintf("InitSocketEvents : epoll_create1() failed: %s, falling back to select()\n", NetworkErrorString(errno));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
+            return false;
+        }
+
+        // Listening sockets and the wakeup pipe stay level-triggered: one accept() or drain per wakeup is enough
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+            event.data.fd = hListenSocket.socket;
+            if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("InitSocketEvents : failed to register listening socket: %s\n", NetworkErrorString(errno));
+        }
+        if (hWakeupPipe[0] != -1) {
+            event.data.fd = hWakeupPipe[0];
+            epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hWakeupPipe[0], &event);
+        }
+    }
+#endif
+
+    LogPrintf("Using %s for socket events\n", GetSocketEventsModeName(nSocketEventsMode));
+    return true;
+}
+
+void CloseSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (hEpollFd != -1) {
+        close(hEpollFd);
+        hEpollFd = -1;
+    }
+    mapSocketNodes.clear();
+#endif
+#ifndef WIN32
+    for (int i = 0; i < 2; i++) {
+        if (hWakeupPipe[i] != -1) {
+            close(hWakeupPipe[i]);
+            hWakeupPipe[i] = -1;
+        }
+    }
+#endif
+}
+
+void WakeSocketHandler()
+{
+#ifndef WIN32
+    if (hWakeupPipe[1] != -1) {
+        char c = 0;
+        // A full pipe already guarantees a wakeup
+        if (write(hWakeupPipe[1], &c, 1) != 1)
+            return;
+    }
+#endif
+}
+
+#ifndef WIN32
+static void DrainWakeupPipe()
+{
+    char buf[128];
+    while (read(hWakeupPipe[0], buf, sizeof(buf)) > 0) {
+    }
+}
+#endif
+
+/** Remove a socket from the epoll set before it is closed, so a reused descriptor never reports for the old node */
+static void UnregisterSocketEvents(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpollFd != -1)
+        epoll_ctl(hEpollFd, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
+}
+
+#ifdef USE_EPOLL
+/** Add a node's socket to the epoll set, edge-triggered. Runs in ThreadSocketHandler only. */
+static void RegisterSocketEvents(CNode* pnode)
+{
+    SOCKET hSocket = pnode->hSocket;
+    if (hSocket == INVALID_SOCKET || pnode->hSocketEvents != INVALID_SOCKET)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = hSocket;
+    // EEXIST means the descriptor was reused before its old owner was unregistered; take it over
+    if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hSocket, &event) != 0 &&
+        (errno != EEXIST || epoll_ctl(hEpollFd, EPOLL_CTL_MOD, hSocket, &event) != 0)) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    mapSocketNodes[hSocket] = pnode;
+    pnode->hSocketEvents = hSocket;
+}
+
+static void ForgetSocketEvents(CNode* pnode)
+{
+    if (pnode->hSocketEvents == INVALID_SOCKET)
+        return;
+    std::map<SOCKET, CNode*>::iterator it = mapSocketNodes.find(pnode->hSocketEvents);
+    if (it != mapSocketNodes.end() && it->second == pnode)
+        mapSocketNodes.erase(it);
+    pnode->hSocketEvents = INVALID_SOCKET;
+}
+#endif
+
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+#ifdef USE_EPOLL
+                ForgetSocketEvents(pnode);
+#endif
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if (vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static CNode* AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        return pnode;
+    }
+    return NULL;
+}
+
+/** Read once from a node's socket. Returns true if a full buffer was read, so more may be waiting.
+ *  requires LOCK(cs_vRecvMsg) */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf);
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+/** What ThreadSocketHandlerEpoll should do next for a node it has serviced */
+enum SocketServiceResult {
+    SOCKET_SERVICE_IDLE,      // wait for the next edge or housekeeping sweep
+    SOCKET_SERVICE_AGAIN,     // a full buffer was read, so more data is waiting
+    SOCKET_SERVICE_CONTENDED, // a lock was busy, retry shortly
+};
+
+/**
+ * Act on the readiness epoll has reported for a node. The flags stay set while
+ * flow control holds the work back, so the next housekeeping sweep retries it;
+ * a partial send or a drained receive clears them and waits for the next edge.
+ */
+static SocketServiceResult SocketServiceEpoll(CNode* pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET) {
+        pnode->fSocketRecvReady = pnode->fSocketSendReady = false;
+        return SOCKET_SERVICE_IDLE;
+    }
+
+    SocketServiceResult result = SOCKET_SERVICE_IDLE;
+    bool fSendPending = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend) {
+            if (pnode->fSocketSendReady)
+                result = SOCKET_SERVICE_CONTENDED;
+        } else {
+            if (pnode->fSocketSendReady) {
+                if (!pnode->vSendMsg.empty())
+                    SocketSendData(pnode);
+                pnode->fSocketSendReady = false;
+            }
+            fSendPending = !pnode->vSendMsg.empty();
+        }
+    }
+
+    // As with select(), drain the write buffer before receiving more
+    if (pnode->fSocketRecvReady && !fSendPending && pnode->hSocket != INVALID_SOCKET) {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv) {
+            result = SOCKET_SERVICE_CONTENDED;
+        } else if (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                   pnode->GetTotalRecvSize() <= ReceiveFloodSize()) {
+            pnode->fSocketRecvReady = SocketRecvData(pnode);
+            // The edge for this data has been consumed; come back rather than wait for a new one
+            if (pnode->fSocketRecvReady && result == SOCKET_SERVICE_IDLE)
+                result = SOCKET_SERVICE_AGAIN;
+        }
+    }
+    return result;
+}
+
+/** Service nodes reported ready. The ones to revisit before the next sweep are added to vNodesRetry. */
+static void SocketServiceNodesEpoll(const vector<CNode*>& vNodesReady, vector<CNode*>& vNodesRetry, bool& fRetryNow)
+{
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodesReady)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH (CNode* pnode, vNodesReady) {
+        SocketServiceResult result = SocketServiceEpoll(pnode);
+        if (result != SOCKET_SERVICE_IDLE)
+            vNodesRetry.push_back(pnode);
+        if (result == SOCKET_SERVICE_AGAIN)
+            fRetryNow = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodesReady)
+            pnode->Release();
+    }
+}
+
+static void ThreadSocketHandlerEpoll()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
+    std::vector<struct epoll_event> vEvents(SOCKET_EVENTS_MAX);
+    // Nodes are only deleted during housekeeping, which empties this list first
+    vector<CNode*> vNodesRetry;
+    bool fRetryNow = false;
+
     while (true) {
         //
-        // Disconnect nodes
+        // Housekeeping: register new nodes, disconnect, retry deferred work and check timeouts
         //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastHousekeeping >= SOCKET_HOUSEKEEPING_INTERVAL) {
+            nLastHousekeeping = nNow;
+            vNodesRetry.clear();
+            fRetryNow = false;
+            DisconnectNodes(nPrevNodeCount);
+
+            vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
+            }
+            vector<CNode*> vNodesPending;
             BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                RegisterSocketEvents(pnode);
+                if (pnode->fSocketRecvReady || pnode->fSocketSendReady)
+                    vNodesPending.push_back(pnode);
+                InactivityCheck(pnode);
+            }
+            SocketServiceNodesEpoll(vNodesPending, vNodesRetry, fRetryNow);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+        int nTimeout = fRetryNow ? 0 : 1;
+        if (vNodesRetry.empty())
+            nTimeout = std::max((int64_t)0, nLastHousekeeping + SOCKET_HOUSEKEEPING_INTERVAL - GetTimeMillis());
+        int nEvents = epoll_wait(hEpollFd, &vEvents[0], vEvents.size(), nTimeout);
+        boost::this_thread::interruption_point();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+        if (nEvents < 0) {
+            if (errno != EINTR) {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(SOCKET_HOUSEKEEPING_INTERVAL);
             }
+            continue;
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+
+        vector<CNode*> vNodesReady;
+        vNodesReady.swap(vNodesRetry);
+        fRetryNow = false;
+        for (int i = 0; i < nEvents; i++) {
+            SOCKET hSocket = vEvents[i].data.fd;
+            uint32_t events = vEvents[i].events;
+
+            if (hSocket == (SOCKET)hWakeupPipe[0]) {
+                // A node was added elsewhere; sweep now so it is registered without delay
+                DrainWakeupPipe();
+                nLastHousekeeping = 0;
+                continue;
+            }
+
+            std::map<SOCKET, CNode*>::iterator it = mapSocketNodes.find(hSocket);
+            if (it == mapSocketNodes.end()) {
+                BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+                    if (hListenSocket.socket == hSocket) {
+                        CNode* pnode = AcceptConnection(hListenSocket);
+                        if (pnode)
+                            RegisterSocketEvents(pnode);
                     }
                 }
+                continue;
             }
+
+            CNode* pnode = it->second;
+            if (pnode->hSocket != hSocket)
+                continue;
+            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                pnode->fSocketRecvReady = true;
+            if (events & EPOLLOUT)
+                pnode->fSocketSendReady = true;
+            vNodesReady.push_back(pnode);
         }
-        if (vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
+
+        SocketServiceNodesEpoll(vNodesReady, vNodesRetry, fRetryNow);
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpollFd != -1) {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true) {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_HOUSEKEEPING_INTERVAL * 1000; // frequency to poll pnode->vSend
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -770,6 +1244,14 @@ void ThreadSocketHandler()
             have_fds = true;
         }
 
+#ifndef WIN32
+        if (hWakeupPipe[0] != -1) {
+            FD_SET(hWakeupPipe[0], &fdsetRecv);
+            hSocketMax = max(hSocketMax, (SOCKET)hWakeupPipe[0]);
+            have_fds = true;
+        }
+#endif
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
@@ -826,53 +1308,17 @@ void ThreadSocketHandler()
             MilliSleep(timeout.tv_usec / 1000);
         }
 
+#ifndef WIN32
+        if (hWakeupPipe[0] != -1 && FD_ISSET(hWakeupPipe[0], &fdsetRecv))
+            DrainWakeupPipe();
+#endif
+
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -895,33 +1341,8 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockRecv)
+                    SocketRecvData(pnode);
             }
 
             //
@@ -938,22 +1359,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -963,7 +1369,6 @@ void ThreadSocketHandler()
     }
 }
 
-
 #ifdef USE_UPNP
 void ThreadMapPort()
 {
@@ -1368,7 +1773,7 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize()) {
+                    if (pnode->nSendSize < SendBufferSize() && !pnode->fWorkerQueueFull) {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
                         }
@@ -1584,6 +1989,7 @@ void StartNode(boost::thread_group& threadGroup)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    InitSocketEvents();
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1643,6 +2049,7 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+        CloseSocketEvents();
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1911,6 +2318,12 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nPingUsecTime = 0;
     fPingQueued = false;
     fObfuScationMaster = false;
+    hSocketEvents = INVALID_SOCKET;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
+    fWorkerQueueFull = false;
+    fSupportsCompactBlocks = false;
+    fPreferCompactBlocks = false;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2020,8 +2433,12 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (it == vSendMsg.begin()) {
         SocketSendData(this);
+        // select() was not watching this socket for writing; epoll reports the next EPOLLOUT edge by itself
+        if (!vSendMsg.empty() && nSocketEventsMode == SOCKETEVENTS_SELECT)
+            WakeSocketHandler();
+    }
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
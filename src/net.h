@@ -77,6 +77,23 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+void ThreadSocketHandler();
+
+/** How ThreadSocketHandler waits for socket readiness (-socketevents) */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+std::string GetSupportedSocketEventsModes();
+/** Parse a -socketevents value; fails for modes this build does not support */
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode);
+/** Set up the wakeup pipe and, in epoll mode, the epoll set. Falls back to select() on failure. */
+bool InitSocketEvents();
+void CloseSocketEvents();
+/** Make ThreadSocketHandler run a pass now instead of at its next timeout */
+void WakeSocketHandler();
 
 typedef int NodeId;
 
@@ -125,6 +142,7 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern SocketEventsMode nSocketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -139,6 +157,9 @@ extern CCriticalSection cs_vAddedNodes;
 extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
+/** Wakes ThreadMessageHandler early, e.g. when a peer held back by the message workers may continue */
+extern boost::condition_variable messageHandlerCondition;
+
 struct LocalServiceInfo {
     int nScore;
     int nPort;
@@ -260,6 +281,15 @@ public:
     // (even if it's relative to mixing e.g. for blinding) should NOT set this to 'true'.
     // For such cases node should be released manually (preferably right after corresponding code).
     bool fObfuScationMaster;
+    // epoll state, only touched by ThreadSocketHandler
+    SOCKET hSocketEvents;  // socket registered in the epoll set, or INVALID_SOCKET
+    bool fSocketRecvReady; // the socket may still hold unread data
+    bool fSocketSendReady; // the socket became writable since the last send attempt
+    // the message workers have as many of this peer's messages queued as they take
+    bool fWorkerQueueFull;
+    // the peer sent "sendcmpct", and whether it wants new blocks announced with "cmpctblock"
+    bool fSupportsCompactBlocks;
+    bool fPreferCompactBlocks;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -58,19 +58,24 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     vMerkleTree.reserve(vtx.size() * 2 + 16); // Safe upper bound for the number of total nodes.
     for (std::vector<CTransaction>::const_iterator it(vtx.begin()); it != vtx.end(); ++it)
         vMerkleTree.push_back(it->GetHash());
+    static_assert(sizeof(uint256) == 32, "uint256 must be tightly packed");
     int j = 0;
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // Each full pair of this level is one contiguous 64 byte block, so they
+        // are all hashed in one batch. An odd last entry is paired with itself.
+        const int nPairs = nSize / 2;
+        const size_t nOut = vMerkleTree.size();
+        vMerkleTree.resize(nOut + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nOut].begin(), vMerkleTree[j].begin(), nPairs);
+        if (nSize % 2) {
+            const uint256& last = vMerkleTree[j+nSize-1];
+            vMerkleTree[nOut+nPairs] = Hash(BEGIN(last), END(last), BEGIN(last), END(last));
         }
         j += nSize;
     }
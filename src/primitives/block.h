@@ -66,6 +66,8 @@ public:
         return (nBits == 0);
     }
 
+    // Runs the full Quark chain on every call: hash a header once and keep the
+    // result, or take it from its CBlockIndex (phashBlock) when there is one
     uint256 GetHash() const;
 
     int64_t GetBlockTime() const
@@ -104,6 +104,7 @@ static bool rest_block(AcceptedConnection* conn,
         throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     CBlock block;
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
@@ -111,13 +112,14 @@ static bool rest_block(AcceptedConnection* conn,
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
 
         pblockindex = mapBlockIndex[hash];
-        if (!ReadBlockFromDisk(block, pblockindex))
+        // Binary and hex output are the serialized block, which can be copied from disk as is
+        if (rf == RF_BINARY || rf == RF_HEX) {
+            if (!ReadRawBlockFromDisk(ssBlock, pblockindex))
+                throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        } else if (!ReadBlockFromDisk(block, pblockindex))
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
         string binaryBlock = ssBlock.str();
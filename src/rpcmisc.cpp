@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "clientversion.h"
+#include "coinvalidator.h"
 #include "init.h"
 #include "main.h"
 #include "servicenode-sync.h"
@@ -155,6 +156,37 @@ Value mnsync(const Array& params, bool fHelp)
     return "failure";
 }
 
+Value getcoinvalidatorinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoinvalidatorinfo\n"
+            "Returns the state of the infraction list used to validate transaction inputs.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"loaded\": true|false,    (boolean) If the infraction list is loaded\n"
+            "  \"entries\": n,            (numeric) Number of infractions in the list\n"
+            "  \"filterbytes\": n,        (numeric) Size of the prefilter in bytes\n"
+            "  \"prefilterclean\": n,     (numeric) Inputs the prefilter answered as clean\n"
+            "  \"prefiltermaybe\": n,     (numeric) Inputs that needed a lookup in the list\n"
+            "  \"infractions\": n         (numeric) Inputs found in the list\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getcoinvalidatorinfo", "") + HelpExampleRpc("getcoinvalidatorinfo", ""));
+
+    CoinValidator& validator = CoinValidator::instance();
+    CoinValidatorStats stats = validator.GetStats();
+
+    Object obj;
+    obj.push_back(Pair("loaded", validator.IsLoaded()));
+    obj.push_back(Pair("entries", (uint64_t)stats.entries));
+    obj.push_back(Pair("filterbytes", (uint64_t)stats.filterBytes));
+    obj.push_back(Pair("prefilterclean", stats.prefilterClean));
+    obj.push_back(Pair("prefiltermaybe", stats.prefilterMaybe));
+    obj.push_back(Pair("infractions", stats.infractions));
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 class DescribeAddressVisitor : public boost::static_visitor<Object>
 {
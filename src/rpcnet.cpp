@@ -8,6 +8,7 @@
 
 #include "clientversion.h"
 #include "main.h"
+#include "msgdispatcher.h"
 #include "net.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -325,6 +326,65 @@ Value getnettotals(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getmessagequeueinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagequeueinfo\n"
+            "\nReturns the state of the worker thread that processes servicenode, budget and spork messages.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"worker\": true|false,     (boolean) Whether the worker runs, false if these messages are processed inline\n"
+            "  \"subsystems\": {\n"
+            "    \"name\": {\n"
+            "      \"queued\": n,          (numeric) Messages waiting for the worker\n"
+            "      \"busy\": true|false    (boolean) Whether the worker is processing one of its messages\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"commands\": {\n"
+            "    \"command\": {\n"
+            "      \"queued\": n,          (numeric) Messages waiting or being processed\n"
+            "      \"maxqueued\": n,       (numeric) Highest number of messages waiting at once\n"
+            "      \"processed\": n,       (numeric) Messages processed\n"
+            "      \"avgwait\": n,         (numeric) Average time waited for the worker, in milliseconds\n"
+            "      \"avgtime\": n          (numeric) Average processing time, in milliseconds\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagequeueinfo", "") + HelpExampleRpc("getmessagequeueinfo", ""));
+
+    std::map<std::string, CMessageQueueStats> mapStats;
+    std::vector<std::pair<int64_t, bool> > vSubsystems;
+    messageDispatcher.GetStats(mapStats, vSubsystems);
+
+    Object subsystems;
+    for (unsigned int i = 0; i < vSubsystems.size(); i++) {
+        Object obj;
+        obj.push_back(Pair("queued", vSubsystems[i].first));
+        obj.push_back(Pair("busy", vSubsystems[i].second));
+        subsystems.push_back(Pair(GetMessageSubsystemName((MessageSubsystem)i), obj));
+    }
+
+    Object commands;
+    for (std::map<std::string, CMessageQueueStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CMessageQueueStats& stats = it->second;
+        Object obj;
+        obj.push_back(Pair("queued", stats.nQueued));
+        obj.push_back(Pair("maxqueued", stats.nMaxQueued));
+        obj.push_back(Pair("processed", stats.nProcessed));
+        obj.push_back(Pair("avgwait", stats.nProcessed ? stats.nWaitMicros * 0.001 / stats.nProcessed : 0.0));
+        obj.push_back(Pair("avgtime", stats.nProcessed ? stats.nRunMicros * 0.001 / stats.nProcessed : 0.0));
+        commands.push_back(Pair(it->first, obj));
+    }
+
+    Object obj;
+    obj.push_back(Pair("worker", messageDispatcher.IsRunning()));
+    obj.push_back(Pair("subsystems", subsystems));
+    obj.push_back(Pair("commands", commands));
+    return obj;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
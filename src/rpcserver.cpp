@@ -248,6 +248,7 @@ static const CRPCCommand vRPCCommands[] =
         {"network", "getaddednodeinfo", &getaddednodeinfo, true, true, false},
         {"network", "getconnectioncount", &getconnectioncount, true, false, false},
         {"network", "getnettotals", &getnettotals, true, true, false},
+        {"network", "getmessagequeueinfo", &getmessagequeueinfo, true, true, false},
         {"network", "getpeerinfo", &getpeerinfo, true, false, false},
         {"network", "ping", &ping, true, false, false},
 
@@ -262,6 +263,7 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", "getdifficulty", &getdifficulty, true, false, false},
         {"blockchain", "getmempoolinfo", &getmempoolinfo, true, true, false},
         {"blockchain", "getrawmempool", &getrawmempool, true, false, false},
+        {"blockchain", "savemempool", &savemempool, true, true, false},
         {"blockchain", "gettxout", &gettxout, true, false, false},
         {"blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true, false, false},
         {"blockchain", "verifychain", &verifychain, true, false, false},
@@ -311,6 +313,7 @@ static const CRPCCommand vRPCCommands[] =
         {"xcurrency", "mnfinalbudget", &mnfinalbudget, true, true, false},
         {"xcurrency", "mnsync", &mnsync, true, true, false},
         {"xcurrency", "spork", &spork, true, true, false},
+        {"xcurrency", "getcoinvalidatorinfo", &getcoinvalidatorinfo, true, true, false},
 #ifdef ENABLE_WALLET
         {"xcurrency", "obfuscation", &obfuscation, false, false, true}, /* not threadSafe because of SendMoney */
 
@@ -501,9 +501,69 @@ bool CServicenodePayments::AddWinningServicenode(CServicenodePaymentWinner& winn
 
     mapServicenodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
 
+    {
+        LOCK(cs_mapServicenodeBlocks);
+        if (mapServicenodeBlocks[winnerIn.nBlockHeight].HasPayeeWithVotes(winnerIn.payee, 2))
+            AddVotedHeight(winnerIn.payee, winnerIn.nBlockHeight);
+    }
+
     return true;
 }
 
+void CServicenodePayments::AddVotedHeight(const CScript& payee, int nBlockHeight)
+{
+    LOCK(cs_mapServicenodeBlocks);
+    mapPayeeVotedHeights[payee].insert(nBlockHeight);
+}
+
+void CServicenodePayments::RemoveVotedHeights(int nBlockHeight)
+{
+    LOCK(cs_mapServicenodeBlocks);
+
+    std::map<int, CServicenodeBlockPayees>::iterator it = mapServicenodeBlocks.find(nBlockHeight);
+    if (it == mapServicenodeBlocks.end()) return;
+
+    BOOST_FOREACH (CServicenodePayee& payee, (*it).second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator it2 = mapPayeeVotedHeights.find(payee.scriptPubKey);
+        if (it2 == mapPayeeVotedHeights.end()) continue;
+
+        (*it2).second.erase(nBlockHeight);
+        if ((*it2).second.empty()) mapPayeeVotedHeights.erase(it2);
+    }
+}
+
+void CServicenodePayments::RebuildVotedHeights()
+{
+    LOCK(cs_mapServicenodeBlocks);
+
+    mapPayeeVotedHeights.clear();
+
+    std::map<int, CServicenodeBlockPayees>::iterator it = mapServicenodeBlocks.begin();
+    while (it != mapServicenodeBlocks.end()) {
+        BOOST_FOREACH (CServicenodePayee& payee, (*it).second.vecPayments) {
+            if (payee.nVotes >= 2) AddVotedHeight(payee.scriptPubKey, (*it).first);
+        }
+        ++it;
+    }
+}
+
+// Most recent height in [nMinHeight, nMaxHeight] where this payee got at least 2 votes, 0 if there is none
+int CServicenodePayments::GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight)
+{
+    LOCK(cs_mapServicenodeBlocks);
+
+    std::map<CScript, std::set<int> >::iterator it = mapPayeeVotedHeights.find(payee);
+    if (it == mapPayeeVotedHeights.end()) return 0;
+
+    std::set<int>::iterator itHeight = (*it).second.upper_bound(nMaxHeight);
+    if (itHeight == (*it).second.begin()) return 0;
+    --itHeight;
+
+    if (*itHeight < nMinHeight) return 0;
+
+    return *itHeight;
+}
+
 bool CServicenodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -621,6 +681,7 @@ void CServicenodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CServicenodePayments::CleanPaymentList - Removing old Servicenode payment - block %d\n", winner.nBlockHeight);
             servicenodeSync.mapSeenSyncMNW.erase((*it).first);
             mapServicenodePayeeVotes.erase(it++);
+            RemoveVotedHeights(winner.nBlockHeight);
             mapServicenodeBlocks.erase(winner.nBlockHeight);
         } else {
             ++it;
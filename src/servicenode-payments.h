@@ -236,6 +236,13 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // block heights where a payee has at least 2 votes, by payee, used for last paid lookups
+    std::map<CScript, std::set<int> > mapPayeeVotedHeights;
+
+    void AddVotedHeight(const CScript& payee, int nBlockHeight);
+    void RemoveVotedHeights(int nBlockHeight);
+    void RebuildVotedHeights();
+
 public:
     std::map<uint256, CServicenodePaymentWinner> mapServicenodePayeeVotes;
     std::map<int, CServicenodeBlockPayees> mapServicenodeBlocks;
@@ -252,6 +259,7 @@ public:
         LOCK2(cs_mapServicenodeBlocks, cs_mapServicenodePayeeVotes);
         mapServicenodeBlocks.clear();
         mapServicenodePayeeVotes.clear();
+        mapPayeeVotedHeights.clear();
     }
 
     bool AddWinningServicenode(CServicenodePaymentWinner& winner);
@@ -264,6 +272,7 @@ public:
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CServicenode& mn, int nNotBlockHeight);
+    int GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight);
 
     bool CanVote(COutPoint outServicenode, int nBlockHeight)
     {
@@ -295,6 +304,9 @@ public:
     {
         READWRITE(mapServicenodePayeeVotes);
         READWRITE(mapServicenodeBlocks);
+
+        if (ser_action.ForRead())
+            RebuildVotedHeights();
     }
 };
 
@@ -15,48 +15,24 @@
 
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenServicenodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the block before the given height (0 stands for the tip height, so the block before the tip),
+//straight from the active chain so reorgs are followed
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0 || pindexTip->nHeight + 1 < nBlockHeight) return false;
 
     if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+        nBlockHeight = pindexTip->nHeight;
+    int nHeight = nBlockHeight - 1;
+    if (nHeight <= 0) return false;
 
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
+    const CBlockIndex* pindex = chainActive[nHeight];
+    if (pindex == NULL) return false;
 
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
-
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CServicenode::CServicenode()
@@ -157,6 +133,7 @@ bool CServicenode::UpdateFromNewBroadcast(CServicenodeBroadcast& mnb)
             lastPing = mnb.lastPing;
             mnodeman.mapSeenServicenodePing.insert(make_pair(lastPing.GetHash(), lastPing));
         }
+        mnodeman.UpdateServicenodeIndex(vin);
         return true;
     }
     return false;
@@ -236,12 +213,9 @@ void CServicenode::Check(bool forceCheck)
     activeState = SERVICENODE_ENABLED; // OK
 }
 
-int64_t CServicenode::SecondsSincePayment()
+int64_t CServicenode::SecondsSincePayment(int nMnCount)
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
-
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nMnCount));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -254,7 +228,10 @@ int64_t CServicenode::SecondsSincePayment()
     return month + hash.GetCompact(false);
 }
 
-int64_t CServicenode::GetLastPaid()
+//
+// nMnCount is the number of enabled servicenodes, pass it in when calling this for the whole list
+//
+int64_t CServicenode::GetLastPaid(int nMnCount)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return false;
@@ -270,36 +247,17 @@ int64_t CServicenode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
+    if (nMnCount < 0) nMnCount = mnodeman.CountEnabled();
+    int nBlocksBack = nMnCount * 1.25;
 
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (servicenodePayments.mapServicenodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (servicenodePayments.mapServicenodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    /*
+        Search the last nBlocksBack blocks for this payee, with at least 2 votes. This will aid in consensus allowing
+        the network to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nHeight = servicenodePayments.GetLastPaidHeight(mnpayee, std::max(1, pindexPrev->nHeight - nBlocksBack + 1), pindexPrev->nHeight);
+    if (nHeight == 0) return 0;
 
-    return 0;
+    return chainActive[nHeight]->nTime + nOffset;
 }
 
 std::string CServicenode::GetStatus()
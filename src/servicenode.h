@@ -27,7 +27,6 @@ using namespace std;
 class CServicenode;
 class CServicenodeBroadcast;
 class CServicenodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -217,7 +216,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CServicenodeBroadcast& mnb);
 
@@ -280,7 +279,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nMnCount = -1);
     bool IsValidNetAddr();
 };
 
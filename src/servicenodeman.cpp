@@ -24,11 +24,11 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
+struct CompareScoreTxInDesc {
     bool operator()(const pair<int64_t, CTxIn>& t1,
         const pair<int64_t, CTxIn>& t2) const
     {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
@@ -207,6 +207,8 @@ bool CServicenodeMan::Add(CServicenode& mn)
     if (pmn == NULL) {
         LogPrint("servicenode", "CServicenodeMan: Adding new Servicenode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vServicenodes.push_back(mn);
+        IndexServicenode(vServicenodes.size() - 1);
+        ClearRankCache();
         return true;
     }
 
@@ -245,6 +247,7 @@ void CServicenodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
+    bool fRemoved = false;
     vector<CServicenode>::iterator it = vServicenodes.begin();
     while (it != vServicenodes.end()) {
         if ((*it).activeState == CServicenode::SERVICENODE_REMOVE ||
@@ -277,11 +280,17 @@ void CServicenodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vServicenodes.erase(it);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
 
+    if (fRemoved) RebuildIndexes();
+
+    // states were refreshed by Check() above, rank again on next use
+    ClearRankCache();
+
     // check who's asked for the Servicenode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForServicenodeList.begin();
     while (it1 != mAskedUsForServicenodeList.end()) {
@@ -338,11 +347,16 @@ void CServicenodeMan::Clear()
 {
     LOCK(cs);
     vServicenodes.clear();
+    mapIndexByOutPoint.clear();
+    mapIndexByPayee.clear();
+    mapIndexByPubKey.clear();
     mAskedUsForServicenodeList.clear();
     mWeAskedForServicenodeList.clear();
     mWeAskedForServicenodeListEntry.clear();
     mapSeenServicenodeBroadcast.clear();
     mapSeenServicenodePing.clear();
+    mapScoreCache.clear();
+    mapRankCache.clear();
     nDsqCount = 0;
 }
 
@@ -381,40 +395,93 @@ void CServicenodeMan::DsegUpdate(CNode* pnode)
     mWeAskedForServicenodeList[pnode->addr] = askAgain;
 }
 
+void CServicenodeMan::IndexServicenode(size_t nIndex)
+{
+    const CServicenode& mn = vServicenodes[nIndex];
+    mapIndexByOutPoint[mn.vin.prevout] = nIndex;
+
+    // on duplicate payees or keys the first entry wins, like a linear scan would; an entry
+    // further down never takes a key over, even a stale one, as Find() rebuilds on those
+    std::pair<boost::unordered_map<CScript, size_t, CServicenodeScriptHasher>::iterator, bool> retPayee =
+        mapIndexByPayee.insert(std::make_pair(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()), nIndex));
+    if (!retPayee.second && nIndex < retPayee.first->second)
+        retPayee.first->second = nIndex;
+    std::pair<boost::unordered_map<CPubKey, size_t, CServicenodePubKeyHasher>::iterator, bool> retPubKey =
+        mapIndexByPubKey.insert(std::make_pair(mn.pubKeyServicenode, nIndex));
+    if (!retPubKey.second && nIndex < retPubKey.first->second)
+        retPubKey.first->second = nIndex;
+}
+
+void CServicenodeMan::RebuildIndexes()
+{
+    LOCK(cs);
+
+    mapIndexByOutPoint.clear();
+    mapIndexByPayee.clear();
+    mapIndexByPubKey.clear();
+
+    for (size_t i = 0; i < vServicenodes.size(); i++)
+        IndexServicenode(i);
+}
+
+void CServicenodeMan::UpdateServicenodeIndex(const CTxIn& vin)
+{
+    LOCK(cs);
+
+    boost::unordered_map<COutPoint, size_t, CServicenodeOutPointHasher>::iterator it = mapIndexByOutPoint.find(vin.prevout);
+    if (it == mapIndexByOutPoint.end()) return;
+
+    // keys the entry had before are left behind, Find() skips them as they no longer match
+    IndexServicenode((*it).second);
+    ClearRankCache();
+}
+
 CServicenode* CServicenodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CServicenode& mn, vServicenodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    boost::unordered_map<CScript, size_t, CServicenodeScriptHasher>::iterator it = mapIndexByPayee.find(payee);
+    if (it == mapIndexByPayee.end()) return NULL;
+
+    CServicenode& mn = vServicenodes[(*it).second];
+    if (GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()) != payee) {
+        // stale entry left behind by a key update, another node may still use this key
+        RebuildIndexes();
+        it = mapIndexByPayee.find(payee);
+        if (it == mapIndexByPayee.end()) return NULL;
+        return &vServicenodes[(*it).second];
     }
-    return NULL;
+
+    return &mn;
 }
 
 CServicenode* CServicenodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CServicenode& mn, vServicenodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
-}
+    boost::unordered_map<COutPoint, size_t, CServicenodeOutPointHasher>::iterator it = mapIndexByOutPoint.find(vin.prevout);
+    if (it == mapIndexByOutPoint.end()) return NULL;
 
+    return &vServicenodes[(*it).second];
+}
 
 CServicenode* CServicenodeMan::Find(const CPubKey& pubKeyServicenode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CServicenode& mn, vServicenodes) {
-        if (mn.pubKeyServicenode == pubKeyServicenode)
-            return &mn;
+    boost::unordered_map<CPubKey, size_t, CServicenodePubKeyHasher>::iterator it = mapIndexByPubKey.find(pubKeyServicenode);
+    if (it == mapIndexByPubKey.end()) return NULL;
+
+    CServicenode& mn = vServicenodes[(*it).second];
+    if (mn.pubKeyServicenode != pubKeyServicenode) {
+        // stale entry left behind by a key update, another node may still use this key
+        RebuildIndexes();
+        it = mapIndexByPubKey.find(pubKeyServicenode);
+        if (it == mapIndexByPubKey.end()) return NULL;
+        return &vServicenodes[(*it).second];
     }
-    return NULL;
+
+    return &mn;
 }
 
 //
@@ -448,7 +515,7 @@ CServicenode* CServicenodeMan::GetNextServicenodeInQueueForPayment(int nBlockHei
         //make sure it has as many confirmations as there are servicenodes
         if (mn.GetServicenodeInputAge() < nMnCount) continue;
 
-        vecServicenodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecServicenodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecServicenodeLastPaid.size();
@@ -470,7 +537,7 @@ CServicenode* CServicenodeMan::GetNextServicenodeInQueueForPayment(int nBlockHei
         CServicenode* pmn = Find(s.second);
         if (!pmn) break;
 
-        uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
+        uint256 n = GetScore(*pmn, nBlockHeight - 100);
         if (n > nHigh) {
             nHigh = n;
             pBestServicenode = pmn;
@@ -513,66 +580,103 @@ CServicenode* CServicenodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclu
     return NULL;
 }
 
-CServicenode* CServicenodeMan::GetCurrentServiceNode(int mod, int64_t nBlockHeight, int minProtocol)
+void CServicenodeMan::CheckScoreCacheTip()
 {
-    int64_t score = 0;
-    CServicenode* winner = NULL;
-
-    // scan for winner
-    BOOST_FOREACH (CServicenode& mn, vServicenodes) {
-        mn.Check();
-        if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+    uint256 hashTip = 0;
+    if (chainActive.Tip() != NULL) hashTip = chainActive.Tip()->GetBlockHash();
+    if (hashTip == hashScoreCacheTip) return;
+
+    // new block or reorg, scores for recent heights may refer to blocks that are no longer in the chain
+    mapScoreCache.clear();
+    mapRankCache.clear();
+    hashScoreCacheTip = hashTip;
+}
 
-        // calculate the score for each Servicenode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+uint256 CServicenodeMan::GetScore(CServicenode& mn, int64_t nBlockHeight)
+{
+    LOCK(cs);
+    CheckScoreCacheTip();
 
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
-    }
+    std::map<COutPoint, uint256>& mapScores = mapScoreCache[nBlockHeight];
+    std::map<COutPoint, uint256>::iterator it = mapScores.find(mn.vin.prevout);
+    if (it != mapScores.end()) return (*it).second;
 
-    return winner;
+    uint256 n = mn.CalculateScore(1, nBlockHeight);
+    mapScores.insert(make_pair(mn.vin.prevout, n));
+    return n;
 }
 
-int CServicenodeMan::GetServicenodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CServicenodeMan::CServicenodeRankCache* CServicenodeMan::GetRankCache(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecServicenodeScores;
+    LOCK(cs);
+    CheckScoreCacheTip();
 
     //make sure we know about this block
     uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    RankCacheKey key = make_pair(nBlockHeight, make_pair(minProtocol, fOnlyActive));
+    std::map<RankCacheKey, CServicenodeRankCache>::iterator it = mapRankCache.find(key);
+    if (it != mapRankCache.end()) return &(*it).second;
+
+    CServicenodeRankCache cache;
 
-    // scan for winner
     BOOST_FOREACH (CServicenode& mn, vServicenodes) {
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+
+        uint256 n = GetScore(mn, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
 
-        vecServicenodeScores.push_back(make_pair(n2, mn.vin));
+        cache.vecScores.push_back(make_pair(n2, mn.vin));
     }
 
-    sort(vecServicenodeScores.rbegin(), vecServicenodeScores.rend(), CompareScoreTxIn());
+    // stable so that equal scores keep list order, the first one found wins like in a linear scan
+    stable_sort(cache.vecScores.begin(), cache.vecScores.end(), CompareScoreTxInDesc());
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecServicenodeScores) {
+    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, cache.vecScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+        cache.mapRank.insert(make_pair(s.second.prevout, rank));
     }
 
-    return -1;
+    it = mapRankCache.insert(make_pair(key, cache)).first;
+    return &(*it).second;
+}
+
+CServicenode* CServicenodeMan::GetCurrentServiceNode(int mod, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
+
+    const CServicenodeRankCache* pcache = GetRankCache(nBlockHeight, minProtocol, true);
+    if (pcache == NULL || pcache->vecScores.empty()) return NULL;
+
+    // the winner needs a score above zero
+    if (pcache->vecScores.front().first <= 0) return NULL;
+
+    return Find(pcache->vecScores.front().second);
+}
+
+int CServicenodeMan::GetServicenodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
+
+    const CServicenodeRankCache* pcache = GetRankCache(nBlockHeight, minProtocol, fOnlyActive);
+    if (pcache == NULL) return -1;
+
+    std::map<COutPoint, int>::const_iterator it = pcache->mapRank.find(vin.prevout);
+    if (it == pcache->mapRank.end()) return -1;
+
+    return (*it).second;
 }
 
 std::vector<pair<int, CServicenode> > CServicenodeMan::GetServicenodeRanks(int64_t nBlockHeight, int minProtocol)
 {
+    LOCK(cs);
+
     std::vector<pair<int64_t, CServicenode> > vecServicenodeScores;
     std::vector<pair<int, CServicenode> > vecServicenodeRanks;
 
@@ -591,7 +695,7 @@ std::vector<pair<int, CServicenode> > CServicenodeMan::GetServicenodeRanks(int64
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        uint256 n = GetScore(mn, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
 
         vecServicenodeScores.push_back(make_pair(n2, mn));
@@ -610,33 +714,14 @@ std::vector<pair<int, CServicenode> > CServicenodeMan::GetServicenodeRanks(int64
 
 CServicenode* CServicenodeMan::GetServicenodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecServicenodeScores;
-
-    // scan for winner
-    BOOST_FOREACH (CServicenode& mn, vServicenodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    LOCK(cs);
 
-        vecServicenodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    const CServicenodeRankCache* pcache = GetRankCache(nBlockHeight, minProtocol, fOnlyActive);
+    if (pcache == NULL) return NULL;
 
-    sort(vecServicenodeScores.rbegin(), vecServicenodeScores.rend(), CompareScoreTxIn());
+    if (nRank < 1 || nRank > (int)pcache->vecScores.size()) return NULL;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecServicenodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
-
-    return NULL;
+    return Find(pcache->vecScores[nRank - 1].second);
 }
 
 void CServicenodeMan::ProcessServicenodeConnections()
@@ -881,6 +966,7 @@ void CServicenodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
                         pmn->addr = addr;
                         //fake ping
                         pmn->lastPing = CServicenodePing(vin);
+                        UpdateServicenodeIndex(vin);
                     }
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
@@ -1073,6 +1159,8 @@ void CServicenodeMan::Remove(CTxIn vin)
         if ((*it).vin == vin) {
             LogPrint("servicenode", "CServicenodeMan: Removing Servicenode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
             vServicenodes.erase(it);
+            RebuildIndexes();
+            ClearRankCache();
             break;
         }
         ++it;
@@ -14,6 +14,9 @@
 #include "sync.h"
 #include "util.h"
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
 #define SERVICENODES_DUMP_SECONDS (15 * 60)
 #define SERVICENODES_DSEG_SECONDS (3 * 60 * 60)
 
@@ -24,6 +27,23 @@ class CServicenodeMan;
 extern CServicenodeMan mnodeman;
 void DumpServicenodes();
 
+struct CServicenodeOutPointHasher {
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        size_t seed = outpoint.hash.GetLow64();
+        boost::hash_combine(seed, outpoint.n);
+        return seed;
+    }
+};
+
+struct CServicenodeScriptHasher {
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+};
+
+struct CServicenodePubKeyHasher {
+    size_t operator()(const CPubKey& pubkey) const { return boost::hash_range(pubkey.begin(), pubkey.end()); }
+};
+
 /** Access to the MN database (mncache.dat)
  */
 class CServicenodeDB
@@ -59,6 +79,10 @@ private:
 
     // map to hold all MNs
     std::vector<CServicenode> vServicenodes;
+    // positions in vServicenodes by collateral outpoint, payee script and servicenode pubkey
+    boost::unordered_map<COutPoint, size_t, CServicenodeOutPointHasher> mapIndexByOutPoint;
+    boost::unordered_map<CScript, size_t, CServicenodeScriptHasher> mapIndexByPayee;
+    boost::unordered_map<CPubKey, size_t, CServicenodePubKeyHasher> mapIndexByPubKey;
     // who's asked for the Servicenode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForServicenodeList;
     // who we asked for the Servicenode list and the last time
@@ -66,6 +90,34 @@ private:
     // which Servicenodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForServicenodeListEntry;
 
+    // Servicenode ranking for one (block height, min protocol, active only) query, sorted high to low
+    struct CServicenodeRankCache {
+        std::vector<pair<int64_t, CTxIn> > vecScores;
+        std::map<COutPoint, int> mapRank;
+    };
+    typedef std::pair<int64_t, std::pair<int, bool> > RankCacheKey;
+
+    // tip the score caches were computed against, they are dropped whenever it changes
+    uint256 hashScoreCacheTip;
+    // scores by block height and collateral outpoint, only depend on the block hash so survive list changes
+    std::map<int64_t, std::map<COutPoint, uint256> > mapScoreCache;
+    // sorted rankings, depend on the list contents so are dropped on every list change
+    std::map<RankCacheKey, CServicenodeRankCache> mapRankCache;
+
+    /// Add the Servicenode at the given position in vServicenodes to the lookup indexes
+    void IndexServicenode(size_t nIndex);
+    /// Rebuild all lookup indexes, needed whenever positions in vServicenodes shift
+    void RebuildIndexes();
+
+    /// Drop cached scores and rankings if the tip moved since they were computed
+    void CheckScoreCacheTip();
+    /// Drop cached rankings after the Servicenode list changed
+    void ClearRankCache() { mapRankCache.clear(); }
+    /// Get the (cached) score of a Servicenode for the given block height
+    uint256 GetScore(CServicenode& mn, int64_t nBlockHeight);
+    /// Get the (cached) sorted ranking for the given block height, NULL if the block is unknown
+    const CServicenodeRankCache* GetRankCache(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CServicenodeBroadcast> mapSeenServicenodeBroadcast;
@@ -89,6 +141,9 @@ public:
 
         READWRITE(mapSeenServicenodeBroadcast);
         READWRITE(mapSeenServicenodePing);
+
+        if (ser_action.ForRead())
+            RebuildIndexes();
     }
 
     CServicenodeMan();
@@ -118,6 +173,9 @@ public:
     CServicenode* Find(const CTxIn& vin);
     CServicenode* Find(const CPubKey& pubKeyServicenode);
 
+    /// Update the lookup indexes after the keys of a known Servicenode changed
+    void UpdateServicenodeIndex(const CTxIn& vin);
+
     /// Find an entry in the servicenode list that is next to be paid
     CServicenode* GetNextServicenodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
 
@@ -20,6 +20,7 @@ class CSporkManager;
 
 CSporkManager sporkManager;
 
+CCriticalSection cs_mapSporks;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
@@ -37,12 +38,15 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         if (chainActive.Tip() == NULL) return;
 
         uint256 hash = spork.GetHash();
-        if (mapSporksActive.count(spork.nSporkID)) {
-            if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
-                if (fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
-                return;
-            } else {
-                if (fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+        {
+            LOCK(cs_mapSporks);
+            if (mapSporksActive.count(spork.nSporkID)) {
+                if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
+                    if (fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+                    return;
+                } else {
+                    if (fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+                }
             }
         }
 
@@ -54,17 +58,25 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
             return;
         }
 
-        mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            mapSporks[hash] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         //does a task if needed
         ExecuteSpork(spork.nSporkID, spork.nValue);
     }
     if (strCommand == "getsporks") {
-        std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
+        std::map<int, CSporkMessage> mapSporksActiveCopy;
+        {
+            LOCK(cs_mapSporks);
+            mapSporksActiveCopy = mapSporksActive;
+        }
+        std::map<int, CSporkMessage>::iterator it = mapSporksActiveCopy.begin();
 
-        while (it != mapSporksActive.end()) {
+        while (it != mapSporksActiveCopy.end()) {
             pfrom->PushMessage("spork", it->second);
             it++;
         }
@@ -76,6 +88,7 @@ bool IsSporkActive(int nSporkID)
 {
     int64_t r = -1;
 
+    LOCK(cs_mapSporks);
     if (mapSporksActive.count(nSporkID)) {
         r = mapSporksActive[nSporkID].nValue;
     } else {
@@ -106,6 +119,7 @@ int64_t GetSporkValue(int nSporkID)
 {
     int64_t r = -1;
 
+    LOCK(cs_mapSporks);
     if (mapSporksActive.count(nSporkID)) {
         r = mapSporksActive[nSporkID].nValue;
     } else {
@@ -225,6 +239,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
 
     if (Sign(msg)) {
         Relay(msg);
+        LOCK(cs_mapSporks);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
         return true;
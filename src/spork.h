@@ -60,6 +60,8 @@ using namespace boost;
 class CSporkMessage;
 class CSporkManager;
 
+//! Guards mapSporks and mapSporksActive, which block validation reads from any thread
+extern CCriticalSection cs_mapSporks;
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
 extern CSporkManager sporkManager;
@@ -0,0 +1,183 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CMutableTransaction RandomSpend()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 1000;
+    return tx;
+}
+
+static CBlock BuildBlockTestCase(bool fProofOfStake)
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << OP_1 << OP_1;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    coinbase.vout[0].nValue = 42;
+    block.vtx.push_back(coinbase);
+
+    if (fProofOfStake) {
+        // The first output of a coinstake is empty
+        CMutableTransaction coinstake = RandomSpend();
+        coinstake.vout.resize(2);
+        coinstake.vout[0].SetEmpty();
+        coinstake.vout[1].scriptPubKey = CScript() << OP_TRUE;
+        coinstake.vout[1].nValue = 100;
+        block.vtx.push_back(coinstake);
+        block.vchBlockSig.assign(72, 0x30);
+    }
+
+    for (int i = 0; i < 3; i++)
+        block.vtx.push_back(RandomSpend());
+
+    block.nVersion = 3;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1500000000;
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    BOOST_CHECK_EQUAL(stream.size(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+    CBlockHeaderAndShortTxIDs cmpctblockOut;
+    stream >> cmpctblockOut;
+    BOOST_CHECK(stream.empty());
+    return cmpctblockOut;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(false));
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+
+    // Too few, wrong and correct missing transactions
+    CBlock block2;
+    PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+    BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_INVALID);
+
+    partialBlockCopy = partialBlock;
+    std::vector<CTransaction> vtx_missing;
+    vtx_missing.push_back(block.vtx[3]);
+    vtx_missing.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlockCopy.FillBlock(block2, vtx_missing) == READ_STATUS_FAILED);
+
+    std::swap(vtx_missing[0], vtx_missing[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block2.vtx.size(), block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(block2.vtx[i] == block.vtx[i]);
+}
+
+BOOST_AUTO_TEST_CASE(ProofOfStakeTest)
+{
+    // The coinstake is sent along and the block signature carried over
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(true));
+    BOOST_CHECK(block.IsProofOfStake());
+    for (size_t i = 2; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK(block2.IsProofOfStake());
+    BOOST_CHECK(block2.vchBlockSig == block.vchBlockSig);
+
+    CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss1 << block;
+    ss2 << block2;
+    BOOST_CHECK(ss1.str() == ss2.str());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(false));
+    block.vtx.resize(1);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.push_back(0);
+    req1.indexes.push_back(1);
+    req1.indexes.push_back(3);
+    req1.indexes.push_back(4);
+    req1.indexes.push_back(65535);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+    BOOST_CHECK_EQUAL(stream.size(), ::GetSerializeSize(req1, SER_NETWORK, PROTOCOL_VERSION));
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK(req1.indexes == req2.indexes);
+
+    // An index past 16 bits is refused
+    CDataStream stream2(SER_NETWORK, PROTOCOL_VERSION);
+    stream2 << req1.blockhash;
+    WriteCompactSize(stream2, 2);
+    WriteCompactSize(stream2, 65535);
+    WriteCompactSize(stream2, 0);
+    BOOST_CHECK_THROW(stream2 >> req2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
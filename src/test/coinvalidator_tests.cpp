@@ -0,0 +1,308 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinvalidator.h"
+
+#include "base58.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "hash.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(coinvalidator_tests)
+
+// Infractions spread over fewer txids than entries, so that some txids have several
+static std::vector<InfractionData> RandomInfractions(size_t nCount, size_t nTxIds)
+{
+    std::vector<uint256> vTxIds;
+    for (size_t i = 0; i < nTxIds; i++)
+        vTxIds.push_back(GetRandHash());
+    std::vector<InfractionData> infractions;
+    for (size_t i = 0; i < nCount; i++) {
+        CAmount amount = 1 + GetRand(1000 * COIN);
+        infractions.emplace_back(vTxIds[GetRand(nTxIds)].GetHex(), strprintf("address%d", GetRand(10)), amount, (double)amount / COIN);
+    }
+    return infractions;
+}
+
+// The infractions of txId in list order, as a scan of the whole list finds them
+static std::vector<InfractionData> FindSerially(const std::vector<InfractionData>& infractions, const uint256& txId)
+{
+    std::vector<InfractionData> found;
+    for (size_t i = 0; i < infractions.size(); i++) {
+        if (uint256S(infractions[i].txid) == txId)
+            found.push_back(infractions[i]);
+    }
+    return found;
+}
+
+static bool SameInfractions(const std::vector<InfractionData>& a, const std::vector<InfractionData>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].txid != b[i].txid || a[i].address != b[i].address || a[i].amount != b[i].amount || a[i].amountH != b[i].amountH)
+            return false;
+    }
+    return true;
+}
+
+// Writes expl.dat in the layout CoinValidator reads it from
+static void WriteExplCache(const std::vector<InfractionData>& infractions, int nHeight)
+{
+    static const char magic[8] = {'X', 'C', 'E', 'X', 'P', 'L', 0, 0};
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(magic) << CoinValidator::CACHE_VERSION << (int32_t)nHeight << (uint32_t)infractions.size() << (uint32_t)0;
+    for (size_t i = 0; i < infractions.size(); i++) {
+        InfractionRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        uint256 txid = uint256S(infractions[i].txid);
+        memcpy(rec.txid, txid.begin(), sizeof(rec.txid));
+        strncpy(rec.address, infractions[i].address.c_str(), sizeof(rec.address) - 1);
+        rec.amount = infractions[i].amount;
+        rec.amountH = infractions[i].amountH;
+        ss << FLATDATA(rec);
+    }
+    uint256 hash = Hash(ss.begin(), ss.end());
+    ss << hash;
+
+    CAutoFile fileout(fopen((GetDataDir() / "expl.dat").string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!fileout.IsNull());
+    fileout << ss;
+}
+
+static void CheckAgainstList(CoinValidator& validator, const std::vector<InfractionData>& infractions)
+{
+    for (size_t i = 0; i < infractions.size(); i++) {
+        uint256 txId = uint256S(infractions[i].txid);
+        BOOST_CHECK(!validator.IsCoinValid(txId));
+        BOOST_CHECK(SameInfractions(validator.GetInfractions(txId), FindSerially(infractions, txId)));
+    }
+    for (int i = 0; i < 500; i++) {
+        uint256 txId = GetRandHash();
+        BOOST_CHECK(validator.IsCoinValid(txId));
+        BOOST_CHECK(validator.GetInfractions(txId).empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(infraction_index_lookups)
+{
+    std::vector<InfractionData> infractions = RandomInfractions(500, 300);
+    std::vector<InfractionData> vCopy(infractions);
+    InfractionIndex index(vCopy);
+    BOOST_CHECK_EQUAL(index.Size(), infractions.size());
+
+    for (size_t i = 0; i < infractions.size(); i++) {
+        uint256 txId = uint256S(infractions[i].txid);
+        BOOST_CHECK(index.Contains(txId));
+        BOOST_CHECK(SameInfractions(index.Get(txId), FindSerially(infractions, txId)));
+    }
+    for (int i = 0; i < 500; i++) {
+        uint256 txId = GetRandHash();
+        BOOST_CHECK(!index.Contains(txId));
+        BOOST_CHECK(index.Get(txId).empty());
+    }
+
+    // An empty list has nothing, and still answers
+    std::vector<InfractionData> vEmpty;
+    InfractionIndex indexEmpty(vEmpty);
+    BOOST_CHECK(!indexEmpty.Contains(GetRandHash()));
+    BOOST_CHECK(indexEmpty.Get(GetRandHash()).empty());
+}
+
+BOOST_AUTO_TEST_CASE(infraction_index_edges)
+{
+    // The lowest and highest txids, and several infractions of one txid between other entries
+    const uint256 txIdLow = uint256S("0000000000000000000000000000000000000000000000000000000000000000");
+    const uint256 txIdHigh = uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+    const uint256 txIdMulti = GetRandHash();
+    std::vector<InfractionData> infractions;
+    infractions.emplace_back(txIdMulti.GetHex(), "address1", 3 * COIN, 3.0);
+    infractions.emplace_back(txIdHigh.GetHex(), "address2", 1 * COIN, 1.0);
+    infractions.emplace_back(txIdMulti.GetHex(), "address3", 2 * COIN, 2.0);
+    infractions.emplace_back(txIdLow.GetHex(), "address4", 1 * COIN, 1.0);
+    infractions.emplace_back(txIdMulti.GetHex(), "address1", 1 * COIN, 1.0);
+    std::vector<InfractionData> vCopy(infractions);
+    InfractionIndex index(vCopy);
+
+    BOOST_CHECK(index.Contains(txIdLow));
+    BOOST_CHECK(index.Contains(txIdHigh));
+    BOOST_CHECK_EQUAL(index.Get(txIdLow).size(), 1U);
+    BOOST_CHECK_EQUAL(index.Get(txIdHigh).size(), 1U);
+
+    // Infractions of the same txid keep the order of the list
+    std::vector<InfractionData> vMulti = index.Get(txIdMulti);
+    BOOST_CHECK(SameInfractions(vMulti, FindSerially(infractions, txIdMulti)));
+    BOOST_REQUIRE_EQUAL(vMulti.size(), 3U);
+    BOOST_CHECK_EQUAL(vMulti[0].amount, 3 * COIN);
+    BOOST_CHECK_EQUAL(vMulti[2].amount, 1 * COIN);
+
+    // Neighbours of listed txids are not listed
+    uint256 txIdNext = txIdLow;
+    *txIdNext.begin() = 1;
+    BOOST_CHECK(!index.Contains(txIdNext));
+    uint256 txIdPrev = txIdHigh;
+    *txIdPrev.begin() = 0xfe;
+    BOOST_CHECK(!index.Contains(txIdPrev));
+    BOOST_CHECK(index.Get(txIdPrev).empty());
+}
+
+BOOST_AUTO_TEST_CASE(coinvalidator_cache_reload)
+{
+    CoinValidator& validator = CoinValidator::instance();
+    validator.Clear();
+
+    // Loaded from the cache, then replaced by a newer one
+    std::vector<InfractionData> infractions = RandomInfractions(400, 250);
+    WriteExplCache(infractions, 1000);
+    BOOST_CHECK(validator.Load(1000));
+    BOOST_CHECK(validator.IsLoaded());
+    CheckAgainstList(validator, infractions);
+
+    std::vector<InfractionData> infractions2 = RandomInfractions(100, 100);
+    WriteExplCache(infractions2, 2000);
+    BOOST_CHECK(validator.Load(2000));
+    CheckAgainstList(validator, infractions2);
+    BOOST_CHECK(validator.IsCoinValid(uint256S(infractions[0].txid)));
+
+    // A cache at the height already loaded is not read again
+    WriteExplCache(infractions, 2000);
+    BOOST_CHECK(!validator.Load(2000));
+    CheckAgainstList(validator, infractions2);
+
+    validator.Clear();
+    BOOST_CHECK(validator.IsCoinValid(uint256S(infractions2[0].txid)));
+    boost::filesystem::remove(GetDataDir() / "expl.dat");
+}
+
+BOOST_AUTO_TEST_CASE(coinvalidator_stats)
+{
+    CoinValidator& validator = CoinValidator::instance();
+    validator.Clear();
+
+    std::vector<InfractionData> infractions = RandomInfractions(300, 200);
+    WriteExplCache(infractions, 1000);
+    BOOST_CHECK(validator.Load(1000));
+
+    // Every check is answered by the prefilter or the index, and only listed txids are infractions
+    CoinValidatorStats before = validator.GetStats();
+    uint64_t nChecks = 0, nFound = 0;
+    for (int i = 0; i < 2000; i++) {
+        uint256 txId = GetRand(4) ? GetRandHash() : uint256S(infractions[GetRand(infractions.size())].txid);
+        bool fListed = !FindSerially(infractions, txId).empty();
+        BOOST_CHECK_EQUAL(validator.IsCoinValid(txId), !fListed);
+        nChecks++;
+        if (fListed)
+            nFound++;
+    }
+    CoinValidatorStats after = validator.GetStats();
+    BOOST_CHECK_EQUAL((after.prefilterClean - before.prefilterClean) + (after.prefilterMaybe - before.prefilterMaybe), nChecks);
+    BOOST_CHECK_EQUAL(after.infractions - before.infractions, nFound);
+    BOOST_CHECK(after.prefilterMaybe - before.prefilterMaybe >= nFound);
+    BOOST_CHECK_EQUAL(after.entries, infractions.size());
+
+    validator.Clear();
+    boost::filesystem::remove(GetDataDir() / "expl.dat");
+}
+
+static CMutableTransaction Spend(const uint256& txId, unsigned int n, const CScript& scriptPubKey, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txId, n);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(checktransaction_flagged_inputs)
+{
+    // Flagged inputs are only checked from the validator's activation height
+    CBlockIndex index;
+    index.nHeight = CoinValidator::CHAIN_HEIGHT;
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&index);
+
+    CKey keyA, keyB;
+    keyA.MakeNewKey(true);
+    keyB.MakeNewKey(true);
+    const CScript scriptA = GetScriptForDestination(keyA.GetPubKey().GetID());
+    const CScript scriptB = GetScriptForDestination(keyB.GetPubKey().GetID());
+    const CScript scriptRedeem = GetScriptForDestination(CBitcoinAddress("BmL4hWa8T7Qi6ZZaL291jDai4Sv98opcSK").Get());
+
+    // X paid A, which is on the list, and B, which is not
+    CMutableTransaction txX;
+    txX.vin.resize(1);
+    txX.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txX.vout.resize(2);
+    txX.vout[0].scriptPubKey = scriptA;
+    txX.vout[0].nValue = 50 * COIN;
+    txX.vout[1].scriptPubKey = scriptB;
+    txX.vout[1].nValue = 20 * COIN;
+    const uint256 hashX = CTransaction(txX).GetHash();
+
+    CoinValidator& validator = CoinValidator::instance();
+    validator.Clear();
+    std::vector<InfractionData> infractions;
+    infractions.emplace_back(hashX.GetHex(), CBitcoinAddress(keyA.GetPubKey().GetID()).ToString(), 50 * COIN, 50.0);
+    WriteExplCache(infractions, CoinValidator::CHAIN_HEIGHT);
+    BOOST_CHECK(validator.Load(CoinValidator::CHAIN_HEIGHT));
+
+    CValidationState state;
+
+    // Unknown outputs of a flagged transaction are refused
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 1, scriptB, 19 * COIN), state));
+
+    // From the UTXO set: B's output is free to move, A's only to the redeem address
+    {
+        LOCK(cs_main);
+        *pcoinsTip->ModifyCoins(hashX) = CCoins(txX, 1);
+    }
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 1, scriptB, 19 * COIN), state));
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 0, scriptB, 49 * COIN), state));
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 0, scriptRedeem, 50 * COIN), state));
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 5, scriptB, 1 * COIN), state));
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(hashX)->Clear();
+    }
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 1, scriptB, 19 * COIN), state));
+
+    // Found once through the transaction lookup, the outputs are remembered after it is gone
+    mempool.addUnchecked(hashX, CTxMemPoolEntry(txX, 0, 0, 0.0, 1));
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 1, scriptB, 19 * COIN), state));
+    std::list<CTransaction> removed;
+    mempool.remove(txX, removed);
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 1, scriptB, 19 * COIN), state));
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 0, scriptB, 49 * COIN), state));
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 5, scriptB, 1 * COIN), state));
+
+    // One block below the activation height nothing is looked up
+    CBlockIndex indexBelow;
+    indexBelow.nHeight = CoinValidator::CHAIN_HEIGHT - 1;
+    chainActive.SetTip(&indexBelow);
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 0, scriptB, 49 * COIN), state));
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 5, scriptB, 1 * COIN), state));
+    chainActive.SetTip(&index);
+    BOOST_CHECK(!CheckTransaction(Spend(hashX, 0, scriptB, 49 * COIN), state));
+
+    chainActive.SetTip(pindexOld);
+    BOOST_CHECK(CheckTransaction(Spend(hashX, 0, scriptB, 49 * COIN), state));
+
+    validator.Clear();
+    boost::filesystem::remove(GetDataDir() / "expl.dat");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
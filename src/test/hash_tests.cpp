@@ -46,4 +46,48 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vectors of SipHash-2-4 for the key 00..0f and the messages 00, 00 01, ...
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    hasher.Write(0x0706050403020100ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+    hasher.Write(0x1716151413121110ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xb8ad50c6f649af94ull);
+    hasher.Write(0x1F1E1D1C1B1A1918ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x7127512f72f27cceull);
+
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL,
+                          uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")),
+        0x7127512f72f27cceull);
+}
+
+BOOST_AUTO_TEST_CASE(quark_batch)
+{
+    // The batched implementation must agree with HashQuark() for every lane,
+    // including partial SIMD groups, the empty input and multi-block inputs.
+    QuarkAutoDetect();
+    const size_t nStride = 160;
+    const size_t nMaxCount = 67;
+    vector<unsigned char> vchData(nStride * nMaxCount);
+    for (size_t i = 0; i < vchData.size(); i++)
+        vchData[i] = (unsigned char)(i * 131 + 7);
+
+    const size_t vLen[] = {0, 1, 64, 80, 111, 112, 150};
+    const size_t vCount[] = {1, 3, 4, 5, 33, 67};
+    for (size_t nLen : vLen) {
+        for (size_t nCount : vCount) {
+            vector<uint256> vHashes(nCount);
+            HashQuarkBatch(&vHashes[0], &vchData[0], nLen, nStride, nCount);
+            for (size_t i = 0; i < nCount; i++) {
+                const unsigned char* pbegin = &vchData[i * nStride];
+                BOOST_CHECK(vHashes[i] == HashQuark(pbegin, pbegin + nLen));
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
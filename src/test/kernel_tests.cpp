@@ -0,0 +1,381 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+
+#include "coins.h"
+#include "hash.h"
+#include "keystore.h"
+#include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// A chain of one block a minute, with a new stake modifier every ten blocks
+struct FakeChain {
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+    CBlockIndex* pindexOld;
+
+    FakeChain(int nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++) {
+            vHashes[i] = GetRandHash();
+            vIndex[i].nHeight = i;
+            vIndex[i].nTime = 1500000000 + i * 60;
+            vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+            vIndex[i].phashBlock = &vHashes[i];
+            vIndex[i].SetStakeModifier(i < 10 ? 0 : (i % 10 == 0 ? GetRand(std::numeric_limits<uint64_t>::max()) : vIndex[i - 1].nStakeModifier), i % 10 == 0);
+        }
+        pindexOld = chainActive.Tip();
+        chainActive.SetTip(&vIndex.back());
+    }
+
+    ~FakeChain()
+    {
+        chainActive.SetTip(pindexOld);
+    }
+};
+
+// The candidates tried one by one, as the staking loop did before the search
+static int SearchSerially(const std::vector<CStakeCandidate>& vCandidates, unsigned int nBits, unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake)
+{
+    int64_t nMedianTimePast = chainActive.Tip()->GetMedianTimePast();
+    for (size_t i = 0; i < vCandidates.size(); i++) {
+        const CStakeCandidate& candidate = vCandidates[i];
+        if (nTimeTx < candidate.pindexFrom->GetBlockTime() + nStakeMinAge)
+            continue;
+        for (unsigned int nTry = nTimeTx + nHashDrift; nTry > nTimeTx; nTry--) {
+            uint256 hash;
+            if (CheckStakeKernelHash(nBits, candidate.pindexFrom, candidate.nValue, candidate.prevout, nTry, hash)) {
+                if (nTry <= nMedianTimePast)
+                    break;
+                nTimeTx = nTry;
+                hashProofOfStake = hash;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_serial_parallel)
+{
+    FakeChain chain(400);
+    const unsigned int nTimeTx = chain.vIndex.back().nTime + 30;
+
+    // Outputs from every block but the last, the youngest are below the minimum age
+    std::vector<CStakeCandidate> vCandidates;
+    for (int i = 0; i < 300; i++) {
+        CStakeCandidate candidate = {&chain.vIndex[GetRand(chain.vIndex.size() - 1)], COutPoint(GetRandHash(), GetRand(4)), (int64_t)(1 + GetRand(100)) * COIN};
+        vCandidates.push_back(candidate);
+    }
+
+    boost::thread_group threads;
+    int nStakeThreadsOld = nStakeThreads;
+    nStakeThreads = 4;
+    for (int i = 0; i < nStakeThreads - 1; i++)
+        threads.create_thread(&ThreadStakeSearch);
+
+    // From a few hits per search down to none
+    const unsigned int vnBits[] = {0x1d008000, 0x1c100000, 0x1c010000, 0x1a010000};
+    for (unsigned int n = 0; n < sizeof(vnBits) / sizeof(vnBits[0]); n++) {
+        unsigned int nTimeSerial = nTimeTx, nTimeParallel = nTimeTx, nTimeReference = nTimeTx;
+        uint256 hashSerial = 0, hashParallel = 0, hashReference = 0;
+        int nReference = SearchSerially(vCandidates, vnBits[n], nTimeReference, 60, hashReference);
+        int nSerial = SearchStakeKernels(vCandidates, vnBits[n], nTimeSerial, 60, hashSerial, false);
+        int nParallel = SearchStakeKernels(vCandidates, vnBits[n], nTimeParallel, 60, hashParallel);
+
+        BOOST_CHECK_EQUAL(nSerial, nReference);
+        BOOST_CHECK_EQUAL(nParallel, nReference);
+        BOOST_CHECK_EQUAL(nTimeSerial, nTimeReference);
+        BOOST_CHECK_EQUAL(nTimeParallel, nTimeReference);
+        BOOST_CHECK(hashSerial == hashReference);
+        BOOST_CHECK(hashParallel == hashReference);
+    }
+
+    // Fewer candidates than a chunk are searched by the caller alone
+    std::vector<CStakeCandidate> vFew(vCandidates.begin(), vCandidates.begin() + 5);
+    unsigned int nTimeSerial = nTimeTx, nTimeParallel = nTimeTx;
+    uint256 hashSerial = 0, hashParallel = 0;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(vFew, 0x1d008000, nTimeSerial, 60, hashSerial, false),
+        SearchStakeKernels(vFew, 0x1d008000, nTimeParallel, 60, hashParallel));
+    BOOST_CHECK_EQUAL(nTimeSerial, nTimeParallel);
+    BOOST_CHECK(hashSerial == hashParallel);
+
+    threads.interrupt_all();
+    threads.join_all();
+    nStakeThreads = nStakeThreadsOld;
+}
+
+// The kernel hash and target computed from scratch, as every kernel check did before they were precomputed
+static uint256 KernelHashSerially(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const COutPoint& prevout, unsigned int nTimeTx)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << prevout.n << prevout.hash << nTimeTx;
+    return Hash(ss.begin(), ss.end());
+}
+
+static bool KernelTargetHitSerially(const uint256& hashProofOfStake, int64_t nValueIn, unsigned int nBits)
+{
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    return hashProofOfStake < (uint256(nValueIn) / 100) * bnTargetPerCoinDay;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_hash_precomputed)
+{
+    FakeChain chain(400);
+    const unsigned int nTimeTip = chain.vIndex.back().nTime;
+    const unsigned int vnBits[] = {0x1d008000, 0x1c100000, 0x1a010000};
+
+    int nHits = 0;
+    for (int i = 0; i < 200; i++) {
+        const CBlockIndex* pindexFrom = &chain.vIndex[GetRand(chain.vIndex.size() - 1)];
+        COutPoint prevout(GetRandHash(), GetRand(4));
+        int64_t nValue = (int64_t)(1 + GetRand(10000)) * COIN;
+        unsigned int nBits = vnBits[GetRand(3)];
+
+        CStakeKernel kernel;
+        BOOST_REQUIRE(kernel.Init(pindexFrom, prevout, nValue, nBits));
+        uint64_t nStakeModifier = 0;
+        int nStakeModifierHeight = 0;
+        int64_t nStakeModifierTime = 0;
+        BOOST_REQUIRE(GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime));
+        BOOST_CHECK_EQUAL(kernel.nStakeModifier, nStakeModifier);
+        BOOST_CHECK_EQUAL(kernel.nTimeBlockFrom, pindexFrom->nTime);
+
+        for (unsigned int nTimeTx = nTimeTip; nTimeTx < nTimeTip + 20; nTimeTx++) {
+            uint256 hashReference = KernelHashSerially(nStakeModifier, pindexFrom->nTime, prevout, nTimeTx);
+            bool fReference = KernelTargetHitSerially(hashReference, nValue, nBits);
+            BOOST_CHECK(kernel.GetHash(nTimeTx) == hashReference);
+            BOOST_CHECK_EQUAL(kernel.IsTargetHit(hashReference), fReference);
+            if (fReference)
+                nHits++;
+
+            if (pindexFrom->nTime + nStakeMinAge <= nTimeTx) {
+                uint256 hashProofOfStake;
+                BOOST_CHECK_EQUAL(CheckStakeKernelHash(nBits, pindexFrom, nValue, prevout, nTimeTx, hashProofOfStake), fReference);
+                BOOST_CHECK(hashProofOfStake == hashReference);
+            }
+        }
+    }
+    // The easiest target hits often enough that both outcomes were compared
+    BOOST_CHECK(nHits > 0);
+}
+
+struct KernelModifier {
+    bool fFound;
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+};
+
+// The kernel stake modifier of every block up to the tip
+static std::vector<KernelModifier> GetKernelModifiers(FakeChain& chain)
+{
+    std::vector<KernelModifier> vModifiers;
+    for (int i = 0; i <= chainActive.Height(); i++) {
+        KernelModifier modifier = {false, 0, 0, 0};
+        modifier.fFound = GetKernelStakeModifier(&chain.vIndex[i], modifier.nStakeModifier, modifier.nStakeModifierHeight, modifier.nStakeModifierTime);
+        vModifiers.push_back(modifier);
+    }
+    return vModifiers;
+}
+
+// With the index empty every lookup walks the chain
+static std::vector<KernelModifier> GetKernelModifiersSerially(FakeChain& chain, int nTip)
+{
+    chainActive.SetTip(NULL);
+    UpdateKernelModifierIndex();
+    chainActive.SetTip(&chain.vIndex[nTip]);
+    return GetKernelModifiers(chain);
+}
+
+static void CheckKernelModifiers(FakeChain& chain, int nTip)
+{
+    std::vector<KernelModifier> vIndexed = GetKernelModifiers(chain);
+    std::vector<KernelModifier> vReference = GetKernelModifiersSerially(chain, nTip);
+    BOOST_CHECK_EQUAL(vIndexed.size(), (size_t)nTip + 1);
+    BOOST_REQUIRE_EQUAL(vIndexed.size(), vReference.size());
+    for (size_t i = 0; i < vIndexed.size(); i++) {
+        BOOST_CHECK_EQUAL(vIndexed[i].fFound, vReference[i].fFound);
+        if (vIndexed[i].fFound && vReference[i].fFound) {
+            BOOST_CHECK_EQUAL(vIndexed[i].nStakeModifier, vReference[i].nStakeModifier);
+            BOOST_CHECK_EQUAL(vIndexed[i].nStakeModifierHeight, vReference[i].nStakeModifierHeight);
+            BOOST_CHECK_EQUAL(vIndexed[i].nStakeModifierTime, vReference[i].nStakeModifierTime);
+        }
+    }
+}
+
+// Moves the tip the way block connection and startup repairs do, keeping the index in sync,
+// and rebuilds the index after the check so the next move starts from a full one
+static void SetKernelModifierTip(FakeChain& chain, int nTip)
+{
+    chainActive.SetTip(&chain.vIndex[nTip]);
+    UpdateKernelModifierIndex();
+    CheckKernelModifiers(chain, nTip);
+    chainActive.SetTip(&chain.vIndex[nTip]);
+    UpdateKernelModifierIndex();
+}
+
+BOOST_AUTO_TEST_CASE(kernel_modifier_index_tip)
+{
+    FakeChain chain(400);
+
+    // Built up from nothing, rewound past resolved blocks, then extended again
+    SetKernelModifierTip(chain, 399);
+    SetKernelModifierTip(chain, 200);
+    SetKernelModifierTip(chain, 150);
+    SetKernelModifierTip(chain, 399);
+    for (int nTip = 390; nTip <= 399; nTip++)
+        SetKernelModifierTip(chain, nTip);
+
+    // Leave no blocks of the fake chain in the index
+    chainActive.SetTip(chain.pindexOld);
+    UpdateKernelModifierIndex();
+}
+
+BOOST_AUTO_TEST_CASE(check_proof_of_stake_from_coins)
+{
+    FakeChain chain(400);
+    LOCK(cs_main);
+
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    const unsigned int vnBits[] = {0x1d008000, 0x1c100000, 0x1a010000};
+
+    int nAccepted = 0;
+    for (int i = 0; i < 40; i++) {
+        // An output created in an old enough block, known only to the coins view
+        const int nHeightFrom = GetRand(300);
+        const CBlockIndex* pindexFrom = &chain.vIndex[nHeightFrom];
+        CMutableTransaction txPrev;
+        txPrev.vin.resize(1);
+        txPrev.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txPrev.vout.resize(1);
+        txPrev.vout[0].scriptPubKey = scriptPubKey;
+        txPrev.vout[0].nValue = (int64_t)(1 + GetRand(10000)) * COIN;
+        const uint256 hashPrev = CTransaction(txPrev).GetHash();
+        *pcoinsTip->ModifyCoins(hashPrev) = CCoins(txPrev, nHeightFrom);
+
+        CMutableTransaction txStake;
+        txStake.vin.resize(1);
+        txStake.vin[0].prevout = COutPoint(hashPrev, 0);
+        txStake.vout.resize(2);
+        txStake.vout[0].SetEmpty();
+        txStake.vout[1].scriptPubKey = scriptPubKey;
+        txStake.vout[1].nValue = txPrev.vout[0].nValue;
+        BOOST_REQUIRE(SignSignature(keystore, txPrev, txStake, 0));
+
+        CBlock block;
+        block.vtx.resize(2);
+        block.vtx[1] = txStake;
+        block.nBits = vnBits[GetRand(3)];
+
+        // Accepted exactly when the kernel computed from scratch hits the target
+        for (unsigned int nTime = chain.vIndex.back().nTime; nTime < chain.vIndex.back().nTime + 10; nTime++) {
+            block.nTime = nTime;
+            uint64_t nStakeModifier = 0;
+            int nStakeModifierHeight = 0;
+            int64_t nStakeModifierTime = 0;
+            bool fModifier = GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime);
+            uint256 hashReference = KernelHashSerially(nStakeModifier, pindexFrom->nTime, txStake.vin[0].prevout, nTime);
+            bool fReference = fModifier && KernelTargetHitSerially(hashReference, txPrev.vout[0].nValue, block.nBits);
+
+            uint256 hashProofOfStake;
+            BOOST_CHECK_EQUAL(CheckProofOfStake(block, hashProofOfStake), fReference);
+            if (fModifier)
+                BOOST_CHECK(hashProofOfStake == hashReference);
+            if (fReference)
+                nAccepted++;
+        }
+
+        // A kernel signed by another key, or no longer in the coins view, is refused
+        block.nTime = chain.vIndex.back().nTime;
+        CMutableTransaction txStakeBad(txStake);
+        txStakeBad.vin[0].scriptSig = CScript();
+        block.vtx[1] = txStakeBad;
+        uint256 hashProofOfStake;
+        BOOST_CHECK(!CheckProofOfStake(block, hashProofOfStake));
+        block.vtx[1] = txStake;
+        pcoinsTip->ModifyCoins(hashPrev)->Clear();
+        BOOST_CHECK(!CheckProofOfStake(block, hashProofOfStake));
+    }
+    BOOST_CHECK(nAccepted > 0);
+}
+
+BOOST_AUTO_TEST_CASE(check_proof_of_stake_boundaries)
+{
+    FakeChain chain(400);
+    LOCK(cs_main);
+
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // An output in an old block, and one in the tip block whose modifier is not known yet
+    const int vnHeightFrom[] = {300, 399};
+    for (unsigned int n = 0; n < sizeof(vnHeightFrom) / sizeof(vnHeightFrom[0]); n++) {
+        const CBlockIndex* pindexFrom = &chain.vIndex[vnHeightFrom[n]];
+        CMutableTransaction txPrev;
+        txPrev.vin.resize(1);
+        txPrev.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txPrev.vout.resize(1);
+        txPrev.vout[0].scriptPubKey = scriptPubKey;
+        txPrev.vout[0].nValue = 10000 * COIN;
+        const uint256 hashPrev = CTransaction(txPrev).GetHash();
+        *pcoinsTip->ModifyCoins(hashPrev) = CCoins(txPrev, vnHeightFrom[n]);
+
+        CMutableTransaction txStake;
+        txStake.vin.resize(1);
+        txStake.vin[0].prevout = COutPoint(hashPrev, 0);
+        txStake.vout.resize(2);
+        txStake.vout[0].SetEmpty();
+        txStake.vout[1].scriptPubKey = scriptPubKey;
+        txStake.vout[1].nValue = txPrev.vout[0].nValue;
+        BOOST_REQUIRE(SignSignature(keystore, txPrev, txStake, 0));
+
+        CBlock block;
+        block.vtx.resize(2);
+        block.vtx[1] = txStake;
+        block.nBits = 0x1d008000;
+        uint256 hashProofOfStake;
+
+        // Before the output's block, and one second short of the minimum age
+        block.nTime = pindexFrom->nTime - 1;
+        BOOST_CHECK(!CheckProofOfStake(block, hashProofOfStake));
+        block.nTime = pindexFrom->nTime;
+        BOOST_CHECK(!CheckProofOfStake(block, hashProofOfStake));
+        block.nTime = pindexFrom->nTime + nStakeMinAge - 1;
+        BOOST_CHECK(!CheckProofOfStake(block, hashProofOfStake));
+
+        // At the minimum age the kernel decides, unless no block far enough ahead gives its modifier
+        block.nTime = pindexFrom->nTime + nStakeMinAge;
+        uint64_t nStakeModifier = 0;
+        int nStakeModifierHeight = 0;
+        int64_t nStakeModifierTime = 0;
+        bool fModifier = GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime);
+        if (vnHeightFrom[n] == chainActive.Height())
+            BOOST_CHECK(!fModifier);
+        uint256 hashReference = KernelHashSerially(nStakeModifier, pindexFrom->nTime, txStake.vin[0].prevout, block.nTime);
+        BOOST_CHECK_EQUAL(CheckProofOfStake(block, hashProofOfStake), fModifier && KernelTargetHitSerially(hashReference, txPrev.vout[0].nValue, block.nBits));
+
+        pcoinsTip->ModifyCoins(hashPrev)->Clear();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,11 @@
 
 #include "primitives/transaction.h"
 #include "main.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "random.h"
+#include "txdb.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -48,4 +53,101 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 4109975100000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(raw_block_read_test)
+{
+    // Two blocks back to back in a blk file nothing else uses
+    CBlock block = Params().GenesisBlock();
+    CDiskBlockPos pos1(9999, 0);
+    BOOST_CHECK(WriteBlockToDisk(block, pos1));
+    CDiskBlockPos pos2(9999, pos1.nPos + ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(WriteBlockToDisk(block, pos2));
+
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << block;
+
+    // The raw bytes are appended to whatever the stream already holds
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << std::string("prefix");
+    size_t nPrefix = ss.size();
+    BOOST_CHECK(ReadRawBlockFromDisk(ss, pos2));
+    BOOST_CHECK_EQUAL(ss.size(), nPrefix + ssExpected.size());
+    BOOST_CHECK(std::equal(ssExpected.begin(), ssExpected.end(), ss.begin() + nPrefix));
+
+    CBlock blockRead;
+    ss.ignore(nPrefix);
+    ss >> blockRead;
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    // A position that isn't the start of a block is refused and leaves the stream alone
+    CDataStream ssBad(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(!ReadRawBlockFromDisk(ssBad, CDiskBlockPos(9999, pos1.nPos + 1)));
+    BOOST_CHECK(!ReadRawBlockFromDisk(ssBad, CDiskBlockPos(9999, 0)));
+    BOOST_CHECK(ssBad.empty());
+}
+
+BOOST_AUTO_TEST_CASE(block_index_load_test)
+{
+    // A chain of several loader batches, past the proof of work blocks so that
+    // the made up headers pass, written in one database and loaded back
+    CBlockTreeDB blocktree(1 << 20, true);
+    std::vector<CDiskBlockIndex> vDiskIndex(2500);
+    std::vector<uint256> vHashes(vDiskIndex.size());
+    for (size_t i = 0; i < vDiskIndex.size(); i++) {
+        CDiskBlockIndex& diskindex = vDiskIndex[i];
+        diskindex.hashPrev = (i == 0) ? uint256() : vHashes[i - 1];
+        diskindex.nHeight = Params().LAST_POW_BLOCK() + 1 + i;
+        diskindex.nVersion = 3;
+        diskindex.hashMerkleRoot = GetRandHash();
+        diskindex.nTime = 1500000000 + i * 60;
+        diskindex.nBits = 0x1e0fffff;
+        diskindex.nNonce = GetRand(1 << 30);
+        diskindex.nStatus = BLOCK_HAVE_DATA | BLOCK_VALID_SCRIPTS;
+        diskindex.nFile = i / 1000;
+        diskindex.nDataPos = 8 + 1000 * (i % 1000);
+        diskindex.nTx = 1 + GetRand(100);
+        diskindex.nMoneySupply = i * COIN;
+        diskindex.nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        if (i % 2) {
+            diskindex.SetProofOfStake();
+            diskindex.prevoutStake = COutPoint(GetRandHash(), 1);
+            diskindex.nStakeTime = diskindex.nTime;
+        }
+        vHashes[i] = diskindex.GetBlockHash();
+        BOOST_CHECK(blocktree.WriteBlockIndex(diskindex));
+    }
+
+    // Loaded into empty globals, which are put back afterwards
+    BlockMap mapBlockIndexOld;
+    std::set<std::pair<COutPoint, unsigned int> > setStakeSeenOld;
+    mapBlockIndex.swap(mapBlockIndexOld);
+    setStakeSeen.swap(setStakeSeenOld);
+
+    BOOST_CHECK(blocktree.LoadBlockIndexGuts());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), vDiskIndex.size());
+    for (size_t i = 0; i < vDiskIndex.size(); i++) {
+        const CDiskBlockIndex& diskindex = vDiskIndex[i];
+        BlockMap::const_iterator mi = mapBlockIndex.find(vHashes[i]);
+        BOOST_REQUIRE(mi != mapBlockIndex.end());
+        const CBlockIndex* pindex = mi->second;
+        BOOST_CHECK(pindex->pprev == (i == 0 ? NULL : mapBlockIndex[vHashes[i - 1]]));
+        BOOST_CHECK_EQUAL(pindex->nHeight, diskindex.nHeight);
+        BOOST_CHECK_EQUAL(pindex->nFile, diskindex.nFile);
+        BOOST_CHECK_EQUAL(pindex->nDataPos, diskindex.nDataPos);
+        BOOST_CHECK_EQUAL(pindex->nStatus, diskindex.nStatus);
+        BOOST_CHECK_EQUAL(pindex->nTx, diskindex.nTx);
+        BOOST_CHECK(pindex->hashMerkleRoot == diskindex.hashMerkleRoot);
+        BOOST_CHECK_EQUAL(pindex->nNonce, diskindex.nNonce);
+        BOOST_CHECK_EQUAL(pindex->nMoneySupply, diskindex.nMoneySupply);
+        BOOST_CHECK_EQUAL(pindex->nStakeModifier, diskindex.nStakeModifier);
+        BOOST_CHECK_EQUAL(pindex->IsProofOfStake(), diskindex.IsProofOfStake());
+        BOOST_CHECK(pindex->prevoutStake == diskindex.prevoutStake);
+    }
+    BOOST_CHECK_EQUAL(setStakeSeen.size(), vDiskIndex.size() / 2);
+
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        delete mi->second;
+    mapBlockIndex.swap(mapBlockIndexOld);
+    setStakeSeen.swap(setStakeSeenOld);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,9 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
@@ -99,4 +101,258 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexTest)
+{
+    // A zero fee parent with one child paying a high fee: the child's package
+    // (parent and child together) has to sort ahead of the parent alone.
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 11000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 1000, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 22000, 0, 0.0, 1));
+
+    const CTxMemPoolEntry& parent = testPool.mapTx[txParent.GetHash()];
+    const CTxMemPoolEntry& child = testPool.mapTx[txChild.GetHash()];
+    BOOST_CHECK_EQUAL(parent.GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(child.GetSizeWithAncestors(), parent.GetTxSize() + child.GetTxSize());
+    BOOST_CHECK_EQUAL(child.GetModFeesWithAncestors(), 22000);
+    BOOST_CHECK_EQUAL(testPool.setAncestorFee.size(), 3);
+
+    CTxMemPool::indexed_ancestor_fee::const_iterator it = testPool.setAncestorFee.begin();
+    BOOST_CHECK((*it)->GetTx().GetHash() == txChild.GetHash());
+    BOOST_CHECK((*++it)->GetTx().GetHash() == txOther.GetHash());
+    BOOST_CHECK((*++it)->GetTx().GetHash() == txParent.GetHash());
+
+    // Prioritising the parent carries over to the package of the child
+    testPool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0.0, 5000);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetModFeesWithAncestors(), 27000);
+    testPool.ClearPrioritisation(txParent.GetHash());
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetModFeesWithAncestors(), 22000);
+
+    // The parent being mined leaves the child on its own
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetModFeesWithAncestors(), 22000);
+    BOOST_CHECK_EQUAL(testPool.setAncestorFee.size(), 2);
+    BOOST_CHECK(testPool.mapLinks[txChild.GetHash()].parents.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // Three unrelated transactions paying increasing fees
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11 << CScriptNum(i);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 10000 * (i + 1), 100 * (i + 1), 0.0, 1));
+    }
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() == 0);
+
+    // Trimming to just below the current usage evicts the cheapest one and raises the floor
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() > 1000);
+
+    // Expiry removes what entered the pool before the given time
+    BOOST_CHECK_EQUAL(pool.Expire(300), 1);
+    BOOST_CHECK(pool.exists(tx[2].GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of four transactions, each spending the one before
+    std::vector<CMutableTransaction> vChain(5);
+    for (int i = 0; i < 5; i++)
+    {
+        vChain[i].vin.resize(1);
+        vChain[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0)
+            vChain[i].vin[0].prevout = COutPoint(vChain[i - 1].GetHash(), 0);
+        vChain[i].vout.resize(1);
+        vChain[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vChain[i].vout[0].nValue = 10 * COIN - i * 1000;
+    }
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(vChain[i].GetHash(), CTxMemPoolEntry(vChain[i], 1000, 0, 0.0, 1));
+
+    LOCK(pool.cs);
+    const CTransaction txTail(vChain[4]);
+    uint64_t nTxSize = ::GetSerializeSize(txTail, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nChainSize = 0;
+    for (int i = 0; i < 4; i++)
+        nChainSize += pool.mapTx[vChain[i].GetHash()].GetTxSize();
+
+    // Within the limits every ancestor is found, as by the in-pool search
+    std::set<uint256> setAncestors, setAncestorsInPool;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(txTail, nTxSize, setAncestors, 5, nChainSize + nTxSize, 5, nChainSize + nTxSize, errString));
+    pool.CalculateMemPoolAncestors(vChain[3].GetHash(), setAncestorsInPool);
+    setAncestorsInPool.insert(vChain[3].GetHash());
+    BOOST_CHECK(setAncestors == setAncestorsInPool);
+
+    // One below any of the limits refuses it
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txTail, nTxSize, setAncestors, 4, nChainSize + nTxSize, 5, nChainSize + nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txTail, nTxSize, setAncestors, 5, nChainSize + nTxSize - 1, 5, nChainSize + nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txTail, nTxSize, setAncestors, 5, nChainSize + nTxSize, 4, nChainSize + nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txTail, nTxSize, setAncestors, 5, nChainSize + nTxSize, 5, nChainSize + nTxSize - 1, errString));
+
+    // A transaction without in-pool parents has nothing to break
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(CTransaction(vChain[0]), nTxSize, setAncestors, 1, nTxSize, 1, nTxSize, errString));
+    BOOST_CHECK(setAncestors.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolFreeCandidatesTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Entries that are free from the start, after some blocks, or never
+    for (int i = 0; i < 200; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_11 << CScriptNum(i);
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = (i % 7 == 0) ? 0 : GetRand(100 * COIN);
+        double dPriority = (double)GetRand(2 * AllowFreeThreshold());
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, GetRand(10000), 0, dPriority, 1 + GetRand(100)));
+        if (i % 10 == 0)
+            pool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), (i % 20 == 0) ? 1e9 : -1e9, 0);
+    }
+
+    // The index gives exactly the entries a scan of the whole pool allows free
+    LOCK(pool.cs);
+    for (unsigned int nHeight = 101; nHeight < 600; nHeight += 7)
+    {
+        std::vector<const CTxMemPoolEntry*> vFree;
+        pool.GetFreeCandidates(nHeight, vFree);
+        std::set<const CTxMemPoolEntry*> setFree(vFree.begin(), vFree.end());
+        BOOST_CHECK_EQUAL(setFree.size(), vFree.size());
+
+        std::set<const CTxMemPoolEntry*> setScan;
+        for (CTxMemPool::TxMap::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+        {
+            double dPriority = it->second.GetPriority(nHeight);
+            CAmount nDummy = 0;
+            pool.ApplyDeltas(it->first, dPriority, nDummy);
+            if (AllowFree(dPriority))
+                setScan.insert(&it->second);
+        }
+        BOOST_CHECK(setFree == setScan);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPersistTest)
+{
+    // Spends of a P2SH OP_TRUE output are standard and need no signature
+    CScript scriptRedeem = CScript() << OP_TRUE;
+    CScript scriptPubKey = GetScriptForDestination(CScriptID(scriptRedeem));
+    CScript scriptSig = CScript() << std::vector<unsigned char>(scriptRedeem.begin(), scriptRedeem.end());
+
+    // A parent spending a coin of the chain state and a child spending the parent
+    uint256 hashCoin = GetRandHash();
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(hashCoin, 0);
+    txParent.vin[0].scriptSig = scriptSig;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = scriptPubKey;
+    txParent.vout[0].nValue = 10 * COIN - COIN / 100;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[0].scriptSig = scriptSig;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = scriptPubKey;
+    txChild.vout[0].nValue = 10 * COIN - 2 * COIN / 100;
+
+    {
+        LOCK(cs_main);
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(hashCoin);
+        coins->nVersion = 1;
+        coins->nHeight = 0;
+        coins->vout.resize(1);
+        coins->vout[0] = CTxOut(10 * COIN, scriptPubKey);
+    }
+
+    // Nothing is written before mempool.dat was loaded, which finds no file here
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    BOOST_CHECK(!DumpMempool());
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK(!boost::filesystem::exists(pathMempool));
+
+    // The child only finds its input when reloaded after its parent
+    int64_t nTime = GetTime();
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, COIN / 100, nTime, 0.0, 1));
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, COIN / 100, nTime, 0.0, 1));
+    mempool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 1.5, 1000);
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(boost::filesystem::exists(pathMempool));
+
+    mempool.clear();
+    mempool.ClearPrioritisation(txChild.GetHash());
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(txChild.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(dPriorityDelta, 1.5);
+    BOOST_CHECK_EQUAL(nFeeDelta, 1000);
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapTx[txChild.GetHash()].GetTime(), nTime);
+    }
+
+    mempool.clear();
+    mempool.ClearPrioritisation(txChild.GetHash());
+    boost::filesystem::remove(pathMempool);
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(hashCoin)->Clear();
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,192 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "msgdispatcher.h"
+
+#include "main.h"
+#include "net.h"
+#include "random.h"
+#include "spork.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(msgdispatcher_tests)
+
+static void WaitForProcessed(CMessageDispatcher& dispatcher, const std::string& strCommand, int64_t nCount)
+{
+    std::map<std::string, CMessageQueueStats> mapStats;
+    std::vector<std::pair<int64_t, bool> > vSubsystems;
+    for (int i = 0; i < 1000; i++) {
+        dispatcher.GetStats(mapStats, vSubsystems);
+        if (mapStats[strCommand].nProcessed == nCount)
+            break;
+        MilliSleep(10);
+    }
+    BOOST_CHECK_EQUAL(mapStats[strCommand].nProcessed, nCount);
+}
+
+static void WaitForRelease(CNode& node)
+{
+    for (int i = 0; i < 1000 && node.GetRefCount() > 0; i++)
+        MilliSleep(10);
+    BOOST_CHECK_EQUAL(node.GetRefCount(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(msgdispatcher_inline)
+{
+    // Without the worker every command is processed by ProcessMessage itself
+    CMessageDispatcher dispatcher;
+    CNode dummyNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)), "", true);
+    CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+
+    BOOST_CHECK(!dispatcher.IsRouted("mnb"));
+    BOOST_CHECK(!dispatcher.Enqueue(&dummyNode, "mnb", vRecv));
+    BOOST_CHECK(!dispatcher.IsPeerQueueFull(dummyNode.GetId()));
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(msgdispatcher_workers)
+{
+    // Keep the handlers from doing anything with the dummy messages
+    bool fLiteModeOld = fLiteMode;
+    fLiteMode = true;
+
+    CMessageDispatcher dispatcher;
+    boost::thread_group threadGroup;
+    dispatcher.Start(threadGroup);
+    BOOST_CHECK(dispatcher.IsRunning());
+
+    BOOST_CHECK(dispatcher.IsRouted("mnb"));
+    BOOST_CHECK(dispatcher.IsRouted("mnw"));
+    BOOST_CHECK(dispatcher.IsRouted("mvote"));
+    BOOST_CHECK(dispatcher.IsRouted("spork"));
+    BOOST_CHECK(!dispatcher.IsRouted("ix"));
+    BOOST_CHECK(!dispatcher.IsRouted("txlvote"));
+    BOOST_CHECK(!dispatcher.IsRouted("block"));
+    BOOST_CHECK(!dispatcher.IsRouted("tx"));
+    BOOST_CHECK(!dispatcher.IsRouted("inv"));
+
+    CNode dummyNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)), "", true);
+    CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK(dispatcher.Enqueue(&dummyNode, "mnb", vRecv));
+        BOOST_CHECK(dispatcher.Enqueue(&dummyNode, "spork", vRecv));
+    }
+
+    std::map<std::string, CMessageQueueStats> mapStats;
+    std::vector<std::pair<int64_t, bool> > vSubsystems;
+    for (int i = 0; i < 1000; i++) {
+        dispatcher.GetStats(mapStats, vSubsystems);
+        if (mapStats["mnb"].nProcessed == 100 && mapStats["spork"].nProcessed == 100)
+            break;
+        MilliSleep(10);
+    }
+    BOOST_CHECK_EQUAL(mapStats["mnb"].nProcessed, 100);
+    BOOST_CHECK_EQUAL(mapStats["mnb"].nQueued, 0);
+    BOOST_CHECK_EQUAL(mapStats["spork"].nProcessed, 100);
+    BOOST_CHECK_EQUAL(mapStats["spork"].nQueued, 0);
+    BOOST_CHECK(mapStats["mnb"].nMaxQueued > 0);
+    BOOST_CHECK_EQUAL(vSubsystems.size(), (size_t)MSG_SUBSYSTEM_MAX);
+    BOOST_CHECK(!dispatcher.IsPeerQueueFull(dummyNode.GetId()));
+
+    // The worker hands the node back once it is done with it
+    WaitForRelease(dummyNode);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    fLiteMode = fLiteModeOld;
+}
+
+BOOST_AUTO_TEST_CASE(msgdispatcher_excludes_message_handler)
+{
+    // No handler runs while the message handler thread holds cs_messageWorker
+    bool fLiteModeOld = fLiteMode;
+    fLiteMode = true;
+
+    CMessageDispatcher dispatcher;
+    boost::thread_group threadGroup;
+    dispatcher.Start(threadGroup);
+
+    CNode dummyNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)), "", true);
+    CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+    {
+        LOCK(cs_messageWorker);
+        for (int i = 0; i < 10; i++)
+            BOOST_CHECK(dispatcher.Enqueue(&dummyNode, "mnb", vRecv));
+        MilliSleep(100);
+
+        std::map<std::string, CMessageQueueStats> mapStats;
+        std::vector<std::pair<int64_t, bool> > vSubsystems;
+        dispatcher.GetStats(mapStats, vSubsystems);
+        BOOST_CHECK_EQUAL(mapStats["mnb"].nProcessed, 0);
+        BOOST_CHECK_EQUAL(mapStats["mnb"].nQueued, 10);
+    }
+    WaitForProcessed(dispatcher, "mnb", 10);
+    WaitForRelease(dummyNode);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    fLiteMode = fLiteModeOld;
+}
+
+BOOST_AUTO_TEST_CASE(msgdispatcher_getdata_concurrent)
+{
+    // The worker checks and serves sporks while this thread answers getdata
+    // for them through ProcessMessages, as ThreadMessageHandler does
+    CMessageDispatcher dispatcher;
+    boost::thread_group threadGroup;
+    dispatcher.Start(threadGroup);
+
+    CNode peerNode(INVALID_SOCKET, CAddress(CService("127.0.0.2", 0)), "", true);
+    CNode dummyNode(INVALID_SOCKET, CAddress(CService("127.0.0.3", 0)), "", true);
+    dummyNode.nVersion = PROTOCOL_VERSION;
+
+    // Not signed with the spork key, so the handler rejects it after checking the signature
+    CSporkMessage spork;
+    spork.nSporkID = SPORK_2_SWIFTTX;
+    spork.nValue = 0;
+    spork.nTimeSigned = GetTime();
+    spork.vchSig.assign(65, 0x1f);
+
+    CSporkMessage sporkKnown = spork;
+    sporkKnown.nSporkID = SPORK_5_MAX_VALUE;
+    {
+        LOCK(cs_mapSporks);
+        mapSporks[sporkKnown.GetHash()] = sporkKnown;
+    }
+
+    for (int i = 0; i < 200; i++) {
+        CDataStream vSpork(SER_NETWORK, PROTOCOL_VERSION);
+        vSpork << spork;
+        BOOST_CHECK(dispatcher.Enqueue(&peerNode, "spork", vSpork));
+        BOOST_CHECK(dispatcher.Enqueue(&peerNode, "getsporks", CDataStream(SER_NETWORK, PROTOCOL_VERSION)));
+    }
+
+    for (int i = 0; i < 200; i++) {
+        LOCK(dummyNode.cs_vRecvMsg);
+        dummyNode.vRecvGetData.push_back(CInv(MSG_SPORK, sporkKnown.GetHash()));
+        dummyNode.vRecvGetData.push_back(CInv(MSG_SERVICENODE_PING, GetRandHash()));
+        dummyNode.vRecvGetData.push_back(CInv(MSG_BUDGET_VOTE, GetRandHash()));
+        BOOST_CHECK(ProcessMessages(&dummyNode));
+        BOOST_CHECK(dummyNode.vRecvGetData.empty());
+        BOOST_CHECK_EQUAL(GetSporkValue(SPORK_2_SWIFTTX), SPORK_2_SWIFTTX_DEFAULT);
+    }
+
+    WaitForProcessed(dispatcher, "spork", 200);
+    WaitForProcessed(dispatcher, "getsporks", 200);
+    WaitForRelease(peerNode);
+    {
+        LOCK(cs_mapSporks);
+        BOOST_CHECK(!mapSporks.count(spork.GetHash()));
+        mapSporks.erase(sporkKnown.GetHash());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
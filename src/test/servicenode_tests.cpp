@@ -0,0 +1,363 @@
+// Copyright (c) 2018 The XCurrency developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "servicenode.h"
+
+#include "clientversion.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "servicenode-payments.h"
+#include "servicenodeman.h"
+#include "streams.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(servicenode_tests)
+
+// A chain of nBlocks random block hashes
+struct RandomChain {
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+
+    RandomChain(int nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++) {
+            vHashes[i] = GetRandHash();
+            vIndex[i].nHeight = i;
+            vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+            vIndex[i].phashBlock = &vHashes[i];
+        }
+    }
+};
+BOOST_AUTO_TEST_CASE(servicenode_getblockhash)
+{
+    RandomChain chain(20);
+    const std::vector<uint256>& vHashes = chain.vHashes;
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&vIndex.back());
+
+    // The hash of the block before the given height; 0 stands for the tip
+    // height, so it gives the block before the tip
+    uint256 hash;
+    BOOST_CHECK(GetBlockHash(hash, 0));
+    BOOST_CHECK(hash == vHashes[18]);
+    BOOST_CHECK(GetBlockHash(hash, 19));
+    BOOST_CHECK(hash == vHashes[18]);
+    BOOST_CHECK(GetBlockHash(hash, 20));
+    BOOST_CHECK(hash == vHashes[19]);
+    BOOST_CHECK(GetBlockHash(hash, 2));
+    BOOST_CHECK(hash == vHashes[1]);
+
+    // Past the next block, before the chain and at genesis there is nothing to return
+    BOOST_CHECK(!GetBlockHash(hash, 21));
+    BOOST_CHECK(!GetBlockHash(hash, 1));
+    BOOST_CHECK(!GetBlockHash(hash, -1));
+
+    // Only genesis precedes the tip
+    chainActive.SetTip(&vIndex[1]);
+    BOOST_CHECK(!GetBlockHash(hash, 0));
+    BOOST_CHECK(GetBlockHash(hash, 2));
+    BOOST_CHECK(hash == vHashes[1]);
+
+    chainActive.SetTip(pindexOld);
+}
+
+static CServicenode MakeServicenode(const CPubKey& pubKeyCollateral, const CPubKey& pubKeyServicenode)
+{
+    CServicenode mn;
+    mn.vin = CTxIn(COutPoint(GetRandHash(), 0));
+    mn.pubKeyCollateralAddress = pubKeyCollateral;
+    mn.pubKeyServicenode = pubKeyServicenode;
+    return mn;
+}
+
+BOOST_AUTO_TEST_CASE(servicenode_duplicate_keys)
+{
+    CKey key1, key2, key3;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(true);
+    key3.MakeNewKey(true);
+    const CScript payee1 = GetScriptForDestination(key1.GetPubKey().GetID());
+
+    // Three entries sharing a collateral key and a servicenode key: the first one is found,
+    // whether the indexes were built entry by entry or all at once
+    CServicenodeMan man;
+    std::vector<CServicenode> vNodes;
+    for (int i = 0; i < 3; i++) {
+        vNodes.push_back(MakeServicenode(key1.GetPubKey(), key2.GetPubKey()));
+        BOOST_CHECK(man.Add(vNodes.back()));
+    }
+    BOOST_CHECK(man.Find(key2.GetPubKey())->vin == vNodes[0].vin);
+    BOOST_CHECK(man.Find(payee1)->vin == vNodes[0].vin);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << man;
+    CServicenodeMan manRead;
+    ss >> manRead;
+    BOOST_CHECK(manRead.Find(key2.GetPubKey())->vin == vNodes[0].vin);
+    BOOST_CHECK(manRead.Find(payee1)->vin == vNodes[0].vin);
+
+    // Once the first one moves to another key the next one takes its keys
+    CServicenode* pmn = man.Find(vNodes[0].vin);
+    pmn->pubKeyServicenode = key3.GetPubKey();
+    man.UpdateServicenodeIndex(vNodes[0].vin);
+    BOOST_CHECK(man.Find(key3.GetPubKey())->vin == vNodes[0].vin);
+    BOOST_CHECK(man.Find(key2.GetPubKey())->vin == vNodes[1].vin);
+
+    // ... and gets it back when it returns to the shared key
+    pmn = man.Find(vNodes[0].vin);
+    pmn->pubKeyServicenode = key2.GetPubKey();
+    man.UpdateServicenodeIndex(vNodes[0].vin);
+    BOOST_CHECK(man.Find(key2.GetPubKey())->vin == vNodes[0].vin);
+    BOOST_CHECK(man.Find(key3.GetPubKey()) == NULL);
+
+    // Removing it leaves the next one in line
+    man.Remove(vNodes[0].vin);
+    BOOST_CHECK(man.Find(key2.GetPubKey())->vin == vNodes[1].vin);
+    BOOST_CHECK(man.Find(payee1)->vin == vNodes[1].vin);
+}
+
+struct CompareScoreDesc {
+    bool operator()(const std::pair<int64_t, CTxIn>& a, const std::pair<int64_t, CTxIn>& b) const
+    {
+        return a.first > b.first;
+    }
+};
+
+// The ranking as scanning and sorting the whole list gives it, best first
+static std::vector<CTxIn> RankSerially(std::vector<CServicenode>& vNodes, int64_t nBlockHeight)
+{
+    std::vector<std::pair<int64_t, CTxIn> > vecScores;
+    for (size_t i = 0; i < vNodes.size(); i++)
+        vecScores.push_back(std::make_pair(vNodes[i].CalculateScore(1, nBlockHeight).GetCompact(false), vNodes[i].vin));
+    std::stable_sort(vecScores.begin(), vecScores.end(), CompareScoreDesc());
+    std::vector<CTxIn> vRank;
+    for (size_t i = 0; i < vecScores.size(); i++)
+        vRank.push_back(vecScores[i].second);
+    return vRank;
+}
+
+static void CheckRanks(CServicenodeMan& man, std::vector<CServicenode>& vNodes, int64_t nBlockHeight)
+{
+    std::vector<CTxIn> vRank = RankSerially(vNodes, nBlockHeight);
+    for (size_t i = 0; i < vRank.size(); i++) {
+        BOOST_CHECK_EQUAL(man.GetServicenodeRank(vRank[i], nBlockHeight, 0, false), (int)i + 1);
+        CServicenode* pmn = man.GetServicenodeByRank(i + 1, nBlockHeight, 0, false);
+        BOOST_CHECK(pmn != NULL && pmn->vin == vRank[i]);
+    }
+    BOOST_CHECK(man.GetServicenodeByRank(vRank.size() + 1, nBlockHeight, 0, false) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(servicenode_rank_cache)
+{
+    RandomChain chainA(20), chainB(20);
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&chainA.vIndex.back());
+
+    CServicenodeMan man;
+    std::vector<CServicenode> vNodes;
+    for (int i = 0; i < 10; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vNodes.push_back(MakeServicenode(key.GetPubKey(), key.GetPubKey()));
+        BOOST_CHECK(man.Add(vNodes.back()));
+    }
+
+    // Cached answers match a full scan, asked twice so the second comes from the cache
+    for (int n = 0; n < 2; n++) {
+        for (int64_t nHeight = 2; nHeight <= 20; nHeight += 3)
+            CheckRanks(man, vNodes, nHeight);
+    }
+
+    // A new tip at the same heights gives new scores
+    chainActive.SetTip(&chainB.vIndex.back());
+    for (int64_t nHeight = 2; nHeight <= 20; nHeight += 3)
+        CheckRanks(man, vNodes, nHeight);
+
+    // So do changes to the list
+    CKey key;
+    key.MakeNewKey(true);
+    vNodes.push_back(MakeServicenode(key.GetPubKey(), key.GetPubKey()));
+    BOOST_CHECK(man.Add(vNodes.back()));
+    for (int64_t nHeight = 2; nHeight <= 20; nHeight += 3)
+        CheckRanks(man, vNodes, nHeight);
+    man.Remove(vNodes[3].vin);
+    vNodes.erase(vNodes.begin() + 3);
+    for (int64_t nHeight = 2; nHeight <= 20; nHeight += 3)
+        CheckRanks(man, vNodes, nHeight);
+
+    // Unknown heights have no ranking
+    BOOST_CHECK_EQUAL(man.GetServicenodeRank(vNodes[0].vin, 22, 0, false), -1);
+
+    chainActive.SetTip(pindexOld);
+}
+
+BOOST_AUTO_TEST_CASE(servicenode_rank_edges)
+{
+    RandomChain chain(20);
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&chain.vIndex.back());
+
+    // An empty list ranks nothing
+    CServicenodeMan manEmpty;
+    BOOST_CHECK_EQUAL(manEmpty.GetServicenodeRank(CTxIn(COutPoint(GetRandHash(), 0)), 10, 0, false), -1);
+    BOOST_CHECK(manEmpty.GetServicenodeByRank(1, 10, 0, false) == NULL);
+
+    // Two collaterals whose scores compact to the same value
+    CKey key;
+    key.MakeNewKey(true);
+    std::map<int64_t, CTxIn> mapScores;
+    CTxIn vinTie1, vinTie2;
+    while (vinTie2 == CTxIn()) {
+        CServicenode mn = MakeServicenode(key.GetPubKey(), key.GetPubKey());
+        int64_t nScore = mn.CalculateScore(1, 10).GetCompact(false);
+        if (mapScores.count(nScore)) {
+            vinTie1 = mapScores[nScore];
+            vinTie2 = mn.vin;
+        }
+        mapScores[nScore] = mn.vin;
+    }
+
+    // Whichever was added first ranks first, as in a scan of the list
+    for (int nOrder = 0; nOrder < 2; nOrder++) {
+        CServicenodeMan man;
+        std::vector<CServicenode> vNodes;
+        for (int i = 0; i < 6; i++) {
+            CKey keyNode;
+            keyNode.MakeNewKey(true);
+            vNodes.push_back(MakeServicenode(keyNode.GetPubKey(), keyNode.GetPubKey()));
+            if (i == 2)
+                vNodes.back().vin = nOrder == 0 ? vinTie1 : vinTie2;
+            if (i == 4)
+                vNodes.back().vin = nOrder == 0 ? vinTie2 : vinTie1;
+            BOOST_CHECK(man.Add(vNodes.back()));
+        }
+        int nRankFirst = man.GetServicenodeRank(vNodes[2].vin, 10, 0, false);
+        BOOST_CHECK_EQUAL(man.GetServicenodeRank(vNodes[4].vin, 10, 0, false), nRankFirst + 1);
+        CheckRanks(man, vNodes, 10);
+
+        // The next block is known, the one after it and genesis are not
+        CheckRanks(man, vNodes, 20);
+        BOOST_CHECK_EQUAL(man.GetServicenodeRank(vNodes[0].vin, 21, 0, false), -1);
+        BOOST_CHECK_EQUAL(man.GetServicenodeRank(vNodes[0].vin, 1, 0, false), -1);
+        BOOST_CHECK(man.GetServicenodeByRank(0, 10, 0, false) == NULL);
+        BOOST_CHECK(man.GetServicenodeByRank(1, 21, 0, false) == NULL);
+    }
+
+    chainActive.SetTip(pindexOld);
+}
+
+// The newest height in [nMinHeight, nMaxHeight] with two votes for payee, walking the blocks down as GetLastPaid did
+static int LastPaidSerially(CServicenodePayments& payments, const CScript& payee, int nMinHeight, int nMaxHeight)
+{
+    for (int nHeight = nMaxHeight; nHeight >= nMinHeight; nHeight--) {
+        if (payments.mapServicenodeBlocks.count(nHeight) && payments.mapServicenodeBlocks[nHeight].HasPayeeWithVotes(payee, 2))
+            return nHeight;
+    }
+    return 0;
+}
+
+static void CheckLastPaid(CServicenodePayments& payments, const std::vector<CScript>& vPayees, int nTipHeight)
+{
+    for (int n = 0; n < 200; n++) {
+        const CScript& payee = vPayees[GetRand(vPayees.size())];
+        int nMaxHeight = 1 + GetRand(nTipHeight + 10);
+        int nMinHeight = std::max(1, nMaxHeight - (int)GetRand(60));
+        BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, nMinHeight, nMaxHeight), LastPaidSerially(payments, payee, nMinHeight, nMaxHeight));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(servicenode_last_paid_index)
+{
+    RandomChain chain(1300);
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&chain.vIndex.back());
+
+    std::vector<CScript> vPayees;
+    for (int i = 0; i < 5; i++)
+        vPayees.push_back(CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY << OP_CHECKSIG);
+
+    // Up to four votes per block, often for the same payee
+    CServicenodePayments payments;
+    for (int nHeight = 102; nHeight <= 1300; nHeight++) {
+        int nVotes = GetRand(5);
+        for (int i = 0; i < nVotes; i++) {
+            CServicenodePaymentWinner winner(CTxIn(COutPoint(GetRandHash(), 0)));
+            winner.nBlockHeight = nHeight;
+            winner.AddPayee(vPayees[GetRand(2) ? 0 : GetRand(vPayees.size())]);
+            BOOST_CHECK(payments.AddWinningServicenode(winner));
+        }
+    }
+    CheckLastPaid(payments, vPayees, 1299);
+
+    // Rebuilt when read back
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << payments;
+    CServicenodePayments paymentsRead;
+    ss >> paymentsRead;
+    CheckLastPaid(paymentsRead, vPayees, 1299);
+
+    // Pruned with the old blocks
+    payments.CleanPaymentList();
+    BOOST_CHECK(payments.mapServicenodeBlocks.begin()->first >= 299);
+    CheckLastPaid(payments, vPayees, 1299);
+
+    chainActive.SetTip(pindexOld);
+}
+
+
+BOOST_AUTO_TEST_CASE(servicenode_last_paid_edges)
+{
+    RandomChain chain(600);
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&chain.vIndex.back());
+
+    const CScript payee = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY << OP_CHECKSIG;
+    const CScript payeeOther = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CServicenodePayments payments;
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 1, 600), 0);
+
+    // A single vote is not a payment, the second one is
+    CServicenodePaymentWinner winner(CTxIn(COutPoint(GetRandHash(), 0)));
+    winner.nBlockHeight = 300;
+    winner.AddPayee(payee);
+    BOOST_CHECK(payments.AddWinningServicenode(winner));
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 1, 600), 0);
+    CServicenodePaymentWinner winner2(CTxIn(COutPoint(GetRandHash(), 0)));
+    winner2.nBlockHeight = 300;
+    winner2.AddPayee(payee);
+    BOOST_CHECK(payments.AddWinningServicenode(winner2));
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 1, 600), 300);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeOther, 1, 600), 0);
+
+    // Both ends of the range are included
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 300, 300), 300);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 300, 600), 300);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 1, 300), 300);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 301, 600), 0);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 1, 299), 0);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 400, 200), 0);
+
+    // The same vote twice counts once
+    CServicenodePaymentWinner winner3(winner);
+    winner3.nBlockHeight = 310;
+    BOOST_CHECK(payments.AddWinningServicenode(winner3));
+    BOOST_CHECK(!payments.AddWinningServicenode(winner3));
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payee, 1, 600), 300);
+
+    // Votes for blocks whose block 100 back is unknown are refused
+    CServicenodePaymentWinner winnerEarly(CTxIn(COutPoint(GetRandHash(), 0)));
+    winnerEarly.nBlockHeight = 101;
+    winnerEarly.AddPayee(payee);
+    BOOST_CHECK(!payments.AddWinningServicenode(winnerEarly));
+
+    chainActive.SetTip(pindexOld);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
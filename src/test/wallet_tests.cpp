@@ -4,6 +4,11 @@
 
 #include "wallet.h"
 
+#include "main.h"
+#include "txmempool.h"
+#include "validationinterface.h"
+
+#include <list>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -305,4 +310,302 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+
+// The cached balance getters against a full scan that bypasses every cache
+static void CheckBalances(const CWallet& wallet)
+{
+    CAmount nTrusted = 0, nUnconfirmed = 0, nAnonymizable = 0;
+    {
+        LOCK2(cs_main, wallet.cs_wallet);
+        for (map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it) {
+            const CWalletTx& wtx = it->second;
+            if (wtx.IsTrusted()) {
+                nTrusted += wtx.GetAvailableCredit(false);
+                nAnonymizable += wtx.GetAnonymizableCredit(false);
+            }
+            if (!IsFinalTx(wtx) || (!wtx.IsTrusted() && wtx.GetDepthInMainChain() == 0))
+                nUnconfirmed += wtx.GetAvailableCredit(false);
+        }
+    }
+    // Twice, the second call is answered from the cache
+    for (int i = 0; i < 2; i++) {
+        BOOST_CHECK_EQUAL(wallet.GetBalance(), nTrusted);
+        BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), nUnconfirmed);
+        BOOST_CHECK_EQUAL(wallet.GetAnonymizableBalance(), nAnonymizable);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(wallet_balance_cache)
+{
+    CWallet wallet("wallet_balance_test.dat");
+    bool fFirstRun;
+    wallet.LoadWallet(fFirstRun);
+    RegisterValidationInterface(&wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+    }
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CheckBalances(wallet);
+
+    // A payment from someone else, unconfirmed in the mempool
+    CMutableTransaction txIn;
+    txIn.vin.resize(1);
+    txIn.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txIn.vout.resize(1);
+    txIn.vout[0].scriptPubKey = scriptPubKey;
+    txIn.vout[0].nValue = 5 * COIN;
+    mempool.addUnchecked(txIn.GetHash(), CTxMemPoolEntry(txIn, 0, GetTime(), 0.0, 1));
+    SyncWithWallets(txIn, NULL);
+    CheckBalances(wallet);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 5 * COIN);
+
+    // Spending it to ourselves makes the change trusted
+    CMutableTransaction txChange;
+    txChange.vin.resize(1);
+    txChange.vin[0].prevout = COutPoint(txIn.GetHash(), 0);
+    txChange.vout.resize(1);
+    txChange.vout[0].scriptPubKey = scriptPubKey;
+    txChange.vout[0].nValue = 4 * COIN;
+    mempool.addUnchecked(txChange.GetHash(), CTxMemPoolEntry(txChange, COIN, GetTime(), 0.0, 1));
+    SyncWithWallets(txChange, NULL);
+    CheckBalances(wallet);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 4 * COIN);
+
+    // Fewer rounds to reach
+    int nObfuscationRoundsOld = nObfuscationRounds;
+    nObfuscationRounds = 1;
+    CheckBalances(wallet);
+    nObfuscationRounds = nObfuscationRoundsOld;
+    CheckBalances(wallet);
+
+    // Leaving the mempool, as on expiry, makes both count for nothing
+    std::list<CTransaction> removed;
+    mempool.Expire(GetTime() + 1, &removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_FOREACH (const CTransaction& tx, removed)
+        SyncWithWallets(tx, NULL);
+    CheckBalances(wallet);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+
+    // Back in the mempool, a new tip is enough to bring them back
+    mempool.addUnchecked(txIn.GetHash(), CTxMemPoolEntry(txIn, 0, GetTime(), 0.0, 1));
+    mempool.addUnchecked(txChange.GetHash(), CTxMemPoolEntry(txChange, COIN, GetTime(), 0.0, 1));
+    GetMainSignals().UpdatedBlockTip(chainActive.Tip(), false);
+    CheckBalances(wallet);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 4 * COIN);
+
+    mempool.clear();
+    UnregisterValidationInterface(&wallet);
+}
+
+// A chain a minute per block up to now, every block holding a single wallet transaction
+struct StakeChain {
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+    CBlockIndex* pindexOld;
+
+    StakeChain(int nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++) {
+            vHashes[i] = GetRandHash();
+            vIndex[i].nHeight = i;
+            vIndex[i].nTime = GetTime() - (nBlocks - i) * 60;
+            vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+            vIndex[i].phashBlock = &vHashes[i];
+            mapBlockIndex[vHashes[i]] = &vIndex[i];
+        }
+        pindexOld = chainActive.Tip();
+        chainActive.SetTip(&vIndex.back());
+    }
+
+    ~StakeChain()
+    {
+        chainActive.SetTip(pindexOld);
+        for (size_t i = 0; i < vHashes.size(); i++)
+            mapBlockIndex.erase(vHashes[i]);
+    }
+
+    void AddToWallet(CWallet& wallet, const CMutableTransaction& tx, int nHeight)
+    {
+        CWalletTx wtx(&wallet, tx);
+        vIndex[nHeight].hashMerkleRoot = wtx.GetHash();
+        wtx.hashBlock = vHashes[nHeight];
+        wtx.nIndex = 0;
+        BOOST_CHECK(wallet.AddToWallet(wtx));
+    }
+};
+
+// The stake selection as it was made from a scan of the whole wallet
+static CoinSet SelectStakeCoinsSerially(const CWallet& wallet, int64_t nTargetAmount)
+{
+    vector<COutput> vCoins;
+    wallet.AvailableCoins(vCoins, true);
+    CoinSet setCoins;
+    int64_t nAmountSelected = 0;
+    BOOST_FOREACH (const COutput& out, vCoins) {
+        if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+            continue;
+        if (GetTime() - out.tx->GetTxTime() < nStakeMinAge)
+            continue;
+        if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+            continue;
+        setCoins.insert(make_pair(out.tx, out.i));
+        nAmountSelected += out.tx->vout[out.i].nValue;
+    }
+    return setCoins;
+}
+
+static void CheckStakeCoins(const CWallet& wallet)
+{
+    const int64_t vnTarget[] = {MAX_MONEY, 5000 * COIN, 500 * COIN};
+    for (unsigned int i = 0; i < sizeof(vnTarget) / sizeof(vnTarget[0]); i++) {
+        CoinSet setCoins;
+        BOOST_CHECK(wallet.SelectStakeCoins(setCoins, vnTarget[i]));
+        BOOST_CHECK(equal_sets(setCoins, SelectStakeCoinsSerially(wallet, vnTarget[i])));
+    }
+}
+
+static CMutableTransaction StakeTestTx(const CScript& scriptMine, const CScript& scriptOther, bool fCoinStake)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    if (fCoinStake) {
+        tx.vout.resize(1);
+        tx.vout[0].SetEmpty();
+    }
+    int nOutputs = 1 + GetRand(3);
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut((1 + GetRand(1000)) * COIN, GetRand(3) ? scriptMine : scriptOther));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_stake_candidates)
+{
+    StakeChain chain(400);
+    CWallet wallet("wallet_stake_test.dat");
+    bool fFirstRun;
+    wallet.LoadWallet(fFirstRun);
+    LOCK2(cs_main, wallet.cs_wallet);
+    CKey keyMine, keyOther;
+    keyMine.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    wallet.AddKeyPubKey(keyMine, keyMine.GetPubKey());
+    const CScript scriptMine = GetScriptForDestination(keyMine.GetPubKey().GetID());
+    const CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    // Payments in blocks 51 to 389 in random order; spends go deep below them or shallow above them
+    vector<int> vHeights;
+    for (int nHeight = 51; nHeight < 390; nHeight++)
+        vHeights.push_back(nHeight);
+    random_shuffle(vHeights.begin(), vHeights.end(), GetRandInt);
+    int nDeepHeight = 1, nShallowHeight = 390;
+
+    // The set is built from the wallet on first use, then kept up as transactions come in
+    for (int i = 0; i < 60; i++) {
+        chain.AddToWallet(wallet, StakeTestTx(scriptMine, scriptOther, i % 7 == 0), vHeights.back());
+        vHeights.pop_back();
+    }
+    CheckStakeCoins(wallet);
+    for (int i = 0; i < 20; i++) {
+        chain.AddToWallet(wallet, StakeTestTx(scriptMine, scriptOther, i % 7 == 0), vHeights.back());
+        vHeights.pop_back();
+    }
+    CheckStakeCoins(wallet);
+
+    // Spent deep in the chain and just below the tip, checked twice as deep spends are dropped on the way
+    vector<COutput> vCoins;
+    wallet.AvailableCoins(vCoins, true);
+    BOOST_REQUIRE(vCoins.size() >= 10);
+    for (int i = 0; i < 10; i++) {
+        CMutableTransaction txSpend;
+        txSpend.vin.push_back(CTxIn(COutPoint(vCoins[i].tx->GetHash(), vCoins[i].i)));
+        txSpend.vout.push_back(CTxOut(COIN, scriptOther));
+        chain.AddToWallet(wallet, txSpend, i % 2 ? nDeepHeight++ : nShallowHeight++);
+    }
+    CheckStakeCoins(wallet);
+    CheckStakeCoins(wallet);
+
+    // Locked coins are left out
+    wallet.AvailableCoins(vCoins, true);
+    COutPoint outpointLocked(vCoins[0].tx->GetHash(), vCoins[0].i);
+    wallet.LockCoin(outpointLocked);
+    CheckStakeCoins(wallet);
+    wallet.UnlockCoin(outpointLocked);
+
+    // Shallow spends and payments reorganized away, then back
+    chainActive.SetTip(&chain.vIndex[385]);
+    CheckStakeCoins(wallet);
+    chainActive.SetTip(&chain.vIndex.back());
+    CheckStakeCoins(wallet);
+}
+
+// Whether the stake selection, checked against the scan, picks an output of the transaction
+static bool SelectsStakeCoin(const CWallet& wallet, const uint256& hash)
+{
+    CoinSet setCoins;
+    BOOST_CHECK(wallet.SelectStakeCoins(setCoins, MAX_MONEY));
+    BOOST_CHECK(equal_sets(setCoins, SelectStakeCoinsSerially(wallet, MAX_MONEY)));
+    for (CoinSet::const_iterator it = setCoins.begin(); it != setCoins.end(); ++it) {
+        if (it->first->GetHash() == hash)
+            return true;
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_stake_boundaries)
+{
+    StakeChain chain(400);
+    CWallet wallet("wallet_stake_boundaries.dat");
+    bool fFirstRun;
+    wallet.LoadWallet(fFirstRun);
+    LOCK2(cs_main, wallet.cs_wallet);
+    CKey keyMine;
+    keyMine.MakeNewKey(true);
+    wallet.AddKeyPubKey(keyMine, keyMine.GetPubKey());
+    const CScript scriptMine = GetScriptForDestination(keyMine.GetPubKey().GetID());
+
+    // Nothing to select from an empty wallet
+    CoinSet setCoins;
+    BOOST_CHECK(wallet.SelectStakeCoins(setCoins, MAX_MONEY));
+    BOOST_CHECK(setCoins.empty());
+
+    // A coinstake at 200 and a payment at 300
+    CMutableTransaction txStake;
+    txStake.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    txStake.vout.resize(1);
+    txStake.vout[0].SetEmpty();
+    txStake.vout.push_back(CTxOut(100 * COIN, scriptMine));
+    CMutableTransaction txPayment;
+    txPayment.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    txPayment.vout.push_back(CTxOut(100 * COIN, scriptMine));
+    chain.AddToWallet(wallet, txStake, 200);
+    chain.AddToWallet(wallet, txPayment, 300);
+    const uint256 hashStake = CTransaction(txStake).GetHash();
+    const uint256 hashPayment = CTransaction(txPayment).GetHash();
+
+    // A coinstake is selected from the coinbase maturity, a payment from a depth of ten
+    const int nMaturity = Params().COINBASE_MATURITY();
+    chainActive.SetTip(&chain.vIndex[200 + nMaturity - 2]);
+    BOOST_CHECK(!SelectsStakeCoin(wallet, hashStake));
+    chainActive.SetTip(&chain.vIndex[200 + nMaturity - 1]);
+    BOOST_CHECK(SelectsStakeCoin(wallet, hashStake));
+    chainActive.SetTip(&chain.vIndex[308]);
+    BOOST_CHECK(!SelectsStakeCoin(wallet, hashPayment));
+    chainActive.SetTip(&chain.vIndex[309]);
+    BOOST_CHECK(SelectsStakeCoin(wallet, hashPayment));
+
+    // and only once it is as old as the minimum stake age
+    chainActive.SetTip(&chain.vIndex.back());
+    const int64_t nTxTime = wallet.mapWallet[hashPayment].GetTxTime();
+    SetMockTime(nTxTime + nStakeMinAge - 1);
+    BOOST_CHECK(!SelectsStakeCoin(wallet, hashPayment));
+    SetMockTime(nTxTime + nStakeMinAge);
+    BOOST_CHECK(SelectsStakeCoin(wallet, hashPayment));
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,12 +5,16 @@
 
 #include "txdb.h"
 
+#include "hash.h"
 #include "main.h"
 #include "pow.h"
 #include "uint256.h"
 
+#include <deque>
+#include <list>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -195,69 +199,251 @@ bool CBlockTreeDB::ReadFlag(const std::string& name, bool& fValue)
     return true;
 }
 
+namespace
+{
+/** Number of block index records handed to a loader worker at a time. */
+const size_t BLOCK_INDEX_LOAD_BATCH = 1024;
+
+/** Block index records read from leveldb, decoded and checked together by one worker. */
+struct CBlockIndexLoadBatch {
+    std::vector<std::string> vValue;
+    std::vector<CDiskBlockIndex> vIndex;
+    std::vector<uint256> vHash;
+    std::string strError;
+    int64_t nTimeMicros;
+    bool fDecoded; //! Set once a worker is done with the batch, guarded by the queue mutex
+
+    CBlockIndexLoadBatch() : nTimeMicros(0), fDecoded(false) {}
+};
+
+/** Deserialize a batch, hash the headers and check proof of work. Runs on a loader thread. */
+void DecodeBlockIndexBatch(CBlockIndexLoadBatch& batch)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    const size_t nCount = batch.vValue.size();
+    batch.vIndex.resize(nCount);
+    batch.vHash.resize(nCount);
+    try {
+        for (size_t i = 0; i < nCount; i++) {
+            CDataStream ssValue(batch.vValue[i].data(), batch.vValue[i].data() + batch.vValue[i].size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> batch.vIndex[i];
+        }
+    } catch (std::exception& e) {
+        batch.strError = strprintf("Deserialize or I/O error - %s", e.what());
+        return;
+    }
+    std::vector<std::string>().swap(batch.vValue);
+
+    // Hash the headers together, so the SIMD Quark implementation works on several at a time;
+    // each hash is the one GetBlockHash() gives
+    std::vector<unsigned char> vchHeaders(nCount * 80);
+    for (size_t i = 0; i < nCount; i++) {
+        CBlockHeader header = batch.vIndex[i].GetBlockHeader();
+        memcpy(&vchHeaders[i * 80], BEGIN(header.nVersion), 80);
+    }
+    if (nCount > 0)
+        HashQuarkBatch(&batch.vHash[0], &vchHeaders[0], 80, 80, nCount);
+
+    for (size_t i = 0; i < nCount; i++) {
+        if (batch.vIndex[i].nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(batch.vHash[i], batch.vIndex[i].nBits)) {
+            batch.strError = strprintf("CheckProofOfWork failed: %s", batch.vIndex[i].ToString());
+            return;
+        }
+    }
+    batch.nTimeMicros = GetTimeMicros() - nTimeStart;
+}
+
+/** Insert the entries of a decoded batch into mapBlockIndex and link them. Runs on the loading thread. */
+void LinkBlockIndexBatch(const CBlockIndexLoadBatch& batch)
+{
+    for (size_t i = 0; i < batch.vIndex.size(); i++) {
+        const CDiskBlockIndex& diskindex = batch.vIndex[i];
+        CBlockIndex* pindexNew = InsertBlockIndex(batch.vHash[i]);
+        pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nHeight = diskindex.nHeight;
+        pindexNew->nFile = diskindex.nFile;
+        pindexNew->nDataPos = diskindex.nDataPos;
+        pindexNew->nUndoPos = diskindex.nUndoPos;
+        pindexNew->nVersion = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime = diskindex.nTime;
+        pindexNew->nBits = diskindex.nBits;
+        pindexNew->nNonce = diskindex.nNonce;
+        pindexNew->nStatus = diskindex.nStatus;
+        pindexNew->nTx = diskindex.nTx;
+
+        //Proof Of Stake
+        pindexNew->nMint = diskindex.nMint;
+        pindexNew->nMoneySupply = diskindex.nMoneySupply;
+        pindexNew->nFlags = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake = diskindex.prevoutStake;
+        pindexNew->nStakeTime = diskindex.nStakeTime;
+        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+
+        // ppcoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+}
+
+/** Work queue feeding the block index loader threads. Stops and joins them when destroyed. */
+class CBlockIndexLoadQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::condition_variable condDecoded;
+    std::deque<CBlockIndexLoadBatch*> queue;
+    bool fDone;
+    boost::thread_group threads;
+
+    void Loop()
+    {
+        while (true) {
+            CBlockIndexLoadBatch* pbatch;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty() && !fDone)
+                    cond.wait(lock);
+                if (queue.empty())
+                    return;
+                pbatch = queue.front();
+                queue.pop_front();
+            }
+            DecodeBlockIndexBatch(*pbatch);
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                pbatch->fDecoded = true;
+            }
+            condDecoded.notify_all();
+        }
+    }
+
+public:
+    CBlockIndexLoadQueue(int nThreads) : fDone(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockIndexLoadQueue::Loop, this));
+    }
+
+    ~CBlockIndexLoadQueue()
+    {
+        Finish();
+    }
+
+    void Add(CBlockIndexLoadBatch* pbatch)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            queue.push_back(pbatch);
+        }
+        cond.notify_one();
+    }
+
+    //! Whether a worker is done with the batch
+    bool IsDecoded(const CBlockIndexLoadBatch* pbatch)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return pbatch->fDecoded;
+    }
+
+    //! Wait for a worker to be done with the batch
+    void WaitDecoded(const CBlockIndexLoadBatch* pbatch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!pbatch->fDecoded)
+            condDecoded.wait(lock);
+    }
+
+    //! Wait for all queued batches to be processed
+    void Finish()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (fDone)
+                return;
+            fDone = true;
+        }
+        cond.notify_all();
+        threads.join_all();
+    }
+};
+} // namespace
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
+    // Loading is pipelined: this thread iterates leveldb, a pool of -par
+    // workers deserializes the records and verifies proof of work (the Quark
+    // hashing dominates), and this thread links each batch in key order as
+    // soon as it and the ones before it are done.
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256());
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    const int nThreads = std::max(1, nScriptCheckThreads);
+    size_t nRecords = 0;
+    int64_t nTimeStart = GetTimeMicros();
+    int64_t nTimeDecode = 0;
+    int64_t nTimeLink = 0;
+
+    // The batches outlive the queue, whose workers hold pointers to them
+    std::list<CBlockIndexLoadBatch> listBatch;
+    CBlockIndexLoadQueue queue(nThreads);
+    std::vector<std::string> vValue;
+    vValue.reserve(BLOCK_INDEX_LOAD_BATCH);
 
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+    // Read mapBlockIndex records
+    while (true) {
+        boost::this_thread::interruption_point();
+        bool fEnd = !pcursor->Valid();
+        if (!fEnd) {
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                fEnd = chType != 'b'; // finished loading block index
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
+        if (!fEnd) {
+            leveldb::Slice slValue = pcursor->value();
+            vValue.push_back(std::string(slValue.data(), slValue.size()));
+            nRecords++;
+            pcursor->Next();
+            if (vValue.size() < BLOCK_INDEX_LOAD_BATCH)
+                continue;
+        }
+
+        if (!vValue.empty()) {
+            listBatch.push_back(CBlockIndexLoadBatch());
+            listBatch.back().vValue.swap(vValue);
+            vValue.reserve(BLOCK_INDEX_LOAD_BATCH);
+            queue.Add(&listBatch.back());
+        }
+
+        // Link the batches done so far; once everything is read, wait for the rest
+        while (!listBatch.empty() && (fEnd || queue.IsDecoded(&listBatch.front()))) {
+            const CBlockIndexLoadBatch& batch = listBatch.front();
+            queue.WaitDecoded(&batch);
+            if (!batch.strError.empty())
+                return error("%s : %s", __func__, batch.strError);
+            int64_t nTimeLinkStart = GetTimeMicros();
+            LinkBlockIndexBatch(batch);
+            nTimeLink += GetTimeMicros() - nTimeLinkStart;
+            nTimeDecode += batch.nTimeMicros;
+            listBatch.pop_front();
+        }
+        if (fEnd)
+            break;
     }
+    LogPrintf("%s: loaded %u block index entries on %d threads in %.2fms (%.2fms of decoding and hashing across workers, %.2fms linking)\n", __func__,
+        nRecords, nThreads, (GetTimeMicros() - nTimeStart) * 0.001, nTimeDecode * 0.001, nTimeLink * 0.001);
 
     return true;
 }
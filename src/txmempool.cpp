@@ -6,6 +6,7 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
 #include "streams.h"
 #include "util.h"
@@ -16,16 +17,22 @@
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), nFeeDelta(0)
 {
     nHeight = MEMPOOL_HEIGHT;
+    nUsageSize = 0;
+    ResetAncestorState();
+    ResetDescendantState();
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+    ResetAncestorState();
+    ResetDescendantState();
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -42,6 +49,59 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+unsigned int CTxMemPoolEntry::GetFreeHeight() const
+{
+    if (AllowFree(dPriority))
+        return nHeight;
+    CAmount nValueIn = tx.GetValueOut() + nFee;
+    if (nValueIn <= 0)
+        return std::numeric_limits<unsigned int>::max();
+    // One block early, so that rounding can only make it too soon
+    double dBlocks = floor((AllowFreeThreshold() - dPriority) * nModSize / nValueIn) - 1;
+    if (dBlocks >= MEMPOOL_HEIGHT - nHeight)
+        return std::numeric_limits<unsigned int>::max();
+    return nHeight + (unsigned int)std::max(0.0, dBlocks);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    nModFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    nModFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount newFeeDelta)
+{
+    nModFeesWithAncestors += newFeeDelta - nFeeDelta;
+    nModFeesWithDescendants += newFeeDelta - nFeeDelta;
+    nFeeDelta = newFeeDelta;
+}
+
+void CTxMemPoolEntry::ResetAncestorState()
+{
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = GetModifiedFee();
+}
+
+void CTxMemPoolEntry::ResetDescendantState()
+{
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = GetModifiedFee();
+}
+
 /**
  * Keep track of fee/priority for transactions confirmed within N blocks
  */
@@ -354,8 +414,16 @@ public:
 };
 
 
+CMemPoolOutPointHasher::CMemPoolOutPointHasher() : salt(GetRandHash()) {}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       cachedInnerUsage(0),
+                                                       nLinks(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false),
+                                                       rollingMinimumFeeRate(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -379,12 +447,10 @@ void CTxMemPool::pruneSpent(const uint256& hashTx, CCoins& coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+    // mapNextTx is unordered, so look up each output of hashTx on its own
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (mapNextTx.count(COutPoint(hashTx, i)))
+            coins.Spend(i); // and remove those outputs from coins
     }
 }
 
@@ -401,6 +467,124 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::CalculateMemPoolAncestors(const uint256& hash, std::set<uint256>& setAncestors) const
+{
+    LinksMap::const_iterator it = mapLinks.find(hash);
+    if (it == mapLinks.end())
+        return;
+    std::vector<uint256> vStack(it->second.parents.begin(), it->second.parents.end());
+    while (!vStack.empty()) {
+        uint256 hashParent = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(hashParent).second)
+            continue;
+        const std::set<uint256>& parents = mapLinks.find(hashParent)->second.parents;
+        vStack.insert(vStack.end(), parents.begin(), parents.end());
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTransaction& tx, uint64_t nTxSize, std::set<uint256>& setAncestors, uint64_t limitAncestorCount,
+    uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const
+{
+    std::set<uint256> setParents;
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (mapTx.count(txin.prevout.hash))
+            setParents.insert(txin.prevout.hash);
+    }
+    if (setParents.size() + 1 > limitAncestorCount) {
+        errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+        return false;
+    }
+
+    uint64_t nSizeWithAncestors = nTxSize;
+    std::vector<uint256> vStack(setParents.begin(), setParents.end());
+    while (!vStack.empty()) {
+        uint256 hashAncestor = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(hashAncestor).second)
+            continue;
+        const CTxMemPoolEntry& ancestor = mapTx.find(hashAncestor)->second;
+        nSizeWithAncestors += ancestor.GetTxSize();
+        if (ancestor.GetSizeWithDescendants() + nTxSize > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hashAncestor.ToString(), limitDescendantSize);
+            return false;
+        } else if (ancestor.GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", hashAncestor.ToString(), limitDescendantCount);
+            return false;
+        } else if (nSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        } else if (setAncestors.size() + 1 > limitAncestorCount) {
+            errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+            return false;
+        }
+        const std::set<uint256>& parents = mapLinks.find(hashAncestor)->second.parents;
+        vStack.insert(vStack.end(), parents.begin(), parents.end());
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    std::vector<uint256> vStack(1, hash);
+    while (!vStack.empty()) {
+        uint256 hashChild = vStack.back();
+        vStack.pop_back();
+        if (!setDescendants.insert(hashChild).second)
+            continue;
+        LinksMap::const_iterator it = mapLinks.find(hashChild);
+        if (it != mapLinks.end())
+            vStack.insert(vStack.end(), it->second.children.begin(), it->second.children.end());
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(const uint256& hash, int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    // The index is keyed on the totals, so the entry has to leave it while they change
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setAncestorFee.erase(&entry);
+    entry.UpdateAncestorState(modifySize, modifyFee, modifyCount);
+    setAncestorFee.insert(&entry);
+}
+
+void CTxMemPool::UpdateForAncestors(const uint256& hash)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setAncestorFee.erase(&entry);
+    entry.ResetAncestorState();
+    std::set<uint256> setAncestors;
+    CalculateMemPoolAncestors(hash, setAncestors);
+    BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+        const CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+        entry.UpdateAncestorState(ancestor.GetTxSize(), ancestor.GetModifiedFee(), 1);
+    }
+    setAncestorFee.insert(&entry);
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash, int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setDescendantScore.erase(&entry);
+    entry.UpdateDescendantState(modifySize, modifyFee, modifyCount);
+    setDescendantScore.insert(&entry);
+}
+
+void CTxMemPool::UpdateForDescendants(const uint256& hash)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setDescendantScore.erase(&entry);
+    entry.ResetDescendantState();
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+        if (hashDescendant == hash)
+            continue;
+        const CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+        entry.UpdateDescendantState(descendant.GetTxSize(), descendant.GetModifiedFee(), 1);
+    }
+    setDescendantScore.insert(&entry);
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
@@ -408,12 +592,65 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        if (mapTx.count(hash))
+            return true;
+        CTxMemPoolEntry& newEntry = mapTx[hash];
+        newEntry = entry;
+        const CTransaction& tx = newEntry.GetTx();
+        TxLinks& links = mapLinks[hash];
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            if (mapTx.count(tx.vin[i].prevout.hash))
+                links.parents.insert(tx.vin[i].prevout.hash);
+        }
+        BOOST_FOREACH (const uint256& hashParent, links.parents)
+            mapLinks[hashParent].children.insert(hash);
+        nLinks += links.parents.size();
+
+        // Pool transactions can only already spend this one when the transactions of
+        // a disconnected block are put back, so that is the only time descendants change
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            NextTxMap::const_iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = it->second.ptx->GetHash();
+            if (links.children.insert(hashChild).second) {
+                mapLinks[hashChild].parents.insert(hash);
+                nLinks++;
+            }
+        }
+
+        DeltaMap::const_iterator pos = mapDeltas.find(hash);
+        if (pos != mapDeltas.end())
+            newEntry.UpdateFeeDelta(pos->second.second);
+        newEntry.ResetAncestorState();
+        newEntry.ResetDescendantState();
+        setDescendantScore.insert(&newEntry);
+        UpdateForAncestors(hash);
+        std::set<uint256> setAncestors;
+        CalculateMemPoolAncestors(hash, setAncestors);
+        if (links.children.empty()) {
+            BOOST_FOREACH (const uint256& hashAncestor, setAncestors)
+                UpdateDescendantState(hashAncestor, newEntry.GetTxSize(), newEntry.GetModifiedFee(), 1);
+        } else {
+            // The new transaction joins existing descendants to its ancestors
+            std::set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+                if (hashDescendant != hash)
+                    UpdateForAncestors(hashDescendant);
+            }
+            UpdateForDescendants(hash);
+            BOOST_FOREACH (const uint256& hashAncestor, setAncestors)
+                UpdateForDescendants(hashAncestor);
+        }
+        setEntryTime.insert(std::make_pair(newEntry.GetTime(), hash));
+        if (newEntry.GetFreeHeight() != std::numeric_limits<unsigned int>::max())
+            setFreeHeight.insert(std::make_pair(newEntry.GetFreeHeight(), hash));
+
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
+        cachedInnerUsage += newEntry.DynamicMemoryUsage();
     }
     return true;
 }
@@ -432,7 +669,7 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                NextTxMap::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txToRemove.push_back(it->second.ptx->GetHash());
@@ -446,7 +683,7 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
             const CTransaction& tx = mapTx[hash].GetTx();
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    NextTxMap::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it == mapNextTx.end())
                         continue;
                     txToRemove.push_back(it->second.ptx->GetHash());
@@ -455,8 +692,48 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
             BOOST_FOREACH (const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
 
+            // Descendants staying in the pool stop counting this transaction as an
+            // ancestor (with fRecursive they are all about to go as well), and
+            // its ancestors stop counting it as a descendant.
+            const CTxMemPoolEntry& entry = mapTx[hash];
+            std::set<uint256> setDescendants, setAncestors;
+            if (!fRecursive)
+                CalculateDescendants(hash, setDescendants);
+            CalculateMemPoolAncestors(hash, setAncestors);
+            TxLinks& links = mapLinks[hash];
+            bool fHasParents = !links.parents.empty();
+            bool fHasChildren = !links.children.empty();
+            BOOST_FOREACH (const uint256& hashParent, links.parents)
+                mapLinks[hashParent].children.erase(hash);
+            BOOST_FOREACH (const uint256& hashChild, links.children)
+                mapLinks[hashChild].parents.erase(hash);
+            nLinks -= links.parents.size() + links.children.size();
+            mapLinks.erase(hash);
+            BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+                if (hashDescendant == hash)
+                    continue;
+                // Without in-pool parents the ancestors of the descendants only lose
+                // this one transaction, otherwise some of its ancestors may go too
+                if (fHasParents)
+                    UpdateForAncestors(hashDescendant);
+                else
+                    UpdateAncestorState(hashDescendant, -(int64_t)entry.GetTxSize(), -entry.GetModifiedFee(), -1);
+            }
+            BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+                // Likewise the ancestors lose only this transaction unless it had children
+                if (fHasChildren)
+                    UpdateForDescendants(hashAncestor);
+                else
+                    UpdateDescendantState(hashAncestor, -(int64_t)entry.GetTxSize(), -entry.GetModifiedFee(), -1);
+            }
+            setAncestorFee.erase(&entry);
+            setDescendantScore.erase(&entry);
+            setEntryTime.erase(std::make_pair(entry.GetTime(), hash));
+            setFreeHeight.erase(std::make_pair(entry.GetFreeHeight(), hash));
+
             removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
+            totalTxSize -= entry.GetTxSize();
+            cachedInnerUsage -= entry.DynamicMemoryUsage();
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -468,10 +745,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (TxMap::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         const CTransaction& tx = it->second.GetTx();
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            TxMap::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -497,7 +774,7 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
     list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        NextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction& txConflict = *it->second.ptx;
             if (txConflict != tx) {
@@ -526,15 +803,27 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    setAncestorFee.clear();
+    setDescendantScore.clear();
+    setEntryTime.clear();
+    setFreeHeight.clear();
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    nLinks = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -546,19 +835,22 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
+    uint64_t linksCheck = 0;
+    uint64_t nFreeCheck = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (TxMap::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->second.GetTxSize();
         const CTransaction& tx = it->second.GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            TxMap::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
                 const CTransaction& tx2 = it2->second.GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
@@ -568,12 +860,52 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            NextTxMap::const_iterator it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
             i++;
         }
+        // Check the links and the ancestor totals against the inputs
+        LinksMap::const_iterator itLinks = mapLinks.find(it->first);
+        assert(itLinks != mapLinks.end());
+        BOOST_FOREACH (const uint256& hashParent, itLinks->second.parents) {
+            assert(mapTx.count(hashParent));
+            assert(mapLinks.find(hashParent)->second.children.count(it->first));
+        }
+        std::set<uint256> setAncestors;
+        CalculateMemPoolAncestors(it->first, setAncestors);
+        uint64_t nSizeCheck = it->second.GetTxSize();
+        CAmount nFeesCheck = it->second.GetModifiedFee();
+        BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+            nSizeCheck += mapTx.find(hashAncestor)->second.GetTxSize();
+            nFeesCheck += mapTx.find(hashAncestor)->second.GetModifiedFee();
+        }
+        assert(it->second.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->second.GetSizeWithAncestors() == nSizeCheck);
+        assert(it->second.GetModFeesWithAncestors() == nFeesCheck);
+        assert(setAncestorFee.count(&it->second));
+
+        std::set<uint256> setDescendants;
+        CalculateDescendants(it->first, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+            nSizeCheck += mapTx.find(hashDescendant)->second.GetTxSize();
+            nFeesCheck += mapTx.find(hashDescendant)->second.GetModifiedFee();
+        }
+        assert(it->second.GetCountWithDescendants() == setDescendants.size());
+        assert(it->second.GetSizeWithDescendants() == nSizeCheck);
+        assert(it->second.GetModFeesWithDescendants() == nFeesCheck);
+        assert(setDescendantScore.count(&it->second));
+        unsigned int nFreeHeight = it->second.GetFreeHeight();
+        if (nFreeHeight != std::numeric_limits<unsigned int>::max()) {
+            assert(setFreeHeight.count(std::make_pair(nFreeHeight, it->first)));
+            nFreeCheck++;
+        }
+        innerUsage += it->second.DynamicMemoryUsage();
+        linksCheck += itLinks->second.parents.size();
+
         if (fDependsWait)
             waitingOnDependants.push_back(&it->second);
         else {
@@ -599,9 +931,9 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (NextTxMap::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
+        TxMap::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->second.GetTx();
         assert(it2 != mapTx.end());
         assert(&tx == it->second.ptx);
@@ -610,6 +942,13 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     }
 
     assert(totalTxSize == checkTotal);
+    assert(setAncestorFee.size() == mapTx.size());
+    assert(setDescendantScore.size() == mapTx.size());
+    assert(setEntryTime.size() == mapTx.size());
+    assert(setFreeHeight.size() == nFreeCheck);
+    assert(mapLinks.size() == mapTx.size());
+    assert(innerUsage == cachedInnerUsage);
+    assert(linksCheck == nLinks);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -618,14 +957,14 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (TxMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    TxMap::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
     result = i->second.GetTx();
     return true;
@@ -680,6 +1019,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount>& deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        UpdateFeeDelta(hash, deltas.second);
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -687,7 +1027,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
 void CTxMemPool::ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta)
 {
     LOCK(cs);
-    std::map<uint256, std::pair<double, CAmount> >::iterator pos = mapDeltas.find(hash);
+    DeltaMap::iterator pos = mapDeltas.find(hash);
     if (pos == mapDeltas.end())
         return;
     const std::pair<double, CAmount>& deltas = pos->second;
@@ -695,10 +1035,138 @@ void CTxMemPool::ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount
     nFeeDelta += deltas.second;
 }
 
+void CTxMemPool::GetFreeCandidates(unsigned int nHeight, std::vector<const CTxMemPoolEntry*>& vEntries) const
+{
+    // Without a priority delta nothing is free before its free height; the
+    // few prioritised entries are checked on their own
+    std::set<std::pair<unsigned int, uint256> >::const_iterator it = setFreeHeight.begin();
+    for (; it != setFreeHeight.end() && it->first <= nHeight; ++it) {
+        if (mapDeltas.count(it->second))
+            continue;
+        const CTxMemPoolEntry& entry = mapTx.find(it->second)->second;
+        if (AllowFree(entry.GetPriority(nHeight)))
+            vEntries.push_back(&entry);
+    }
+    for (DeltaMap::const_iterator pos = mapDeltas.begin(); pos != mapDeltas.end(); ++pos) {
+        TxMap::const_iterator mi = mapTx.find(pos->first);
+        if (mi != mapTx.end() && AllowFree(mi->second.GetPriority(nHeight) + pos->second.first))
+            vEntries.push_back(&mi->second);
+    }
+}
+
 void CTxMemPool::ClearPrioritisation(const uint256 hash)
 {
     LOCK(cs);
     mapDeltas.erase(hash);
+    UpdateFeeDelta(hash, 0);
+}
+
+void CTxMemPool::UpdateFeeDelta(const uint256& hash, CAmount nFeeDelta)
+{
+    TxMap::iterator it = mapTx.find(hash);
+    if (it == mapTx.end())
+        return;
+    CAmount nChange = nFeeDelta - (it->second.GetModifiedFee() - it->second.GetFee());
+    if (nChange == 0)
+        return;
+    setAncestorFee.erase(&it->second);
+    setDescendantScore.erase(&it->second);
+    it->second.UpdateFeeDelta(nFeeDelta);
+    setAncestorFee.insert(&it->second);
+    setDescendantScore.insert(&it->second);
+    std::set<uint256> setDescendants, setAncestors;
+    CalculateDescendants(hash, setDescendants);
+    BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+        if (hashDescendant != hash)
+            UpdateAncestorState(hashDescendant, 0, nChange, 0);
+    }
+    CalculateMemPoolAncestors(hash, setAncestors);
+    BOOST_FOREACH (const uint256& hashAncestor, setAncestors)
+        UpdateDescendantState(hashAncestor, 0, nChange, 0);
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Each link is an element of a parent set and of a child set
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) +
+           memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(setAncestorFee) + memusage::DynamicUsage(setDescendantScore) +
+           memusage::DynamicUsage(setEntryTime) + memusage::DynamicUsage(setFreeHeight) + 2 * nLinks * memusage::IncrementalDynamicUsage(std::set<uint256>()) + cachedInnerUsage;
+}
+
+int CTxMemPool::Expire(int64_t time, std::list<CTransaction>* pRemoved)
+{
+    LOCK(cs);
+    std::vector<CTransaction> vExpired;
+    for (std::set<std::pair<int64_t, uint256> >::const_iterator it = setEntryTime.begin(); it != setEntryTime.end() && it->first < time; ++it)
+        vExpired.push_back(mapTx[it->second].GetTx());
+    std::list<CTransaction> removed;
+    BOOST_FOREACH (const CTransaction& tx, vExpired)
+        remove(tx, removed, true);
+    if (pRemoved)
+        pRemoved->insert(pRemoved->end(), removed.begin(), removed.end());
+    return removed.size();
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::list<CTransaction>* pRemoved)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!setDescendantScore.empty() && DynamicMemoryUsage() > sizelimit) {
+        const CTxMemPoolEntry* pentry = *setDescendantScore.begin();
+
+        // The fee to get in is raised to what the evicted package paid plus the relay
+        // fee, so replacing it has to pay for its own relay as well
+        CFeeRate removed(CFeeRate(pentry->GetModFeesWithDescendants(), pentry->GetSizeWithDescendants()).GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        std::list<CTransaction> lRemoved;
+        remove(CTransaction(pentry->GetTx()), lRemoved, true);
+        nTxnRemoved += lRemoved.size();
+        if (pRemoved)
+            pRemoved->splice(pRemoved->end(), lRemoved);
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        // Decay faster while the pool is well below its limit
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minRelayFee);
 }
 
 
@@ -7,6 +7,9 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
+
+#include <boost/unordered_map.hpp>
 
 #include "amount.h"
 #include "coins.h"
@@ -44,6 +47,18 @@ private:
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee delta from PrioritiseTransaction
+    size_t nUsageSize;    //! ... and total memory usage
+
+    //! Totals for this transaction and all of its in-pool ancestors, maintained by CTxMemPool
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    //! ... and for this transaction and all of its in-pool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -52,10 +67,94 @@ public:
 
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
+    /** A height from which the priority (without deltas) may allow the transaction free; never later than the first one that does */
+    unsigned int GetFreeHeight() const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    /** Adjust the package totals; only to be called by CTxMemPool while the entry is out of its indexes */
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateFeeDelta(CAmount newFeeDelta);
+    void ResetAncestorState();
+    void ResetDescendantState();
+};
+
+/**
+ * Order mempool entries by the fee rate of the package they form with their
+ * in-pool ancestors, highest first. Ties are broken by txid so the order is total.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double f1 = (double)a->GetModFeesWithAncestors() * b->GetSizeWithAncestors();
+        double f2 = (double)b->GetModFeesWithAncestors() * a->GetSizeWithAncestors();
+        if (f1 == f2)
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/**
+ * Order mempool entries by the fee rate of the package they form with their
+ * in-pool descendants, lowest first: the order in which they are evicted.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double f1 = (double)a->GetModFeesWithDescendants() * b->GetSizeWithDescendants();
+        double f2 = (double)b->GetModFeesWithDescendants() * a->GetSizeWithDescendants();
+        if (f1 == f2)
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        return f1 < f2;
+    }
+};
+
+/** Order mempool entries so that every transaction comes after its in-pool parents */
+class CompareTxMemPoolEntryByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        if (a->GetCountWithAncestors() == b->GetCountWithAncestors())
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+
+/**
+ * Salted hasher for the outpoints of mapNextTx; like CCoinsKeyHasher, the salt
+ * keeps peers from choosing transactions that pile up in one bucket.
+ */
+class CMemPoolOutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CMemPoolOutPointHasher();
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        size_t seed = outpoint.hash.GetHash(salt);
+        boost::hash_combine(seed, outpoint.n);
+        return seed;
+    }
 };
 
 class CMinerPolicyEstimator;
@@ -100,12 +199,45 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    uint64_t nLinks;           //! number of parent/child links between entries
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
+
+    void trackPackageRemoved(const CFeeRate& rate);
+
+    void UpdateAncestorState(const uint256& hash, int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateForAncestors(const uint256& hash);
+    void UpdateDescendantState(const uint256& hash, int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateForDescendants(const uint256& hash);
+    void UpdateFeeDelta(const uint256& hash, CAmount nFeeDelta);
 
 public:
+    /** In-pool parents and children of a mempool transaction */
+    struct TxLinks {
+        std::set<uint256> parents;
+        std::set<uint256> children;
+    };
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, CCoinsKeyHasher> TxMap;
+    typedef boost::unordered_map<COutPoint, CInPoint, CMemPoolOutPointHasher> NextTxMap;
+    typedef boost::unordered_map<uint256, std::pair<double, CAmount>, CCoinsKeyHasher> DeltaMap;
+    typedef boost::unordered_map<uint256, TxLinks, CCoinsKeyHasher> LinksMap;
+    typedef std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByAncestorFee> indexed_ancestor_fee;
+    typedef std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByDescendantScore> indexed_descendant_score;
+
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
-    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    TxMap mapTx;
+    NextTxMap mapNextTx;
+    DeltaMap mapDeltas;
+    LinksMap mapLinks;
+    indexed_ancestor_fee setAncestorFee;           //! Every entry of mapTx, best package fee rate first
+    indexed_descendant_score setDescendantScore;   //! Every entry of mapTx, first to be evicted first
+    std::set<std::pair<int64_t, uint256> > setEntryTime; //! Every entry of mapTx by time, oldest first
+    std::set<std::pair<unsigned int, uint256> > setFreeHeight; //! Entries whose priority ever allows them free, by GetFreeHeight()
 
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
@@ -127,12 +259,36 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins& coins);
+
+    /** Collect the in-pool ancestors of the mempool transaction hash, not including itself */
+    void CalculateMemPoolAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    /**
+     * Collect the in-pool ancestors of tx, which does not have to be in the pool, and check
+     * that adding it keeps its own package and those of its ancestors within the limits.
+     * Stops at the first limit it breaks and returns false with errString set.
+     */
+    bool CalculateMemPoolAncestors(const CTransaction& tx, uint64_t nTxSize, std::set<uint256>& setAncestors, uint64_t limitAncestorCount,
+        uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const;
+    /** Collect hash and all of its in-pool descendants into setDescendants */
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
+    /** Remove transactions that entered the pool before time, with their descendants. Returns the number removed. */
+    int Expire(int64_t time, std::list<CTransaction>* pRemoved = NULL);
+    /** Evict the lowest fee rate packages, with their descendants, until the pool uses at most sizelimit bytes */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>* pRemoved = NULL);
+    /**
+     * The minimum fee rate to get into the pool, which is raised above the relay fee
+     * by evictions and decays back towards it. sizelimit is the -maxmempool limit in bytes.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
+    /** Collect the entries whose priority, with any delta, allows them free at nHeight */
+    void GetFreeCandidates(unsigned int nHeight, std::vector<const CTxMemPoolEntry*>& vEntries) const;
     void ClearPrioritisation(const uint256 hash);
 
     unsigned long size()
@@ -145,6 +301,7 @@ public:
         LOCK(cs);
         return totalTxSize;
     }
+    size_t DynamicMemoryUsage() const;
 
     bool exists(uint256 hash)
     {
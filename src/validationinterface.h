@@ -31,7 +31,7 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock);
 
 class CValidationInterface {
 protected:
-    virtual void UpdatedBlockTip(const CBlockIndex *) {}
+    virtual void UpdatedBlockTip(const CBlockIndex *, bool) {}
     virtual void SyncTransaction(const CTransaction &, const CBlock *) {}
     virtual void NotifyTransactionLock(const CTransaction &) {}
     virtual void SetBestChain(const CBlockLocator &) {}
@@ -48,8 +48,8 @@ protected:
 };
 
 struct CMainSignals {
-    /** Notifies listeners of updated block chain tip */
-    boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
+    /** Notifies listeners of updated block chain tip, once per ActivateBestChain step and outside cs_main, and whether it is still in initial download */
+    boost::signals2::signal<void (const CBlockIndex *, bool)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
     /** Notifies listeners of an updated transaction lock without new data. */
@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70711;
+static const int PROTOCOL_VERSION = 70712;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -40,5 +40,8 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" messages start with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 70712;
+
 
 #endif // BITCOIN_VERSION_H
@@ -618,6 +618,7 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        nWalletUpdated++;
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
     }
@@ -631,8 +632,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        nWalletUpdated++;
     } else {
         LOCK(cs_wallet);
+        nWalletUpdated++;
         // Inserts only if not already there, returns tx inserted or tx found
         pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
@@ -682,6 +685,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             }
             AddToSpends(hash);
         }
+        AddToStakeCandidates(wtx);
 
         bool fUpdated = false;
         if (!fInsertedNew) {
@@ -761,6 +765,14 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
         if (mapWallet.count(txin.prevout.hash))
             mapWallet[txin.prevout.hash].MarkDirty();
     }
+    nWalletUpdated++;
+}
+
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex, bool fInitialDownload)
+{
+    // Depths, maturity and conflicts of wallet transactions all follow the tip, during initial download as well
+    LOCK(cs_wallet);
+    nWalletUpdated++;
 }
 
 void CWallet::EraseFromWallet(const uint256& hash)
@@ -769,6 +781,7 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
+        nWalletUpdated++;
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1220,9 +1233,42 @@ void CWallet::ResendWalletTransactions()
  */
 
 
+bool CWallet::GetCachedBalance(BalanceType type, CAmount& nBalance) const
+{
+    LOCK(cs_wallet);
+    if (nWalletUpdated != nCachedBalanceWallet || nObfuscationRounds != nCachedBalanceRounds) {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            fCachedBalance[i] = false;
+        // The anonymizable and anonymized credit of each transaction depend on the rounds as well
+        if (nObfuscationRounds != nCachedBalanceRounds) {
+            for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+                it->second.fAnonymizableCreditCached = false;
+                it->second.fAnonymizedCreditCached = false;
+            }
+        }
+        nCachedBalanceWallet = nWalletUpdated;
+        nCachedBalanceRounds = nObfuscationRounds;
+        return false;
+    }
+    nBalance = nCachedBalance[type];
+    return fCachedBalance[type];
+}
+
+void CWallet::SetCachedBalance(BalanceType type, CAmount nBalance) const
+{
+    AssertLockHeld(cs_wallet);
+    // Changed since GetCachedBalance(): the total may predate the change, leave it to the next call
+    if (nWalletUpdated != nCachedBalanceWallet || nObfuscationRounds != nCachedBalanceRounds)
+        return;
+    nCachedBalance[type] = nBalance;
+    fCachedBalance[type] = true;
+}
+
 CAmount CWallet::GetBalance() const
 {
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_TRUSTED, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1230,6 +1276,7 @@ CAmount CWallet::GetBalance() const
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
+        SetCachedBalance(BALANCE_TRUSTED, nTotal);
     }
 
     return nTotal;
@@ -1240,6 +1287,8 @@ CAmount CWallet::GetAnonymizableBalance() const
     if (fLiteMode) return 0;
 
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_ANONYMIZABLE, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1248,6 +1297,7 @@ CAmount CWallet::GetAnonymizableBalance() const
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAnonymizableCredit();
         }
+        SetCachedBalance(BALANCE_ANONYMIZABLE, nTotal);
     }
 
     return nTotal;
@@ -1258,6 +1308,8 @@ CAmount CWallet::GetAnonymizedBalance() const
     if (fLiteMode) return 0;
 
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_ANONYMIZED, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1266,6 +1318,7 @@ CAmount CWallet::GetAnonymizedBalance() const
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAnonymizedCredit();
         }
+        SetCachedBalance(BALANCE_ANONYMIZED, nTotal);
     }
 
     return nTotal;
@@ -1339,6 +1392,8 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
     if (fLiteMode) return 0;
 
     CAmount nTotal = 0;
+    if (GetCachedBalance(unconfirmed ? BALANCE_DENOMINATED_UNCONFIRMED : BALANCE_DENOMINATED, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1346,6 +1401,7 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 
             nTotal += pcoin->GetDenominatedCredit(unconfirmed);
         }
+        SetCachedBalance(unconfirmed ? BALANCE_DENOMINATED_UNCONFIRMED : BALANCE_DENOMINATED, nTotal);
     }
 
     return nTotal;
@@ -1354,6 +1410,8 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 CAmount CWallet::GetUnconfirmedBalance() const
 {
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_UNCONFIRMED, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1361,6 +1419,7 @@ CAmount CWallet::GetUnconfirmedBalance() const
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
+        SetCachedBalance(BALANCE_UNCONFIRMED, nTotal);
     }
     return nTotal;
 }
@@ -1368,12 +1427,15 @@ CAmount CWallet::GetUnconfirmedBalance() const
 CAmount CWallet::GetImmatureBalance() const
 {
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_IMMATURE, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
             const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
+        SetCachedBalance(BALANCE_IMMATURE, nTotal);
     }
     return nTotal;
 }
@@ -1381,6 +1443,8 @@ CAmount CWallet::GetImmatureBalance() const
 CAmount CWallet::GetWatchOnlyBalance() const
 {
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_WATCHONLY, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1388,6 +1452,7 @@ CAmount CWallet::GetWatchOnlyBalance() const
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_WATCHONLY, nTotal);
     }
 
     return nTotal;
@@ -1396,6 +1461,8 @@ CAmount CWallet::GetWatchOnlyBalance() const
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_WATCHONLY_UNCONFIRMED, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
@@ -1403,6 +1470,7 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_WATCHONLY_UNCONFIRMED, nTotal);
     }
     return nTotal;
 }
@@ -1410,12 +1478,15 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
     CAmount nTotal = 0;
+    if (GetCachedBalance(BALANCE_WATCHONLY_IMMATURE, nTotal))
+        return nTotal;
     {
         LOCK2(cs_main, cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
             const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_WATCHONLY_IMMATURE, nTotal);
     }
     return nTotal;
 }
@@ -1559,10 +1630,75 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
+void CWallet::AddToStakeCandidates(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fStakeCandidatesBuilt)
+        return;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (wtx.vout[i].nValue > 0 && IsMine(wtx.vout[i]) != ISMINE_NO)
+            setStakeCandidates.insert(COutPoint(wtx.GetHash(), i));
+    }
+}
+
+/**
+ * Same as AvailableCoins(vCoins, true) but only looks at the stake candidates
+ * rather than every transaction in the wallet.
+ */
+void CWallet::AvailableStakeCoins(vector<COutput>& vCoins) const
+{
+    vCoins.clear();
+
+    LOCK2(cs_main, cs_wallet);
+    if (!fStakeCandidatesBuilt) {
+        fStakeCandidatesBuilt = true;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddToStakeCandidates(it->second);
+    }
+
+    std::set<COutPoint>::iterator it = setStakeCandidates.begin();
+    while (it != setStakeCandidates.end()) {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->hash);
+        if (mi == mapWallet.end()) {
+            setStakeCandidates.erase(it++);
+            continue;
+        }
+        const CWalletTx* pcoin = &mi->second;
+        const COutPoint& outpoint = *it++;
+
+        if (IsSpent(outpoint.hash, outpoint.n)) {
+            // Forget coins whose spend can no longer be reorganized away
+            pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+            for (TxSpends::const_iterator sit = range.first; sit != range.second; ++sit) {
+                map<uint256, CWalletTx>::const_iterator smi = mapWallet.find(sit->second);
+                if (smi != mapWallet.end() && smi->second.GetDepthInMainChain() > Params().COINBASE_MATURITY()) {
+                    setStakeCandidates.erase(outpoint);
+                    break;
+                }
+            }
+            continue;
+        }
+
+        if (!CheckFinalTx(*pcoin) || !pcoin->IsTrusted())
+            continue;
+        if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+            continue;
+        int nDepth = pcoin->GetDepthInMainChain(false);
+        if (nDepth == 0 && !pcoin->InMempool())
+            continue;
+        if (IsLockedCoin(outpoint.hash, outpoint.n))
+            continue;
+        isminetype mine = IsMine(pcoin->vout[outpoint.n]);
+        if (mine == ISMINE_NO)
+            continue;
+        vCoins.push_back(COutput(pcoin, outpoint.n, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+    }
+}
+
 bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, int64_t nTargetAmount) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
+    AvailableStakeCoins(vCoins);
     int64_t nAmountSelected = 0;
 
     BOOST_FOREACH (const COutput& out, vCoins) {
@@ -1594,7 +1730,7 @@ bool CWallet::MintableCoins()
         return false;
 
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
+    AvailableStakeCoins(vCoins);
 
     BOOST_FOREACH (const COutput& out, vCoins) {
         if (GetTime() - out.tx->GetTxTime() > nStakeMinAge)
@@ -2362,87 +2498,81 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (GetAdjustedTime() <= chainActive.Tip()->nTime)
         MilliSleep(10000);
 
-    BOOST_FOREACH (PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins) {
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = NULL;
-        BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
-        if (it != mapBlockIndex.end())
-            pindex = it->second;
-        else {
-            if (fDebug)
-                LogPrintf("CreateCoinStake() failed to find block index \n");
-            continue;
+    vector<pair<const CWalletTx*, unsigned int> > vStakeCoins;
+    vector<CStakeCandidate> vCandidates;
+    vStakeCoins.reserve(setStakeCoins.size());
+    vCandidates.reserve(setStakeCoins.size());
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH (PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins) {
+            //make sure that enough time has elapsed between
+            BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
+            if (it == mapBlockIndex.end()) {
+                if (fDebug)
+                    LogPrintf("CreateCoinStake() failed to find block index \n");
+                continue;
+            }
+            CStakeCandidate candidate = {it->second, COutPoint(pcoin.first->GetHash(), pcoin.second), pcoin.first->vout[pcoin.second].nValue};
+            vStakeCoins.push_back(pcoin);
+            vCandidates.push_back(candidate);
         }
+    }
 
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
-
-        bool fKernelFound = false;
-        uint256 hashProofOfStake = 0;
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-        nTxNewTime = GetAdjustedTime();
+    // Search all coins for a kernel at once, spread over the -stakethreads threads
+    uint256 hashProofOfStake = 0;
+    nTxNewTime = GetAdjustedTime();
+    int nKernel = SearchStakeKernels(vCandidates, nBits, nTxNewTime, nHashDrift, hashProofOfStake);
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (CheckStakeKernelHash(nBits, block, *pcoin.first, prevoutStake, nTxNewTime, nHashDrift, false, hashProofOfStake, true)) {
-            //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
+    if (nKernel >= 0) {
+        const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vStakeCoins[nKernel];
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : kernel found prevout=%s nTimeTx=%u hashProof=%s\n", vCandidates[nKernel].prevout.ToString(), nTxNewTime, hashProofOfStake.ToString());
 
-            // Found a kernel
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : kernel found\n");
-
-            vector<valtype> vSolutions;
-            txnouttype whichType;
-            CScript scriptPubKeyOut;
-            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-            if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
-                LogPrintf("CreateCoinStake : failed to parse kernel\n");
-                break;
-            }
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
+            LogPrintf("CreateCoinStake : failed to parse kernel\n");
+            return false;
+        }
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH) {
             if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH) {
+                LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false; // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            //convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key)) {
                 if (fDebug && GetBoolArg("-printcoinstake", false))
-                    LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                break; // only support pay to public key and pay to address
+                    LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false; // unable to find corresponding public key
             }
-            if (whichType == TX_PUBKEYHASH) // pay to address type
-            {
-                //convert to pay to public key type
-                CKey key;
-                if (!keystore.GetKey(uint160(vSolutions[0]), key)) {
-                    if (fDebug && GetBoolArg("-printcoinstake", false))
-                        LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                    break; // unable to find corresponding public key
-                }
 
-                scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-            } else
-                scriptPubKeyOut = scriptPubKeyKernel;
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        } else
+            scriptPubKeyOut = scriptPubKeyKernel;
 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
-            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-            //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
-            const CBlockIndex* pIndex0 = chainActive.Tip();
-            uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
+        //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
+        const CBlockIndex* pIndex0 = chainActive.Tip();
+        uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
 
-            //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
-            if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
+        if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
-            fKernelFound = true;
-            break;
-        }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
@@ -3145,6 +3275,8 @@ bool CWallet::UpdatedTransaction(const uint256& hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()) {
+            // Its depth changes with a SwiftTX lock
+            nWalletUpdated++;
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -3156,18 +3288,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    nWalletUpdated++;
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    nWalletUpdated++;
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    nWalletUpdated++;
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
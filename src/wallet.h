@@ -161,6 +161,46 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Outputs of wallet transactions that are ours and not spent deep in the
+     * chain, i.e. every coin that may become stakeable. Built by a full scan on
+     * first use, then extended as transactions are added; outputs spent in a
+     * transaction buried deeper than coinbase maturity are dropped lazily.
+     */
+    mutable std::set<COutPoint> setStakeCandidates;
+    mutable bool fStakeCandidatesBuilt;
+    void AddToStakeCandidates(const CWalletTx& wtx) const;
+    void AvailableStakeCoins(std::vector<COutput>& vCoins) const;
+
+    /**
+     * Balance totals computed by the Get*Balance() functions. nWalletUpdated
+     * is bumped under cs_wallet by every event that can change one: a wallet
+     * transaction added, updated or evicted from the mempool, a new tip, a
+     * completed SwiftTX lock or a change of the locked coins. The totals stay
+     * valid while it and nObfuscationRounds are unchanged; until then a getter
+     * only takes cs_wallet and returns the cached number.
+     */
+    enum BalanceType {
+        BALANCE_TRUSTED,
+        BALANCE_ANONYMIZABLE,
+        BALANCE_ANONYMIZED,
+        BALANCE_DENOMINATED,
+        BALANCE_DENOMINATED_UNCONFIRMED,
+        BALANCE_UNCONFIRMED,
+        BALANCE_IMMATURE,
+        BALANCE_WATCHONLY,
+        BALANCE_WATCHONLY_UNCONFIRMED,
+        BALANCE_WATCHONLY_IMMATURE,
+        BALANCE_TYPES
+    };
+    unsigned int nWalletUpdated;
+    mutable CAmount nCachedBalance[BALANCE_TYPES];
+    mutable bool fCachedBalance[BALANCE_TYPES];
+    mutable unsigned int nCachedBalanceWallet;
+    mutable int nCachedBalanceRounds;
+    bool GetCachedBalance(BalanceType type, CAmount& nBalance) const;
+    void SetCachedBalance(BalanceType type, CAmount nBalance) const;
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, int64_t nTargetAmount) const;
@@ -242,6 +282,12 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fStakeCandidatesBuilt = false;
+        nWalletUpdated = 0;
+        nCachedBalanceWallet = 0;
+        nCachedBalanceRounds = 0;
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            fCachedBalance[i] = false;
 
         // Stake Settings
         nHashDrift = 45;
@@ -380,6 +426,7 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void UpdatedBlockTip(const CBlockIndex* pindex, bool fInitialDownload);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);